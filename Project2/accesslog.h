@@ -0,0 +1,232 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Access log, per-thread rings drained to a file by a background thread
+
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "arena.h"
+
+#define LOG_RING_SIZE 4096 // Records each thread can have waiting, power of 2
+#define LOG_URI_MAX 88 // URI bytes kept, longer ones are cut
+#define LOG_IDLE_MS 10 // Writer's nap when every ring was empty
+#define LOG_BUF_SIZE (256 * 1024) // Text formatted per writev
+
+// One request, fixed size so a ring is a flat array and pushing is a copy
+struct LogRecord {
+    uint64_t time_us; // Wall clock when it was answered
+    uint64_t bytes; // Response size, headers and body
+    uint32_t latency_us; // Request read to response ready
+    uint32_t ip; // Client, host order
+    uint16_t status;
+    uint8_t uri_len;
+    char method[9]; // Cut to 8, NUL terminated
+    char uri[LOG_URI_MAX];
+};
+static_assert(sizeof(LogRecord) == 128, "LogRecord should be two cache lines");
+
+// Single producer single consumer ring, one per thread that logs
+// The owner thread pushes, only the writer thread pops
+struct LogRing {
+    alignas(64) std::atomic<uint64_t> head{0}; // Next to pop, writer owns it
+    alignas(64) std::atomic<uint64_t> tail{0}; // Next to push, owner owns it
+    LogRecord records[LOG_RING_SIZE];
+
+    bool push(const LogRecord &r){
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == LOG_RING_SIZE) return false;
+        records[t & (LOG_RING_SIZE - 1)] = r;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+// Async access log
+// A request only copies its record into its thread's ring, no lock and no syscall. The
+// writer thread formats whatever is waiting and hands it to the file with writev, so
+// workers never wait on the disk or on each other. A full ring drops the record and
+// counts it rather than slowing the request down.
+class AccessLog {
+public:
+    std::atomic<uint64_t> written{0}; // Records that made it to the file
+    std::atomic<uint64_t> dropped{0}; // Records lost to a full ring
+
+    // Log to path ("-" is stdout), one request in every sample
+    bool open(const std::string &path, unsigned every){
+        sample = every;
+        if (path == "-"){
+            fd = STDOUT_FILENO;
+        }
+        else{
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd < 0) return false;
+        }
+        std::thread([this]{ run(); }).detach(); // Lives as long as the server
+        return true;
+    }
+
+    bool enabled() const { return fd >= 0 && sample > 0; }
+
+    // Should this request be logged, every sample-th one per thread is
+    bool sampled(){
+        if (!enabled()) return false;
+        thread_local unsigned n = 0;
+        if (++n < sample) return false;
+        n = 0;
+        return true;
+    }
+
+    // Queue a record from the current thread
+    void log(std::string_view method, std::string_view uri, uint32_t ip, int status,
+             uint64_t bytes, uint64_t latency_us){
+        LogRecord r;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        r.time_us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        r.bytes = bytes;
+        r.latency_us = (uint32_t)std::min<uint64_t>(latency_us, UINT32_MAX);
+        r.ip = ip;
+        r.status = (uint16_t)status;
+        size_t m = std::min(method.size(), sizeof(r.method) - 1);
+        memcpy(r.method, method.data(), m);
+        r.method[m] = '\0';
+        r.uri_len = (uint8_t)std::min(uri.size(), (size_t)LOG_URI_MAX);
+        memcpy(r.uri, uri.data(), r.uri_len);
+        if (!ring()->push(r)) count(dropped);
+    }
+
+private:
+    // This thread's ring, made and registered the first time it logs
+    LogRing *ring(){
+        thread_local LogRing *mine = nullptr;
+        if (!mine){
+            mine = new LogRing();
+            std::lock_guard<std::mutex> lk(mutex);
+            rings.push_back(mine);
+        }
+        return mine;
+    }
+
+    // Writer thread, drains every ring in turn
+    void run(){
+        char *buf = new char[LOG_BUF_SIZE];
+        std::vector<LogRing *> seen;
+        while (true){
+            {
+                std::lock_guard<std::mutex> lk(mutex);
+                seen = rings;
+            }
+            size_t used = 0;
+            int cnt = 0;
+            struct iovec iov[IOV_MAX];
+            uint64_t done = 0;
+            // One iovec per ring's stretch of lines
+            for (LogRing *r : seen){
+                uint64_t h = r->head.load(std::memory_order_relaxed);
+                uint64_t t = r->tail.load(std::memory_order_acquire);
+                char *start = buf + used;
+                for (; h < t; ++h){
+                    if (LOG_BUF_SIZE - used < MAX_LINE || cnt == IOV_MAX) break;
+                    used += format(r->records[h & (LOG_RING_SIZE - 1)], buf + used);
+                    ++done;
+                }
+                r->head.store(h, std::memory_order_release); // Formatted, the slots can be reused
+                if (buf + used > start){
+                    iov[cnt].iov_base = start;
+                    iov[cnt].iov_len = buf + used - start;
+                    ++cnt;
+                }
+            }
+            if (cnt > 0){
+                write_all(iov, cnt);
+                count(written, done);
+            }
+            // Nothing was waiting, nap instead of spinning
+            if (done == 0) std::this_thread::sleep_for(std::chrono::milliseconds(LOG_IDLE_MS));
+        }
+    }
+
+    // A short write moves the iovecs along and goes again
+    void write_all(struct iovec *iov, int cnt){
+        while (cnt > 0){
+            ssize_t n = writev(fd, iov, cnt);
+            if (n < 0){
+                if (errno == EINTR) continue;
+                return; // Disk full or stdout closed, nothing to be done
+            }
+            while (cnt > 0 && (size_t)n >= iov->iov_len){
+                n -= iov->iov_len;
+                ++iov;
+                --cnt;
+            }
+            if (cnt > 0){
+                iov->iov_base = (char *)iov->iov_base + n;
+                iov->iov_len -= n;
+            }
+        }
+    }
+
+    static const size_t MAX_LINE = 4 * (LOG_URI_MAX + 8) + 128; // Every URI and method byte escaped plus the rest
+
+    // Control characters and quotes are escaped so a client can't fake a line
+    static char *escape(const char *s, size_t n, char *p){
+        for (size_t i = 0; i < n; ++i){
+            unsigned char ch = s[i];
+            if (ch < 0x20 || ch >= 0x7f || ch == '"' || ch == '\\') p += sprintf(p, "\\x%02x", ch);
+            else *p++ = ch;
+        }
+        return p;
+    }
+
+    // 127.0.0.1 [17/Oct/2026:10:00:00.123 +0000] "GET /uri" 200 1234 56us
+    size_t format(const LogRecord &r, char *out){
+        char *p = out;
+        uint32_t ip = htonl(r.ip);
+        if (!inet_ntop(AF_INET, &ip, p, INET_ADDRSTRLEN)) strcpy(p, "?");
+        p += strlen(p);
+        time_t sec = r.time_us / 1000000;
+        if (sec != date_sec){
+            // Same second as the last line most of the time
+            struct tm tm;
+            gmtime_r(&sec, &tm);
+            strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S", &tm);
+            date_sec = sec;
+        }
+        p += sprintf(p, " [%s.%03u +0000] \"", date, (unsigned)(r.time_us / 1000 % 1000));
+        p = escape(r.method, strlen(r.method), p);
+        *p++ = ' ';
+        p = escape(r.uri, r.uri_len, p);
+        p += sprintf(p, "\" %u %llu %uus\n", (unsigned)r.status, (unsigned long long)r.bytes, (unsigned)r.latency_us);
+        return p - out;
+    }
+
+    int fd = -1;
+    unsigned sample = 0;
+    std::mutex mutex; // Protect rings
+    std::vector<LogRing *> rings; // Every thread's, never freed since the threads never end
+    time_t date_sec = 0; // Writer thread only
+    char date[32];
+};
+inline AccessLog access_log;
+
+#endif
@@ -0,0 +1,139 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Admission control, connection caps at accept and CoDel shedding on the worker queue
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <math.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "arena.h"
+
+#define IP_BUCKETS 65536 // Per-address connection counters, addresses hash into these
+
+// What got turned away and why, shown on /stats
+struct AdmissionStats {
+    std::atomic<uint64_t> shed_conns{0}; // Over the open connection cap at accept
+    std::atomic<uint64_t> shed_ip{0}; // Over the per-address cap at accept
+    std::atomic<uint64_t> shed_queue{0}; // Worker queue too deep
+    std::atomic<uint64_t> shed_codel{0}; // Waited in the queue too long
+};
+inline AdmissionStats admission_stats;
+
+// Why a connection was or wasn't let in
+enum Admit {
+    ADMIT_OK,
+    ADMIT_FULL, // Too many open connections
+    ADMIT_IP // Too many from this address
+};
+
+// Open connection counts shared by every event loop
+// Addresses hash into a fixed table of counters, so there is nothing to allocate or lock;
+// two addresses that share a bucket share a cap, which with 64K buckets is rare and only
+// ever errs toward turning someone away early.
+class Admission {
+public:
+    // 0 for either turns that cap off
+    void set_limits(size_t conns, size_t per_ip){
+        max_conns = conns;
+        max_per_ip = per_ip;
+    }
+
+    // A connection from ip was accepted, counts it if it can stay
+    Admit admit(uint32_t ip){
+        size_t n = open.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (max_conns && n > max_conns){
+            open.fetch_sub(1, std::memory_order_relaxed);
+            count(admission_stats.shed_conns);
+            return ADMIT_FULL;
+        }
+        std::atomic<uint32_t> &b = buckets[bucket(ip)];
+        uint32_t m = b.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (max_per_ip && m > max_per_ip){
+            b.fetch_sub(1, std::memory_order_relaxed);
+            open.fetch_sub(1, std::memory_order_relaxed);
+            count(admission_stats.shed_ip);
+            return ADMIT_IP;
+        }
+        return ADMIT_OK;
+    }
+
+    // An admitted connection from ip closed
+    void leave(uint32_t ip){
+        buckets[bucket(ip)].fetch_sub(1, std::memory_order_relaxed);
+        open.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    size_t connections() const { return open.load(std::memory_order_relaxed); }
+
+private:
+    static size_t bucket(uint32_t ip){
+        return (ip * 2654435761u) >> 16; // Fibonacci hash, top 16 bits
+    }
+
+    size_t max_conns = 0;
+    size_t max_per_ip = 0;
+    alignas(64) std::atomic<size_t> open{0};
+    std::atomic<uint32_t> buckets[IP_BUCKETS] = {};
+};
+inline Admission admission;
+
+// CoDel, shed by how long work waited instead of how much is waiting
+// A deep queue that drains fast is fine, one where even the quickest task waited over target
+// for a whole interval is a standing backlog. Then tasks are shed at interval / sqrt(drops),
+// more often the longer it lasts, until a task gets through under target again.
+// Each worker runs its own copy on the tasks it takes, so there is nothing shared to lock.
+// https://queue.acm.org/detail.cfm?id=2209336 and RFC 8289
+class CoDel {
+public:
+    // Task that waited sojourn_us is about to run at now_us, true to shed it
+    bool should_drop(uint64_t now_us, uint64_t sojourn_us, uint64_t target_us, uint64_t interval_us){
+        bool ok_to_drop = false;
+        if (sojourn_us < target_us){
+            first_above = 0; // Queue got through, no backlog
+        }
+        else if (first_above == 0){
+            first_above = now_us + interval_us; // Give it an interval to drain
+        }
+        else if (now_us >= first_above){
+            ok_to_drop = true;
+        }
+
+        if (dropping){
+            if (!ok_to_drop){
+                dropping = false;
+                return false;
+            }
+            if (now_us >= drop_next){
+                ++drops;
+                drop_next = control_law(drop_next, interval_us);
+                return true;
+            }
+            return false;
+        }
+        if (ok_to_drop){
+            // Coming straight back into a backlog starts near the old drop rate
+            dropping = true;
+            drops = (drops > 2 && now_us - drop_next < 8 * interval_us) ? drops - 2 : 1;
+            drop_next = control_law(now_us, interval_us);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    uint64_t control_law(uint64_t t, uint64_t interval_us) const {
+        return t + (uint64_t)(interval_us / sqrt((double)drops));
+    }
+
+    uint64_t first_above = 0; // When sojourn has been over target for an interval
+    uint64_t drop_next = 0; // Next shed while dropping
+    uint32_t drops = 0; // Sheds this dropping period
+    bool dropping = false;
+};
+
+#endif
@@ -0,0 +1,281 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Pooled buffers and per-connection arenas for request-scoped memory
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <sys/mman.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string_view>
+
+#define BLOCK_SIZE 16384 // Size of every pooled block
+#define MAX_POOLED_BLOCKS 8192 // Blocks kept on the free list, extra ones go back to malloc
+
+// Allocation counters
+// Relaxed atomics, they only move when something actually allocates
+struct AllocStats {
+    std::atomic<uint64_t> heap_allocs{0}; // operator new calls
+    std::atomic<uint64_t> heap_frees{0}; // operator delete calls
+    std::atomic<uint64_t> block_acquires{0}; // Blocks handed out by the pool
+    std::atomic<uint64_t> block_mallocs{0}; // ...that the free list couldn't cover
+    std::atomic<uint64_t> block_releases{0}; // Blocks given back
+    std::atomic<uint64_t> big_mallocs{0}; // Buffers too big for one block
+    std::atomic<uint64_t> arena_allocs{0}; // Bump allocations
+    std::atomic<uint64_t> arena_bytes{0}; // Bytes bumped
+    std::atomic<uint64_t> arena_resets{0}; // Arena resets between requests
+};
+inline AllocStats alloc_stats;
+
+static inline void count(std::atomic<uint64_t> &c, uint64_t n = 1){
+    c.fetch_add(n, std::memory_order_relaxed);
+}
+
+// Free list of BLOCK_SIZE blocks shared by the event loops and workers
+// A connection takes blocks when it starts reading and gives them back when it goes idle,
+// so after warm-up nothing on the request path reaches malloc.
+class BlockPool {
+public:
+    // Carve n blocks out of one mapping up front, call before any threads start
+    // The io_uring loops register the whole slab once and send from it as a fixed buffer
+    bool reserve(size_t n){
+        void *p = mmap(nullptr, n * BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return false;
+        slab_base = (char *)p;
+        slab_len = n * BLOCK_SIZE;
+        std::lock_guard<std::mutex> lk(mutex);
+        for (size_t i = n; i-- > 0;){
+            FreeBlock *b = (FreeBlock *)(slab_base + i * BLOCK_SIZE);
+            b->next = head;
+            head = b;
+            ++cached;
+        }
+        return true;
+    }
+
+    // [p, p + n) is inside the slab
+    bool in_slab(const void *p, size_t n) const {
+        const char *c = (const char *)p;
+        return c >= slab_base && c + n <= slab_base + slab_len;
+    }
+    char *slab() const { return slab_base; }
+    size_t slab_size() const { return slab_len; }
+
+    void *acquire(){
+        count(alloc_stats.block_acquires);
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            if (head){
+                FreeBlock *b = head;
+                head = b->next;
+                --cached;
+                return b;
+            }
+        }
+        count(alloc_stats.block_mallocs);
+        return malloc(BLOCK_SIZE);
+    }
+
+    void release(void *p){
+        if (!p) return;
+        count(alloc_stats.block_releases);
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            // Slab blocks always go back, they were never malloc'd
+            if (cached < MAX_POOLED_BLOCKS || in_slab(p, 1)){
+                FreeBlock *b = (FreeBlock *)p;
+                b->next = head;
+                head = b;
+                ++cached;
+                return;
+            }
+        }
+        free(p);
+    }
+
+    // Blocks sitting on the free list
+    size_t size(){
+        std::lock_guard<std::mutex> lk(mutex);
+        return cached;
+    }
+
+private:
+    struct FreeBlock { FreeBlock *next; };
+    std::mutex mutex; // Protect the list
+    FreeBlock *head = nullptr;
+    size_t cached = 0;
+    char *slab_base = nullptr; // reserve()'d blocks, never freed
+    size_t slab_len = 0;
+};
+inline BlockPool block_pool;
+
+// Growable byte buffer
+// Starts on one pooled block and only falls back to malloc when it outgrows it
+class Buffer {
+public:
+    Buffer() {}
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+    ~Buffer(){ release(); }
+
+    char *data() { return ptr; }
+    const char *data() const { return ptr; }
+    size_t size() const { return len; }
+    size_t capacity() const { return cap; }
+    bool empty() const { return len == 0; }
+    std::string_view view() const { return std::string_view(ptr, len); }
+
+    // Make sure n more bytes fit, false if memory ran out
+    bool reserve(size_t n){
+        if (len + n <= cap) return true;
+        if (!ptr && len + n <= BLOCK_SIZE){
+            ptr = (char *)block_pool.acquire();
+            if (!ptr) return false;
+            cap = BLOCK_SIZE;
+            return true;
+        }
+        size_t want = std::max(len + n, cap * 2);
+        char *bigger = (char *)malloc(want);
+        if (!bigger) return false;
+        count(alloc_stats.big_mallocs);
+        if (len) memcpy(bigger, ptr, len);
+        drop();
+        ptr = bigger;
+        cap = want;
+        return true;
+    }
+
+    // Out of memory aborts, dropping the bytes would leave a response short of the
+    // Content-Length already written. Callers that can back out use reserve() first.
+    void append(const char *p, size_t n){
+        if (n == 0) return; // p can be null for an empty view
+        if (!reserve(n)) abort();
+        memcpy(ptr + len, p, n);
+        len += n;
+    }
+    void append(std::string_view s){ append(s.data(), s.size()); }
+    void push_back(char ch){
+        if (!reserve(1)) abort();
+        ptr[len++] = ch;
+    }
+
+    // Room to write into directly, follow with commit(n)
+    char *tail(){ return ptr + len; }
+    void commit(size_t n){ len += n; }
+    void resize(size_t n){ len = n; }
+
+    // Empty but keep the memory
+    void clear(){ len = 0; }
+
+    // Hand the memory back to the pool
+    void release(){
+        drop();
+        ptr = nullptr;
+        len = cap = 0;
+    }
+
+private:
+    void drop(){
+        if (!ptr) return;
+        if (cap == BLOCK_SIZE) block_pool.release(ptr);
+        else free(ptr);
+    }
+
+    char *ptr = nullptr;
+    size_t len = 0;
+    size_t cap = 0;
+};
+
+// Bump allocator for memory that only lives as long as one request
+// alloc() moves a pointer forward, reset() moves it back to the start, both O(1).
+// Blocks come from the block pool; anything past the first is returned on reset.
+class Arena {
+public:
+    Arena() {}
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+    ~Arena(){ release(); }
+
+    void *alloc(size_t n, size_t align = alignof(std::max_align_t)){
+        count(alloc_stats.arena_allocs);
+        count(alloc_stats.arena_bytes, n);
+        size_t at = (used + align - 1) & ~(align - 1);
+        if (!block || at + n > limit){
+            if (!grow(n + align)) return nullptr;
+            at = (used + align - 1) & ~(align - 1);
+        }
+        used = at + n;
+        return block->bytes + at;
+    }
+
+    char *alloc_chars(size_t n){ return (char *)alloc(n, 1); }
+
+    // Everything allocated since the last reset is gone, the first block stays
+    void reset(){
+        if (!block) return;
+        count(alloc_stats.arena_resets);
+        while (block->prev){
+            Block *prev = block->prev;
+            free_block(block);
+            block = prev;
+        }
+        used = 0;
+        limit = block->size;
+    }
+
+    // Give every block back
+    void release(){
+        while (block){
+            Block *prev = block->prev;
+            free_block(block);
+            block = prev;
+        }
+        used = limit = 0;
+    }
+
+private:
+    struct Block {
+        Block *prev; // Older block
+        size_t size; // Usable bytes
+        alignas(std::max_align_t) char bytes[1];
+    };
+
+    bool grow(size_t n){
+        size_t header = offsetof(Block, bytes);
+        Block *b;
+        if (n + header <= BLOCK_SIZE){
+            b = (Block *)block_pool.acquire();
+            if (!b) return false;
+            b->size = BLOCK_SIZE - header;
+        }
+        else{
+            b = (Block *)malloc(n + header);
+            if (!b) return false;
+            count(alloc_stats.big_mallocs);
+            b->size = n;
+        }
+        b->prev = block;
+        block = b;
+        used = 0;
+        limit = b->size;
+        return true;
+    }
+
+    static void free_block(Block *b){
+        if (b->size == BLOCK_SIZE - offsetof(Block, bytes)) block_pool.release(b);
+        else free(b);
+    }
+
+    Block *block = nullptr; // Newest block
+    size_t used = 0; // Bytes used in it
+    size_t limit = 0; // Its size
+};
+
+#endif
@@ -0,0 +1,133 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Coroutine type for handlers that wait on the event loop instead of a thread
+
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <new>
+#include <utility>
+#include "arena.h"
+
+// Where a coroutine's frame goes, found among its arguments
+// Anything that carries an arena gets an overload, everything else says none and the frame
+// comes from malloc. Looked up when the coroutine is instantiated so later overloads count.
+template <typename A>
+inline Arena *frame_arena(const A &){ return nullptr; }
+inline Arena *frame_arena(Arena &arena){ return &arena; }
+
+// Parts of the promise that don't depend on the result type
+struct AsyncPromiseBase {
+    std::coroutine_handle<> continuation; // Whoever co_awaits this, null for the outermost one
+
+    // Frames start with a header saying where they came from so delete knows what to do
+    struct FrameHeader {
+        bool heap;
+    };
+    static constexpr size_t HEADER = alignof(std::max_align_t);
+    static_assert(sizeof(FrameHeader) <= HEADER, "frame header has to fit before the frame");
+
+    // Frame in the first argument's arena if it has one, it's gone when the arena resets
+    template <typename... Args>
+    static void *operator new(size_t n, Args &...args) noexcept {
+        Arena *arena = nullptr;
+        ((arena = arena ? arena : frame_arena(args)), ...);
+        char *p = arena ? (char *)arena->alloc(n + HEADER) : (char *)malloc(n + HEADER);
+        if (!p) return nullptr;
+        ((FrameHeader *)p)->heap = !arena;
+        return p + HEADER;
+    }
+    static void operator delete(void *frame, size_t){
+        char *p = (char *)frame - HEADER;
+        if (((FrameHeader *)p)->heap) free(p);
+    }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    // Done, carry on in whoever was waiting for it without growing the stack
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+            std::coroutine_handle<> next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    // Handlers report errors in the response, same as the plain ones
+    void unhandled_exception(){ std::terminate(); }
+};
+
+template <typename T>
+struct AsyncPromise : AsyncPromiseBase {
+    T value{};
+    void return_value(T v){ value = std::move(v); }
+    T take(){ return std::move(value); }
+};
+
+template <>
+struct AsyncPromise<void> : AsyncPromiseBase {
+    void return_void(){}
+    void take(){}
+};
+
+// A coroutine that produces a T
+// Lazy: nothing runs until it's co_awaited or start() is called. Awaiting one runs it right
+// away on the same thread and comes back when it finishes, however many times it suspended
+// in between. The Async owns the frame, dropping it destroys a suspended coroutine and
+// everything it was awaiting. A null Async means the frame couldn't be allocated.
+template <typename T = void>
+class Async {
+public:
+    struct promise_type : AsyncPromise<T> {
+        Async get_return_object(){
+            return Async(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        static Async get_return_object_on_allocation_failure(){ return Async(); }
+    };
+
+    Async() {}
+    Async(Async &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Async &operator=(Async &&other) noexcept {
+        if (this != &other){
+            if (handle) handle.destroy();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    Async(const Async &) = delete;
+    Async &operator=(const Async &) = delete;
+    ~Async(){
+        if (handle) handle.destroy();
+    }
+
+    explicit operator bool() const { return (bool)handle; }
+    bool done() const { return handle.done(); }
+
+    // Run the outermost one until it first suspends or finishes
+    void start(){ handle.resume(); }
+
+    // Result once done()
+    T result(){ return handle.promise().take(); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+    T await_resume(){ return handle.promise().take(); }
+
+private:
+    explicit Async(std::coroutine_handle<promise_type> h) : handle(h) {}
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+#endif
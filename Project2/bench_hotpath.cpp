@@ -0,0 +1,288 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Microbenchmarks for the request hot path
+// Parsing, form decoding, writing responses and handing work to the pool, one at a time
+// over requests shaped like real traffic. Each one reports heap allocations and bytes per op
+// next to ns/op, so a parser or allocator change comes with numbers.
+
+#include <benchmark/benchmark.h>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "arena.h"
+#include "httpparser.h"
+#include "multiply.h"
+#include "response.h"
+#include "threadpool.h"
+
+// Heap bytes asked for, next to the call count arena.h keeps
+static std::atomic<uint64_t> heap_bytes{0};
+
+// Same counting operator new as the server, plus sizes
+__attribute__((noinline)) void *operator new(size_t n){
+    count(alloc_stats.heap_allocs);
+    count(heap_bytes, n);
+    void *p = malloc(n ? n : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    if (p) count(alloc_stats.heap_frees);
+    free(p);
+}
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+    if (p) count(alloc_stats.heap_frees);
+    free(p);
+}
+
+// Heap and arena use over the timed loop, reported per op when it goes out of scope
+// Declare it right before the loop so setup isn't counted
+class AllocCounter {
+public:
+    AllocCounter(benchmark::State &state)
+        : state(state), allocs(alloc_stats.heap_allocs.load()), bytes(heap_bytes.load()),
+          arena(alloc_stats.arena_bytes.load()) {}
+
+    ~AllocCounter(){
+        using benchmark::Counter;
+        state.counters["allocs/op"] = Counter(alloc_stats.heap_allocs.load() - allocs, Counter::kAvgIterations);
+        state.counters["bytes/op"] = Counter(heap_bytes.load() - bytes, Counter::kAvgIterations);
+        state.counters["arena/op"] = Counter(alloc_stats.arena_bytes.load() - arena, Counter::kAvgIterations);
+    }
+
+private:
+    benchmark::State &state;
+    uint64_t allocs, bytes, arena;
+};
+
+// Request corpora
+
+static std::string small_get(){
+    return "GET /index.html HTTP/1.1\r\nHost: localhost:8080\r\n\r\n";
+}
+
+// What a browser sends for a page, cookies and all
+static std::string header_heavy(){
+    return "GET /static/app.js?v=20241017 HTTP/1.1\r\n"
+           "Host: localhost:8080\r\n"
+           "Connection: keep-alive\r\n"
+           "sec-ch-ua: \"Chromium\";v=\"129\", \"Not=A?Brand\";v=\"8\"\r\n"
+           "sec-ch-ua-mobile: ?0\r\n"
+           "sec-ch-ua-platform: \"Linux\"\r\n"
+           "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+           "Chrome/129.0.0.0 Safari/537.36\r\n"
+           "Accept: */*\r\n"
+           "Sec-Fetch-Site: same-origin\r\n"
+           "Sec-Fetch-Mode: no-cors\r\n"
+           "Sec-Fetch-Dest: script\r\n"
+           "Referer: http://localhost:8080/index.html\r\n"
+           "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+           "Accept-Language: en-US,en;q=0.9\r\n"
+           "If-None-Match: \"0000000067100a3b-0000000000004a21\"\r\n"
+           "If-Modified-Since: Wed, 16 Oct 2024 18:42:03 GMT\r\n"
+           "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; _ga=GA1.1.1234567890.1729100000; "
+           "_gid=GA1.1.987654321.1729100000; consent=necessary%2Canalytics\r\n"
+           "\r\n";
+}
+
+// As many fields as a form keeps, long values with nothing to decode
+static std::string large_form_body(){
+    std::string body;
+    for (int i = 0; i < MAX_FORM_FIELDS; ++i){
+        if (i) body += '&';
+        body += "field" + std::to_string(i) + "=";
+        for (int k = 0; k < 2000; ++k) body += (char)('a' + (i + k) % 26);
+    }
+    return body;
+}
+
+// Same shape, but every value is mostly escapes and plus signs
+static std::string percent_body(){
+    std::string body;
+    for (int i = 0; i < MAX_FORM_FIELDS; ++i){
+        if (i) body += '&';
+        body += "f%5B" + std::to_string(i) + "%5D=";
+        for (int k = 0; k < 100; ++k) body += "%E2%9C%93+caf%C3%A9%20";
+    }
+    return body;
+}
+
+static std::string post(const std::string &body){
+    return "POST /multiply HTTP/1.1\r\nHost: localhost:8080\r\n"
+           "Content-Type: application/x-www-form-urlencoded\r\n"
+           "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+static std::string large_form(){ return post(large_form_body()); }
+static std::string percent_form(){ return post(percent_body()); }
+
+// parse_request: the head, then the body into the buffer the way the event loop does it
+static void BM_Parse(benchmark::State &state, std::string (*corpus)()){
+    std::string req = corpus();
+    RequestLimits limits;
+    HttpParser parser;
+    HttpRequest parsed;
+    AllocCounter counter(state);
+    for (auto _ : state){
+        parser.reset();
+        size_t len = req.size();
+        ParseStatus st = parser.parse(req.data(), len, parsed, limits);
+        if (st == PARSE_HEAD){
+            parser.start_body(nullptr, nullptr, limits.body);
+            st = parser.parse(req.data(), len, parsed, limits);
+        }
+        if (st != PARSE_DONE) state.SkipWithError("didn't parse");
+        benchmark::DoNotOptimize(parsed);
+    }
+    state.SetBytesProcessed(state.iterations() * req.size());
+}
+BENCHMARK_CAPTURE(BM_Parse, small_get, small_get);
+BENCHMARK_CAPTURE(BM_Parse, header_heavy, header_heavy);
+BENCHMARK_CAPTURE(BM_Parse, large_form, large_form);
+BENCHMARK_CAPTURE(BM_Parse, percent_form, percent_form);
+
+// One value decoded, plain text and escape-heavy text
+static void BM_UrlDecode(benchmark::State &state, std::string (*corpus)()){
+    std::string body = corpus();
+    std::string_view value(body);
+    value = value.substr(value.find('=') + 1, value.find('&') - value.find('=') - 1);
+    std::string dst(value.size(), '\0');
+    AllocCounter counter(state);
+    for (auto _ : state){
+        std::string_view out = url_decode(value, dst.data());
+        benchmark::DoNotOptimize(out);
+    }
+    state.SetBytesProcessed(state.iterations() * value.size());
+}
+BENCHMARK_CAPTURE(BM_UrlDecode, plain, large_form_body);
+BENCHMARK_CAPTURE(BM_UrlDecode, percent, percent_body);
+
+// parse_POST: the whole body split and decoded into the request arena
+static void BM_ParseForm(benchmark::State &state, std::string (*corpus)()){
+    std::string body = corpus();
+    Arena arena;
+    FormFields form;
+    AllocCounter counter(state);
+    for (auto _ : state){
+        arena.reset();
+        if (!parse_form(body, arena, form)) state.SkipWithError("didn't parse");
+        benchmark::DoNotOptimize(form);
+    }
+    state.SetBytesProcessed(state.iterations() * body.size());
+}
+BENCHMARK_CAPTURE(BM_ParseForm, multiply, +[]{ return std::string("a=6&b=7"); });
+BENCHMARK_CAPTURE(BM_ParseForm, large_form, large_form_body);
+BENCHMARK_CAPTURE(BM_ParseForm, percent_form, percent_body);
+
+// send_response for a body of range(0) bytes, identity or gzip when range(1) is set
+static void BM_SendResponse(benchmark::State &state){
+    std::string body;
+    for (int64_t i = 0; i < state.range(0); ++i) body += "Hello from Allison's server :)\n"[i % 31];
+    Encoding enc = state.range(1) ? ENC_GZIP : ENC_IDENTITY;
+    OutQueue out;
+    Arena arena;
+    AllocCounter counter(state);
+    for (auto _ : state){
+        out.clear();
+        arena.reset();
+        Reply reply{out, arena, true, enc};
+        send_response(reply, 200, "OK", "text/html", body);
+        benchmark::DoNotOptimize(out.size());
+    }
+    state.SetBytesProcessed(state.iterations() * body.size());
+}
+BENCHMARK(BM_SendResponse)->ArgNames({"bytes", "gzip"})->Args({42, 0})->Args({4096, 0})->Args({4096, 1})->Args({65536, 0});
+
+// The responses that never change, copied out of the cache
+static void BM_CachedResponse(benchmark::State &state){
+    OutQueue out;
+    Arena arena;
+    AllocCounter counter(state);
+    for (auto _ : state){
+        out.clear();
+        Reply reply{out, arena, true, ENC_IDENTITY};
+        responses.append(reply, RESP_INDEX);
+        benchmark::DoNotOptimize(out.size());
+    }
+}
+BENCHMARK(BM_CachedResponse);
+
+// ThreadPool::enqueue from outside the pool, the way the event loop hands off a batch
+static std::atomic<uint64_t> tasks_run{0};
+static void count_task(void *){ tasks_run.fetch_add(1, std::memory_order_relaxed); }
+
+static void BM_Enqueue(benchmark::State &state){
+    ThreadPool pool(state.range(0));
+    uint64_t before = tasks_run.load();
+    AllocCounter counter(state);
+    for (auto _ : state){
+        pool.enqueue(Task{count_task, nullptr});
+    }
+    // Let them all finish so the next run starts with an empty pool
+    while (tasks_run.load() - before < (uint64_t)state.iterations()) std::this_thread::yield();
+}
+BENCHMARK(BM_Enqueue)->ArgName("workers")->Arg(1)->Arg(4)->UseRealTime();
+
+// The /multiply/batch kernels over range(0) pairs, all fitting in int32 or
+// one in sixteen that doesn't and has to be redone in scalar when range(1) is set
+static void BM_MultiplyPairs(benchmark::State &state, multiply_pairs_fn kernel){
+    size_t n = state.range(0);
+    std::vector<int64_t> pairs(2 * n);
+    for (size_t i = 0; i < 2 * n; ++i){
+        pairs[i] = (int64_t)(i * 2654435761u % 200000) - 100000;
+        if (state.range(1) && i % 32 == 0) pairs[i] <<= 32;
+    }
+    std::vector<Product> out(n);
+    for (auto _ : state){
+        kernel((const char *)pairs.data(), out.data(), n);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK_CAPTURE(BM_MultiplyPairs, scalar, multiply_pairs_scalar)->ArgNames({"pairs", "wide"})->ArgsProduct({{64, 4096}, {0, 1}});
+
+// format_product has to write exactly product_text_len bytes, route_multiply_batch sends that
+// as the Content-Length. Checked around where it switches how it writes, both signs.
+static bool check_product_text(){
+    const Product two63 = (Product)1 << 63, two64 = (Product)1 << 64, ten19 = (Product)TEN19;
+    const Product edges[] = {0, 9, 10, two63 - 1, two63, two63 + 1, ten19 - 1, ten19, ten19 + 1,
+                             two64 - 1, two64, two64 + 1, (Product)INT64_MIN * INT64_MIN};
+    bool ok = true;
+    for (Product e : edges){
+        for (Product p : {e, -e}){
+            char buf[PRODUCT_TEXT_MAX];
+            size_t len = format_product(buf, p) - buf;
+            bool leading_zero = buf[p < 0] == '0' && len > (size_t)(p < 0) + 1;
+            if (len != product_text_len(p) || leading_zero){
+                fprintf(stderr, "format_product wrote %.*s, %zu bytes, product_text_len says %zu\n",
+                        (int)len, buf, len, product_text_len(p));
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char **argv){
+    responses.build();
+    if (!check_product_text()) return 1;
+    // The vector kernels only on CPUs that have them, same check as pick_multiply_pairs
+    if (__builtin_cpu_supports("avx2")){
+        benchmark::RegisterBenchmark("BM_MultiplyPairs/avx2", BM_MultiplyPairs, multiply_pairs_avx2)
+            ->ArgNames({"pairs", "wide"})->ArgsProduct({{64, 4096}, {0, 1}});
+    }
+    if (__builtin_cpu_supports("avx512f")){
+        benchmark::RegisterBenchmark("BM_MultiplyPairs/avx512", BM_MultiplyPairs, multiply_pairs_avx512)
+            ->ArgNames({"pairs", "wide"})->ArgsProduct({{64, 4096}, {0, 1}});
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,163 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Microbenchmark for the worker pool
+// Runs the same load through the work-stealing ThreadPool and the old mutex + condvar queue
+
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "threadpool.h"
+
+// The pool the server used before, one std::queue behind one mutex
+// Kept here as the baseline
+class MutexThreadPool {
+public:
+    MutexThreadPool(size_t n) : stop_flag(false){
+        for (size_t i = 0; i < n; ++i) {
+            workers.emplace_back([this] {this->worker_loop();});
+        }
+    }
+
+    ~MutexThreadPool() {
+        {
+            std::unique_lock<std::mutex> lk(queue_mutex);
+            stop_flag = true;
+        }
+        cv.notify_all();
+        for (auto &t : workers){
+            if (t.joinable()){
+                t.join();
+            }
+        }
+    }
+
+    void enqueue(std::function<void()> task){
+        {
+            std::unique_lock<std::mutex> lk(queue_mutex);
+            tasks.push(std::move(task));
+        }
+        cv.notify_one();
+    }
+
+private:
+    void worker_loop(){
+        while (true){
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lk(queue_mutex);
+                cv.wait(lk, [this] { return stop_flag || !tasks.empty(); });
+                if (stop_flag && tasks.empty()){
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+    std::mutex queue_mutex;
+    std::condition_variable cv;
+    bool stop_flag;
+};
+
+// Shared by every task in a run
+struct BenchState {
+    std::atomic<size_t> done{0};
+    int work; // Busy loop iterations per task
+    void *fake_conn; // Stands in for the Connection* the server passes
+};
+
+// What a task does, a bit of spinning then count itself done
+static void bench_task(BenchState *st){
+    volatile int sink = 0;
+    for (int i = 0; i < st->work; ++i) sink = sink + i; // += on a volatile is deprecated in C++20
+    st->done.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void bench_trampoline(void *arg){
+    bench_task((BenchState *)arg);
+}
+
+// Wait for every task to finish
+static void wait_done(BenchState &st, size_t n){
+    while (st.done.load(std::memory_order_relaxed) < n){
+        std::this_thread::yield();
+    }
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static double ns_since(Clock::time_point start){
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+// One producer submitting n tasks, like the event loop handing off requests
+static double run_mutex(size_t threads, size_t n, int work){
+    MutexThreadPool pool(threads);
+    BenchState st;
+    st.work = work;
+    st.fake_conn = &st;
+    auto start = Clock::now();
+    for (size_t i = 0; i < n; ++i){
+        BenchState *s = &st;
+        void *conn = st.fake_conn;
+        // Same capture size as the old server lambda, [this, c]
+        pool.enqueue([s, conn]() { (void)conn; bench_task(s); });
+    }
+    wait_done(st, n);
+    return ns_since(start) / n;
+}
+
+static double run_stealing(size_t threads, size_t n, int work){
+    ThreadPool pool(threads);
+    BenchState st;
+    st.work = work;
+    auto start = Clock::now();
+    for (size_t i = 0; i < n; ++i){
+        Task t;
+        t.fn = bench_trampoline;
+        t.arg = &st;
+        pool.enqueue(t);
+    }
+    wait_done(st, n);
+    return ns_since(start) / n;
+}
+
+int main(int argc, char *argv[]) {
+    size_t n = 1000000; // Tasks per run
+    if (argc > 1) n = strtoul(argv[1], nullptr, 10);
+
+    unsigned int hw = std::thread::hardware_concurrency();
+    if (hw == 0) hw = 4;
+    std::vector<size_t> thread_counts = {1, 2, 4};
+    if (hw * 2 > 4) thread_counts.push_back(hw * 2);
+
+    // 0 is pure queue overhead, the others add a little work per task
+    std::vector<int> work_sizes = {0, 100, 1000};
+
+    printf("%zu tasks per run, %u hardware threads\n", n, hw);
+    printf("%-8s %-10s %14s %14s %8s\n", "threads", "work", "mutex ns/op", "steal ns/op", "speedup");
+    for (int work : work_sizes){
+        for (size_t threads : thread_counts){
+            double m = run_mutex(threads, n, work);
+            double s = run_stealing(threads, n, work);
+            printf("%-8zu %-10d %14.1f %14.1f %7.2fx\n", threads, work, m, s, m / s);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// gzip/deflate response bodies with zlib
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <strings.h>
+#include <zlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "arena.h"
+
+// Content-Encoding values the server can send
+enum Encoding {
+    ENC_IDENTITY,
+    ENC_GZIP,
+    ENC_DEFLATE,
+    ENC_COUNT
+};
+
+static const char *encoding_names[ENC_COUNT] = {"identity", "gzip", "deflate"};
+
+// Hit rates for the compressed variant caches and work done on the fly
+struct CompressStats {
+    std::atomic<uint64_t> cache_hits{0}; // Compressed variant already there
+    std::atomic<uint64_t> cache_misses{0}; // Had to compress (or load the .gz) first
+    std::atomic<uint64_t> dynamic{0}; // Bodies compressed per response
+    std::atomic<uint64_t> bytes_in{0}; // Before compression, dynamic only
+    std::atomic<uint64_t> bytes_out{0}; // After
+};
+inline CompressStats compress_stats;
+
+// Worth compressing, text-like types only, images and archives already are
+static inline bool compressible(std::string_view type){
+    if (type.substr(0, 5) == "text/") return true;
+    return type == "application/json" || type == "application/javascript" ||
+           type == "application/xml" || type == "image/svg+xml" || type == "application/wasm";
+}
+
+// Pick an encoding from Accept-Encoding, gzip over deflate, q=0 turns one off
+static inline Encoding choose_encoding(std::string_view accept){
+    bool ok[ENC_COUNT] = {true, false, false};
+    bool star = false;
+    while (!accept.empty()){
+        size_t comma = accept.find(',');
+        std::string_view item = accept.substr(0, comma);
+        accept = comma == std::string_view::npos ? std::string_view() : accept.substr(comma + 1);
+        // coding[;q=value]
+        size_t semi = item.find(';');
+        std::string_view coding = item.substr(0, semi);
+        while (!coding.empty() && (coding.front() == ' ' || coding.front() == '\t')) coding.remove_prefix(1);
+        while (!coding.empty() && (coding.back() == ' ' || coding.back() == '\t')) coding.remove_suffix(1);
+        bool allowed = true;
+        if (semi != std::string_view::npos){
+            std::string_view q = item.substr(semi + 1);
+            size_t eq = q.find('=');
+            if (eq != std::string_view::npos){
+                // q=0, q=0.0, q=0.000 all mean no
+                std::string_view val = q.substr(eq + 1);
+                while (!val.empty() && val.front() == ' ') val.remove_prefix(1);
+                allowed = false;
+                for (char c : val){
+                    if (c >= '1' && c <= '9') allowed = true;
+                    else if (c != '0' && c != '.') break;
+                }
+            }
+        }
+        if (coding.size() == 4 && strncasecmp(coding.data(), "gzip", 4) == 0) ok[ENC_GZIP] = allowed;
+        else if (coding.size() == 7 && strncasecmp(coding.data(), "deflate", 7) == 0) ok[ENC_DEFLATE] = allowed;
+        else if (coding == "*") star = allowed;
+    }
+    if (ok[ENC_GZIP] || star) return ENC_GZIP;
+    if (ok[ENC_DEFLATE]) return ENC_DEFLATE;
+    return ENC_IDENTITY;
+}
+
+// zlib stream per thread and encoding, set up once and reset between bodies
+// so compressing a response doesn't pay deflateInit's allocations every time.
+static inline z_stream *deflate_stream(Encoding enc, int level){
+    thread_local z_stream streams[ENC_COUNT];
+    thread_local int levels[ENC_COUNT] = {-1, -1, -1};
+    z_stream &zs = streams[enc];
+    if (levels[enc] != level){
+        if (levels[enc] >= 0) deflateEnd(&zs);
+        memset(&zs, 0, sizeof(zs));
+        // 31 is a gzip wrapper, 15 is zlib's which is what HTTP calls deflate
+        if (deflateInit2(&zs, level, Z_DEFLATED, enc == ENC_GZIP ? 31 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+            levels[enc] = -1;
+            return nullptr;
+        }
+        levels[enc] = level;
+    }
+    else{
+        deflateReset(&zs);
+    }
+    return &zs;
+}
+
+// Compress in into out (at most cap bytes), returns the size or 0 if it didn't fit
+// Feeds the input through in chunks so a big body never needs a second full copy
+static inline size_t deflate_into(Encoding enc, int level, std::string_view in, char *out, size_t cap){
+    z_stream *zs = deflate_stream(enc, level);
+    if (!zs) return 0;
+    const size_t CHUNK = 65536;
+    zs->next_out = (Bytef *)out;
+    zs->avail_out = (uInt)cap;
+    size_t pos = 0;
+    int ret;
+    do{
+        size_t n = std::min(CHUNK, in.size() - pos);
+        zs->next_in = (Bytef *)(in.data() + pos);
+        zs->avail_in = (uInt)n;
+        pos += n;
+        ret = deflate(zs, pos == in.size() ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR || (zs->avail_out == 0 && ret != Z_STREAM_END)) return 0;
+    } while (ret != Z_STREAM_END);
+    return zs->total_out;
+}
+
+// Compressed body in the request arena, empty if it wouldn't come out smaller
+static inline std::string_view deflate_arena(Encoding enc, int level, std::string_view in, Arena &arena){
+    size_t cap = deflateBound(nullptr, in.size()) + 32; // + gzip header and trailer
+    char *out = arena.alloc_chars(cap);
+    if (!out) return std::string_view();
+    size_t n = deflate_into(enc, level, in, out, cap);
+    if (n == 0 || n >= in.size()) return std::string_view();
+    count(compress_stats.dynamic);
+    count(compress_stats.bytes_in, in.size());
+    count(compress_stats.bytes_out, n);
+    return std::string_view(out, n);
+}
+
+// Compressed copy to keep in a cache, empty if it wouldn't come out smaller
+static inline std::string deflate_string(Encoding enc, int level, std::string_view in){
+    std::string out(deflateBound(nullptr, in.size()) + 32, '\0');
+    size_t n = deflate_into(enc, level, in, &out[0], out.size());
+    if (n == 0 || n >= in.size()) return std::string();
+    out.resize(n);
+    return out;
+}
+
+#endif
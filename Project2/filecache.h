@@ -0,0 +1,423 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Static files from a document root, small hot files stay mmap'd with their headers ready
+
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "compress.h"
+
+#define FILE_CACHE_BYTES (64 << 20) // mmap'd bytes the cache keeps at most
+#define FILE_CACHE_MAX_FILE (1 << 20) // Bigger files are always sent with sendfile
+#define ETAG_LEN 40 // Fits "\"<16 hex>-<16 hex>\""
+
+// Extension to Content-Type, anything else is application/octet-stream
+static const char *mime_type(std::string_view path){
+    static const struct { const char *ext; const char *type; } types[] = {
+        {"html", "text/html"}, {"htm", "text/html"}, {"css", "text/css"},
+        {"js", "text/javascript"}, {"mjs", "text/javascript"}, {"json", "application/json"},
+        {"txt", "text/plain"}, {"csv", "text/csv"}, {"xml", "application/xml"},
+        {"svg", "image/svg+xml"}, {"png", "image/png"}, {"jpg", "image/jpeg"},
+        {"jpeg", "image/jpeg"}, {"gif", "image/gif"}, {"webp", "image/webp"},
+        {"ico", "image/x-icon"}, {"avif", "image/avif"}, {"woff", "font/woff"},
+        {"woff2", "font/woff2"}, {"ttf", "font/ttf"}, {"otf", "font/otf"},
+        {"pdf", "application/pdf"}, {"zip", "application/zip"}, {"gz", "application/gzip"},
+        {"wasm", "application/wasm"}, {"mp3", "audio/mpeg"}, {"ogg", "audio/ogg"},
+        {"mp4", "video/mp4"}, {"webm", "video/webm"},
+    };
+    size_t dot = path.rfind('.');
+    if (dot == std::string_view::npos || path.find('/', dot) != std::string_view::npos){
+        return "application/octet-stream";
+    }
+    std::string_view ext = path.substr(dot + 1);
+    for (const auto &t : types){
+        if (ext.size() != strlen(t.ext)) continue;
+        bool same = true;
+        for (size_t i = 0; i < ext.size() && same; ++i){
+            same = tolower((unsigned char)ext[i]) == t.ext[i];
+        }
+        if (same) return t.type;
+    }
+    return "application/octet-stream";
+}
+
+// What the headers of a file response need to know
+struct FileMeta {
+    size_t size = 0;
+    time_t mtime = 0; // Seconds, what Last-Modified and If-Modified-Since compare
+    const char *content_type = "";
+    char etag[ETAG_LEN + 1] = ""; // Strong, size and mtime in ns
+    char last_modified[32] = ""; // HTTP date
+
+    void fill(std::string_view path, const struct stat &st){
+        size = st.st_size;
+        mtime = st.st_mtim.tv_sec;
+        content_type = mime_type(path);
+        uint64_t ns = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+        snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (unsigned long long)st.st_size, (unsigned long long)ns);
+        struct tm tm;
+        gmtime_r(&mtime, &tm);
+        strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    }
+};
+
+// Compressed copy of a cached file
+struct FileVariant {
+    std::string body; // Empty when compressing didn't make it smaller
+    std::string headers; // Content-Type through Last-Modified for a 200, built once
+    char etag[ETAG_LEN + 4]; // Its own ETag, a different representation
+};
+
+// One cached file
+// The cache holds a reference and every response sending it holds one more,
+// so an invalidated file stays mapped until the last write using it is done.
+struct CachedFile {
+    std::atomic<int> refs{1};
+    std::string key; // Path relative to the docroot
+    const char *data = nullptr; // mmap'd, nullptr for an empty file
+    FileMeta meta;
+    bool varies = false; // Has compressed variants, responses need Vary
+    std::string headers; // Content-Type through Accept-Ranges for a full 200, built once
+    std::atomic<FileVariant *> variants[ENC_COUNT] = {}; // Built the first time someone asks
+    CachedFile *lru_prev = nullptr; // Newer
+    CachedFile *lru_next = nullptr; // Older
+
+    ~CachedFile(){
+        for (auto &v : variants) delete v.load();
+    }
+};
+
+// A file ready to send, either from the cache or an open descriptor
+struct FileHandle {
+    CachedFile *cached = nullptr;
+    int fd = -1; // When not cached, whoever sends it closes it
+    FileMeta local; // Meta for the uncached case
+    const FileMeta &meta() const { return cached ? cached->meta : local; }
+};
+
+// Document root plus the hot file cache
+// Lookups hash the path under one mutex, misses open the file, mmap it if it's small and
+// keep it in LRU order. A thread reads inotify events for the directories of cached files
+// and drops entries when their file changes, so nobody stats on the request path.
+class FileCache {
+public:
+    // Open the docroot and start watching, false if it can't be opened
+    bool open(const std::string &dir){
+        root = dir;
+        while (root.size() > 1 && root.back() == '/') root.pop_back();
+        root_fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (root_fd < 0) return false;
+        inotify_fd = inotify_init1(IN_CLOEXEC);
+        if (inotify_fd < 0){
+            // Still works, just can't cache without knowing when files change
+            perror("inotify_init1");
+        }
+        else{
+            std::thread(&FileCache::watch, this).detach();
+        }
+        return true;
+    }
+
+    bool enabled() const { return root_fd >= 0; }
+
+    // Compress cached text files at this level when they are at least min bytes, 0 turns it off
+    void set_compression(int level, size_t min){
+        compress_level = level;
+        compress_min = min;
+    }
+
+    // Compressed variant of a cached file, nullptr if it doesn't have a smaller one
+    // Built once per file: a fresh enough "<file>.gz" next to it is used as is for gzip,
+    // otherwise the mapping gets compressed. Two threads racing both build, one keeps it.
+    FileVariant *variant(CachedFile *f, Encoding enc){
+        FileVariant *v = f->variants[enc].load(std::memory_order_acquire);
+        if (v){
+            count(compress_stats.cache_hits);
+            return v->body.empty() ? nullptr : v;
+        }
+        count(compress_stats.cache_misses);
+        v = new FileVariant();
+        if (enc == ENC_GZIP) v->body = precompressed(f);
+        if (v->body.empty()){
+            v->body = deflate_string(enc, compress_level, std::string_view(f->data, f->meta.size));
+        }
+        snprintf(v->etag, sizeof(v->etag), "%.*s-%c\"", (int)strlen(f->meta.etag) - 1, f->meta.etag,
+                 enc == ENC_GZIP ? 'g' : 'd');
+        v->headers = std::string("Content-Type: ") + f->meta.content_type +
+                     "\r\nContent-Length: " + std::to_string(v->body.size()) +
+                     "\r\nContent-Encoding: " + encoding_names[enc] +
+                     "\r\nVary: Accept-Encoding\r\nETag: " + v->etag +
+                     "\r\nLast-Modified: " + f->meta.last_modified + "\r\n";
+        FileVariant *expected = nullptr;
+        if (!f->variants[enc].compare_exchange_strong(expected, v, std::memory_order_acq_rel)){
+            delete v;
+            v = expected;
+        }
+        return v->body.empty() ? nullptr : v;
+    }
+
+    // Find rel (decoded, checked, no leading '/'), 0 or an errno
+    int lookup(std::string_view rel, FileHandle &out){
+        // Key kept per thread so a lookup doesn't allocate once it has grown
+        thread_local std::string key;
+        key.assign(rel.data(), rel.size());
+        uint64_t gen;
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            auto it = files.find(key);
+            if (it != files.end()){
+                CachedFile *f = it->second;
+                f->refs.fetch_add(1, std::memory_order_relaxed);
+                touch(f);
+                out.cached = f;
+                hits.fetch_add(1, std::memory_order_relaxed);
+                return 0;
+            }
+            misses.fetch_add(1, std::memory_order_relaxed);
+            // Watch before opening so a change after this point is never missed
+            watch_dir(key);
+            gen = generation;
+        }
+
+        int fd = openat(root_fd, key.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return errno;
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)){
+            close(fd);
+            return ENOENT;
+        }
+        if (inotify_fd < 0 || st.st_size > FILE_CACHE_MAX_FILE){
+            out.fd = fd;
+            out.local.fill(key, st);
+            return 0;
+        }
+
+        CachedFile *f = load(key, fd, st);
+        if (!f){
+            out.fd = fd;
+            out.local.fill(key, st);
+            return 0;
+        }
+        close(fd);
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            // Something changed while it was loading, serve it this once without caching
+            if (gen == generation && files.find(key) == files.end()){
+                f->refs.fetch_add(1, std::memory_order_relaxed);
+                files.emplace(f->key, f);
+                lru_push(f);
+                bytes += f->meta.size;
+                evict();
+            }
+        }
+        out.cached = f;
+        return 0;
+    }
+
+    // Drop a reference taken by lookup, used as the OutQueue release callback
+    static void unref(void *arg){
+        CachedFile *f = (CachedFile *)arg;
+        if (f->refs.fetch_sub(1, std::memory_order_acq_rel) == 1){
+            if (f->data) munmap((void *)f->data, f->meta.size);
+            delete f;
+        }
+    }
+
+    // Closes an uncached file once it's sent
+    static void close_fd(void *arg){
+        close((int)(intptr_t)arg);
+    }
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> invalidations{0};
+
+private:
+    // mmap a small file and build its headers
+    CachedFile *load(const std::string &key, int fd, const struct stat &st){
+        const char *data = nullptr;
+        if (st.st_size > 0){
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED) return nullptr;
+            data = (const char *)p;
+        }
+        CachedFile *f = new CachedFile();
+        f->key = key;
+        f->data = data;
+        f->meta.fill(key, st);
+        f->varies = compress_level > 0 && f->meta.size >= compress_min && compressible(f->meta.content_type);
+        f->headers = std::string("Content-Type: ") + f->meta.content_type +
+                     "\r\nContent-Length: " + std::to_string(f->meta.size) +
+                     (f->varies ? "\r\nVary: Accept-Encoding" : "") +
+                     "\r\nETag: " + f->meta.etag +
+                     "\r\nLast-Modified: " + f->meta.last_modified +
+                     "\r\nAccept-Ranges: bytes\r\n";
+        return f;
+    }
+
+    // "<key>.gz" made ahead of time, empty unless it's a regular file at least as new
+    std::string precompressed(CachedFile *f){
+        std::string gz_key = f->key + ".gz";
+        int fd = openat(root_fd, gz_key.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return std::string();
+        std::string body;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_mtim.tv_sec >= f->meta.mtime &&
+            (size_t)st.st_size < f->meta.size){
+            body.resize(st.st_size);
+            size_t got = 0;
+            while (got < body.size()){
+                ssize_t n = pread(fd, &body[got], body.size() - got, got);
+                if (n <= 0) break;
+                got += n;
+            }
+            if (got != body.size()) body.clear();
+        }
+        close(fd);
+        return body;
+    }
+
+    // Most recently used goes to the front
+    void lru_push(CachedFile *f){
+        f->lru_prev = nullptr;
+        f->lru_next = lru_head;
+        if (lru_head) lru_head->lru_prev = f;
+        else lru_tail = f;
+        lru_head = f;
+    }
+
+    void lru_unlink(CachedFile *f){
+        if (f->lru_prev) f->lru_prev->lru_next = f->lru_next;
+        else lru_head = f->lru_next;
+        if (f->lru_next) f->lru_next->lru_prev = f->lru_prev;
+        else lru_tail = f->lru_prev;
+        f->lru_prev = f->lru_next = nullptr;
+    }
+
+    void touch(CachedFile *f){
+        if (lru_head == f) return;
+        lru_unlink(f);
+        lru_push(f);
+    }
+
+    // Lock held
+    void remove(CachedFile *f){
+        lru_unlink(f);
+        files.erase(f->key);
+        bytes -= f->meta.size;
+        unref(f);
+    }
+
+    // Lock held, oldest files go until it fits
+    void evict(){
+        while (bytes > FILE_CACHE_BYTES && lru_tail){
+            remove(lru_tail);
+        }
+    }
+
+    // Lock held, inotify watch on the directory key is in
+    void watch_dir(const std::string &key){
+        if (inotify_fd < 0) return;
+        size_t slash = key.rfind('/');
+        std::string dir = slash == std::string::npos ? std::string() : key.substr(0, slash + 1);
+        if (watched.count(dir)) return;
+        std::string full = root + "/" + dir;
+        int wd = inotify_add_watch(inotify_fd, full.c_str(),
+                                   IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                                   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (wd < 0) return; // Not a directory, the open will fail anyway
+        watched.insert(dir);
+        dirs[wd] = dir;
+    }
+
+    // Lock held, drop every cached file whose key starts with prefix
+    void invalidate_prefix(const std::string &prefix){
+        for (CachedFile *f = lru_head; f;){
+            CachedFile *next = f->lru_next;
+            if (f->key.compare(0, prefix.size(), prefix) == 0) remove(f);
+            f = next;
+        }
+    }
+
+    // Watcher thread, blocks on inotify and invalidates
+    void watch(){
+        alignas(struct inotify_event) char buf[16384];
+        while (true){
+            ssize_t n = read(inotify_fd, buf, sizeof(buf));
+            if (n < 0){
+                if (errno == EINTR) continue;
+                perror("inotify read");
+                return;
+            }
+            std::lock_guard<std::mutex> lk(mutex);
+            ++generation;
+            for (char *p = buf; p < buf + n;){
+                struct inotify_event *ev = (struct inotify_event *)p;
+                p += sizeof(struct inotify_event) + ev->len;
+                invalidations.fetch_add(1, std::memory_order_relaxed);
+                if (ev->mask & IN_Q_OVERFLOW){
+                    invalidate_prefix(""); // Lost events, start over
+                    continue;
+                }
+                auto it = dirs.find(ev->wd);
+                if (it == dirs.end()) continue;
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)){
+                    // The directory itself went away, so did everything under it
+                    invalidate_prefix(it->second);
+                    if (ev->mask & IN_IGNORED){
+                        watched.erase(it->second);
+                        dirs.erase(it);
+                    }
+                    continue;
+                }
+                if (ev->len == 0) continue;
+                std::string key = it->second + ev->name;
+                auto f = files.find(key);
+                if (f != files.end()) remove(f->second);
+                // A changed .gz means the file it belongs to needs its variant redone
+                if (key.size() > 3 && key.compare(key.size() - 3, 3, ".gz") == 0){
+                    f = files.find(key.substr(0, key.size() - 3));
+                    if (f != files.end()) remove(f->second);
+                }
+                if (ev->mask & IN_ISDIR) invalidate_prefix(key + "/");
+            }
+        }
+    }
+
+    std::string root;
+    int root_fd = -1;
+    int inotify_fd = -1;
+    std::mutex mutex; // Protects everything below
+    std::unordered_map<std::string, CachedFile *> files;
+    std::unordered_map<int, std::string> dirs; // Watch descriptor to directory key prefix
+    std::unordered_set<std::string> watched; // Directory key prefixes being watched
+    CachedFile *lru_head = nullptr; // Most recent
+    CachedFile *lru_tail = nullptr; // Least recent
+    size_t bytes = 0; // Mapped bytes in the cache
+    uint64_t generation = 0; // Bumped on every batch of inotify events
+    int compress_level = 0;
+    size_t compress_min = 0;
+};
+inline FileCache file_cache;
+
+#endif
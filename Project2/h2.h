@@ -0,0 +1,1393 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// HTTP/2 over cleartext (h2c): frames, HPACK and the streams of one connection
+
+#ifndef H2_H
+#define H2_H
+
+#include <algorithm>
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "arena.h"
+#include "async.h"
+#include "httpparser.h"
+#include "outqueue.h"
+#include "response.h"
+#include "timerwheel.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n" // What a client opens with
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER 9
+#define H2_MAX_FRAME 16384 // Biggest frame either way, the protocol's default so it's never negotiated
+#define H2_DEFAULT_WINDOW 65535 // Flow control windows until SETTINGS say otherwise
+#define H2_WINDOW (1 << 20) // What a client may send ahead of us, per stream and for the connection
+#define H2_MAX_WINDOW 0x7fffffff
+#define H2_TABLE_SIZE 4096 // HPACK dynamic table each way, the protocol's default
+#define H2_PUMP_MAX (256 * 1024) // DATA framed per pass, the rest waits until the socket takes it
+
+// HTTP/2 counters, shown on /stats with the others
+struct H2Stats {
+    std::atomic<uint64_t> sessions{0}; // Connections that switched to HTTP/2
+    std::atomic<uint64_t> upgrades{0}; // ...through Upgrade: h2c instead of the preface
+    std::atomic<uint64_t> streams{0}; // Requests opened on them
+    std::atomic<uint64_t> refused{0}; // Streams turned away with REFUSED_STREAM
+    std::atomic<uint64_t> resets_sent{0};
+    std::atomic<uint64_t> resets_received{0};
+    std::atomic<uint64_t> goaways{0}; // Sessions we ended, errors and timeouts
+};
+inline H2Stats h2_stats;
+
+enum H2FrameType {
+    H2_DATA,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION
+};
+
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1 // SETTINGS and PING
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+enum H2Error {
+    H2_NO_ERROR,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR,
+    H2_ENHANCE_YOUR_CALM
+};
+
+enum H2Setting {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+    H2_SETTINGS_ENABLE_PUSH,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE,
+    H2_SETTINGS_MAX_FRAME_SIZE,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+// Big-endian reads and writes for frame fields
+static inline uint32_t h2_get32(const uint8_t *p){
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void h2_put32(char *p, uint32_t v){
+    p[0] = (char)(v >> 24);
+    p[1] = (char)(v >> 16);
+    p[2] = (char)(v >> 8);
+    p[3] = (char)v;
+}
+
+static inline void h2_frame_header(char *p, size_t len, uint8_t type, uint8_t flags, uint32_t stream){
+    p[0] = (char)(len >> 16);
+    p[1] = (char)(len >> 8);
+    p[2] = (char)len;
+    p[3] = (char)type;
+    p[4] = (char)flags;
+    h2_put32(p + 5, stream & 0x7fffffff);
+}
+
+// HPACK, RFC 7541
+
+struct HpackField {
+    std::string_view name;
+    std::string_view value;
+};
+
+#define HPACK_STATIC 61 // Entries in the static table, the dynamic table's indexes start after them
+
+static constexpr HpackField hpack_static[HPACK_STATIC] = {
+    {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+    {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+    {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""},
+    {"access-control-allow-origin", ""}, {"age", ""}, {"allow", ""}, {"authorization", ""},
+    {"cache-control", ""}, {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""},
+    {"content-length", ""}, {"content-location", ""}, {"content-range", ""}, {"content-type", ""},
+    {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""}, {"from", ""}, {"host", ""},
+    {"if-match", ""}, {"if-modified-since", ""}, {"if-none-match", ""}, {"if-range", ""},
+    {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""}, {"location", ""}, {"max-forwards", ""},
+    {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+    {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+    {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""}, {"www-authenticate", ""}};
+
+// Huffman code of every byte, plus EOS as 256, from Appendix B
+struct HuffmanCode {
+    uint32_t code;
+    uint8_t bits;
+};
+
+static constexpr HuffmanCode huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+    {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+    {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+    {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+    {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+    {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+    {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+    {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+    {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+    {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+    {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+    {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+    {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+    {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+    {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+    {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+    {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+    {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+    {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+    {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+    {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+    {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+};
+
+// Huffman decoding, 4 bits at a time
+// The codes make a tree with 256 inner nodes. Each step starts at a node, follows one nibble and
+// says where it ended up and which byte (at most one, codes are 5 bits or longer) it passed.
+// The table is built from the codes at startup, like nghttp2's generated one.
+class HuffmanDecoder {
+public:
+    HuffmanDecoder(){
+        int16_t child[256][2];
+        uint8_t depth[256] = {};
+        bool ones[256] = {}; // Every bit on the way here was a 1, so stopping here is valid padding
+        memset(child, 0, sizeof(child));
+        ones[0] = true;
+        int nodes = 1;
+        for (int sym = 0; sym < 257; ++sym){
+            const HuffmanCode &hc = huffman_codes[sym];
+            int n = 0;
+            for (int b = hc.bits - 1; b > 0; --b){
+                int bit = (hc.code >> b) & 1;
+                if (!child[n][bit]){
+                    child[n][bit] = (int16_t)nodes;
+                    depth[nodes] = depth[n] + 1;
+                    ones[nodes] = ones[n] && bit;
+                    ++nodes;
+                }
+                n = child[n][bit];
+            }
+            child[n][hc.code & 1] = (int16_t)(-1 - sym); // Leaves are negative
+        }
+        for (int s = 0; s < nodes; ++s){
+            for (int nib = 0; nib < 16; ++nib){
+                Step &st = steps[s][nib];
+                st = Step{0, 0, 0};
+                int n = s;
+                for (int b = 3; b >= 0; --b){
+                    int v = child[n][(nib >> b) & 1];
+                    if (v >= 0){
+                        n = v;
+                        continue;
+                    }
+                    if (-1 - v == 256){
+                        st.flags = FAIL; // EOS inside a string is an error
+                        break;
+                    }
+                    st.flags |= EMIT;
+                    st.sym = (uint8_t)(-1 - v);
+                    n = 0;
+                }
+                st.next = (uint8_t)n;
+                if (ones[n] && depth[n] <= 7) st.flags |= ACCEPT;
+            }
+        }
+    }
+
+    // Decode n bytes into dst, which needs room for n * 8 / 5 bytes
+    // Length decoded, -1 if it isn't a valid string
+    long decode(const uint8_t *src, size_t n, char *dst) const {
+        char *out = dst;
+        uint8_t state = 0;
+        bool accept = true;
+        for (size_t i = 0; i < n; ++i){
+            for (int half = 0; half < 2; ++half){
+                const Step &st = steps[state][half ? src[i] & 0xf : src[i] >> 4];
+                if (st.flags & FAIL) return -1;
+                if (st.flags & EMIT) *out++ = (char)st.sym;
+                state = st.next;
+                accept = st.flags & ACCEPT;
+            }
+        }
+        return accept ? out - dst : -1;
+    }
+
+private:
+    enum { EMIT = 1, FAIL = 2, ACCEPT = 4 };
+    struct Step {
+        uint8_t next; // Node it ends on
+        uint8_t flags;
+        uint8_t sym;
+    };
+    Step steps[256][16];
+};
+inline const HuffmanDecoder huffman_decoder;
+
+// Bytes s takes Huffman coded
+static inline size_t huffman_len(std::string_view s){
+    size_t bits = 0;
+    for (unsigned char ch : s) bits += huffman_codes[ch].bits;
+    return (bits + 7) / 8;
+}
+
+// s Huffman coded at dst, padded with the start of EOS, returns the end
+static inline char *huffman_encode(std::string_view s, char *dst){
+    uint64_t acc = 0;
+    int n = 0; // Bits in acc
+    for (unsigned char ch : s){
+        acc = acc << huffman_codes[ch].bits | huffman_codes[ch].code;
+        n += huffman_codes[ch].bits;
+        while (n >= 8){
+            n -= 8;
+            *dst++ = (char)(acc >> n);
+        }
+        acc &= (1ull << n) - 1;
+    }
+    if (n > 0) *dst++ = (char)(acc << (8 - n) | (0xff >> n));
+    return dst;
+}
+
+// Prefix-coded integer, the first byte's top bits belong to whoever called
+static inline bool hpack_get_int(const uint8_t *&p, const uint8_t *end, int prefix, uint64_t &v){
+    if (p >= end) return false;
+    uint64_t max = (1u << prefix) - 1;
+    v = *p++ & max;
+    if (v < max) return true;
+    for (int shift = 0; p < end && shift <= 28; shift += 7){
+        uint8_t b = *p++;
+        v += (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false; // Cut short or too big to be anything real
+}
+
+static inline void hpack_put_int(Buffer &out, uint8_t flags, int prefix, uint64_t v){
+    uint64_t max = (1u << prefix) - 1;
+    if (v < max){
+        out.push_back((char)(flags | v));
+        return;
+    }
+    out.push_back((char)(flags | max));
+    v -= max;
+    while (v >= 0x80){
+        out.push_back((char)(0x80 | (v & 0x7f)));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+// String literal, Huffman coded when that's shorter
+static inline void hpack_put_string(Buffer &out, std::string_view s){
+    size_t huff = huffman_len(s);
+    if (huff < s.size()){
+        hpack_put_int(out, 0x80, 7, huff);
+        if (!out.reserve(huff)) return;
+        out.commit(huffman_encode(s, out.tail()) - out.tail());
+    }
+    else{
+        hpack_put_int(out, 0, 7, s.size());
+        out.append(s);
+    }
+}
+
+// Dynamic table, newest entry first
+// Strings sit back to back in one array, oldest at the front. Evicting moves the front up and
+// adding goes on the back, sliding everything down first when the back is full. The table is
+// never more than H2_TABLE_SIZE bytes with 32 of overhead counted per entry, so that's cheap.
+class HpackTable {
+public:
+    size_t count() const { return n; }
+
+    HpackField get(size_t i) const {
+        const Entry &e = ents[(first + n - 1 - i) % MAX_ENTRIES];
+        return {std::string_view(data + e.off, e.name_len), std::string_view(data + e.off + e.name_len, e.value_len)};
+    }
+
+    // New size limit, entries that don't fit any more go
+    void set_max(size_t m){
+        max = std::min(m, (size_t)H2_TABLE_SIZE);
+        while (size > max) evict();
+    }
+
+    void add(std::string_view name, std::string_view value){
+        size_t need = name.size() + value.size() + 32;
+        while (n && size + need > max) evict();
+        if (need > max) return; // Bigger than the whole table, which is now empty
+        if (end + name.size() + value.size() > sizeof(data)){
+            memmove(data, data + start, end - start);
+            for (size_t i = 0; i < n; ++i) ents[(first + i) % MAX_ENTRIES].off -= start;
+            end -= start;
+            start = 0;
+        }
+        Entry &e = ents[(first + n) % MAX_ENTRIES];
+        e.off = end;
+        e.name_len = name.size();
+        e.value_len = value.size();
+        memcpy(data + end, name.data(), name.size());
+        memcpy(data + end + name.size(), value.data(), value.size());
+        end += name.size() + value.size();
+        size += need;
+        ++n;
+    }
+
+private:
+    static constexpr size_t MAX_ENTRIES = H2_TABLE_SIZE / 32;
+
+    struct Entry {
+        uint16_t off;
+        uint16_t name_len;
+        uint16_t value_len;
+    };
+
+    void evict(){
+        const Entry &e = ents[first];
+        start = e.off + e.name_len + e.value_len;
+        size -= e.name_len + e.value_len + 32;
+        first = (first + 1) % MAX_ENTRIES;
+        if (--n == 0) start = end = 0;
+    }
+
+    char data[H2_TABLE_SIZE];
+    Entry ents[MAX_ENTRIES];
+    size_t first = 0; // Oldest entry
+    size_t n = 0;
+    size_t start = 0; // Bytes in use are [start, end)
+    size_t end = 0;
+    size_t size = 0; // As HPACK counts it
+    size_t max = H2_TABLE_SIZE;
+};
+
+// Turns header blocks back into fields
+class HpackDecoder {
+public:
+    // Decode a whole header block, fn(name, value) for each field in order
+    // Fields are copied into arena, but only up to max_bytes of them (counted like HPACK counts
+    // table entries). Past that the block is still decoded so the table stays in step, and
+    // over is set. Returns false if the block isn't valid HPACK, which ends the connection.
+    template <typename F>
+    bool decode(const uint8_t *p, size_t len, Arena &arena, size_t max_bytes, bool &over, F fn){
+        const uint8_t *end = p + len;
+        size_t bytes = 0;
+        over = false;
+        while (p < end){
+            uint8_t b = *p;
+            uint64_t idx;
+            HpackField f;
+            if (b & 0x80){
+                // Indexed field
+                if (!hpack_get_int(p, end, 7, idx) || !lookup(idx, f)) return false;
+                bytes += f.name.size() + f.value.size() + 32;
+                if (bytes > max_bytes){
+                    over = true;
+                    continue;
+                }
+                if (!copy(arena, f.name) || !copy(arena, f.value)) return false;
+                fn(f.name, f.value);
+                continue;
+            }
+            if ((b & 0xe0) == 0x20){
+                // Table size update, can't go past what we said in SETTINGS
+                if (!hpack_get_int(p, end, 5, idx) || idx > H2_TABLE_SIZE) return false;
+                table.set_max(idx);
+                continue;
+            }
+            // Literal, with incremental indexing (01), without (0000) or never indexed (0001)
+            bool add = b & 0x40;
+            if (!hpack_get_int(p, end, add ? 6 : 4, idx)) return false;
+            if (idx){
+                if (!lookup(idx, f) || !copy(arena, f.name)) return false;
+            }
+            else if (!string(p, end, arena, f.name)){
+                return false;
+            }
+            if (!string(p, end, arena, f.value)) return false;
+            if (add) table.add(f.name, f.value);
+            bytes += f.name.size() + f.value.size() + 32;
+            if (bytes > max_bytes){
+                over = true;
+                continue;
+            }
+            fn(f.name, f.value);
+        }
+        return true;
+    }
+
+private:
+    bool lookup(uint64_t idx, HpackField &f) const {
+        if (idx == 0) return false;
+        if (idx <= HPACK_STATIC){
+            f = hpack_static[idx - 1];
+            return true;
+        }
+        if (idx - HPACK_STATIC - 1 >= table.count()) return false;
+        f = table.get(idx - HPACK_STATIC - 1);
+        return true;
+    }
+
+    // Table entries get evicted by later fields in the same block, so everything handed out is copied
+    static bool copy(Arena &arena, std::string_view &s){
+        if (s.empty()) return true;
+        char *dst = arena.alloc_chars(s.size());
+        if (!dst) return false;
+        memcpy(dst, s.data(), s.size());
+        s = std::string_view(dst, s.size());
+        return true;
+    }
+
+    static bool string(const uint8_t *&p, const uint8_t *end, Arena &arena, std::string_view &s){
+        if (p >= end) return false;
+        bool huffman = *p & 0x80;
+        uint64_t len;
+        if (!hpack_get_int(p, end, 7, len) || len > (uint64_t)(end - p)) return false;
+        if (!huffman){
+            s = std::string_view((const char *)p, len);
+            p += len;
+            return copy(arena, s);
+        }
+        char *dst = arena.alloc_chars(len * 8 / 5 + 1);
+        if (!dst) return false;
+        long n = huffman_decoder.decode(p, len, dst);
+        if (n < 0) return false;
+        s = std::string_view(dst, n);
+        p += len;
+        return true;
+    }
+
+    HpackTable table;
+};
+
+// Turns response headers into header blocks
+class HpackEncoder {
+public:
+    // The client's SETTINGS_HEADER_TABLE_SIZE, the next block starts by saying so
+    void set_max(size_t m){
+        m = std::min(m, (size_t)H2_TABLE_SIZE);
+        if (m == max) return;
+        smallest = std::min(smallest, m);
+        max = m;
+        resized = true;
+    }
+
+    // Call before the first field of each block
+    void begin(Buffer &out){
+        if (!resized) return;
+        // Went down and back up since the last block, the decoder has to see the low point too
+        if (smallest < max) hpack_put_int(out, 0x20, 5, smallest);
+        hpack_put_int(out, 0x20, 5, max);
+        table.set_max(max);
+        smallest = max;
+        resized = false;
+    }
+
+    // One field, added to the table when index is set and it's worth remembering
+    void encode(Buffer &out, std::string_view name, std::string_view value, bool index){
+        size_t name_idx = 0;
+        for (size_t i = 0; i < HPACK_STATIC; ++i){
+            if (hpack_static[i].name != name) continue;
+            if (hpack_static[i].value == value){
+                hpack_put_int(out, 0x80, 7, i + 1);
+                return;
+            }
+            if (!name_idx) name_idx = i + 1;
+        }
+        for (size_t i = 0; i < table.count(); ++i){
+            HpackField f = table.get(i);
+            if (f.name != name) continue;
+            if (f.value == value){
+                hpack_put_int(out, 0x80, 7, HPACK_STATIC + 1 + i);
+                return;
+            }
+            if (!name_idx) name_idx = HPACK_STATIC + 1 + i;
+        }
+        if (index){
+            hpack_put_int(out, 0x40, 6, name_idx);
+        }
+        else{
+            hpack_put_int(out, 0x00, 4, name_idx);
+        }
+        if (!name_idx) hpack_put_string(out, name);
+        hpack_put_string(out, value);
+        if (index) table.add(name, value);
+    }
+
+private:
+    HpackTable table;
+    size_t max = H2_TABLE_SIZE;
+    size_t smallest = H2_TABLE_SIZE;
+    bool resized = false;
+};
+
+// base64url, what HTTP2-Settings carries, padding optional
+static inline bool base64url_decode(std::string_view s, Buffer &out){
+    uint32_t acc = 0;
+    int bits = 0;
+    for (char ch : s){
+        int v;
+        if (ch >= 'A' && ch <= 'Z') v = ch - 'A';
+        else if (ch >= 'a' && ch <= 'z') v = ch - 'a' + 26;
+        else if (ch >= '0' && ch <= '9') v = ch - '0' + 52;
+        else if (ch == '-' || ch == '+') v = 62;
+        else if (ch == '_' || ch == '/') v = 63;
+        else if (ch == '=') break;
+        else return false;
+        acc = acc << 6 | v;
+        bits += 6;
+        if (bits >= 8){
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    return true;
+}
+
+// One request and its response on an HTTP/2 connection
+// Streams are answered by the same route handlers as HTTP/1.1, each one writes an HTTP/1.1
+// response into the session's scratch queue and the session turns it into frames. A handler
+// that waits is parked on its stream and the others carry on without it.
+struct H2Stream {
+    H2Stream(){ timer.owner = (void *)((uintptr_t)this | 1); } // Low bit tells the loop it's a stream's
+
+    Arena arena; // Decoded headers, the body consumer's state, the handler's memory and frame
+    uint32_t id = 0;
+    Connection *conn = nullptr; // Whose stream it is
+    HttpRequest req;
+    Buffer body; // Request body, unless a consumer takes it as it comes
+    BodySinkFn sink = nullptr;
+    size_t body_len = 0;
+    StaticResponse error = RESP_COUNT; // Answered with this instead of the route
+    int64_t send_window = 0; // What we may still send on it
+    int64_t recv_window = 0; // What the client may still send
+    bool recv_done = false; // Client's half is finished
+    bool started = false; // Handed to the handler, or about to be
+    bool queued = false; // On the ready list
+    bool headers_out = false; // Response HEADERS framed
+    bool resp_done = false; // Handler finished, all it wrote is in pending
+    bool sent_done = false; // Last of it framed
+    bool reset = false; // RST_STREAM either way, nothing more goes out
+    Buffer pending; // Response body not framed yet
+    size_t pending_off = 0;
+    size_t resp_bytes = 0; // Response bytes the handler wrote, for the access log
+    uint64_t received_at = 0; // When the batch it was answered in was read, microseconds
+    uint64_t handle_ns = 0; // Time its handler spent running
+    // Its handler while it waits on the loop, like the ones on Connection
+    std::optional<Reply> reply;
+    Async<> task;
+    std::coroutine_handle<> waiting;
+    LoopWait wait = WAIT_NONE;
+    int wait_ms = 0;
+    TimerNode timer; // Its sleep
+    H2Stream *next_free = nullptr;
+
+    // Everything the handler wrote has been framed
+    bool drained() const { return pending_off == pending.size(); }
+
+    // Back to unused, for the next stream
+    void clear(){
+        task = Async<>();
+        reply.reset();
+        waiting = nullptr;
+        wait = WAIT_NONE;
+        arena.reset();
+        req = HttpRequest();
+        body.release();
+        pending.release();
+        sink = nullptr;
+        body_len = pending_off = resp_bytes = 0;
+        error = RESP_COUNT;
+        recv_done = started = queued = headers_out = resp_done = sent_done = reset = false;
+        handle_ns = 0;
+    }
+};
+
+// HTTP/2 side of one connection
+// receive() takes frames off the front of the read buffer, answers SETTINGS and PING and
+// window updates, and puts streams whose requests are complete on the ready list. Handlers'
+// responses go through respond() into each stream's pending bytes, and pump() frames what the
+// flow control windows allow onto the connection's OutQueue, one DATA frame per stream per round
+// so a big response never holds up a small one.
+// Only one thread touches a session at a time, the loop or the worker that has the connection.
+class H2Session {
+public:
+    H2Session(const RequestLimits &limits, size_t max_streams) : limits(limits), max_streams(max_streams) {}
+
+    ~H2Session(){
+        for (H2Stream *s : streams) delete s;
+        while (free_streams){
+            H2Stream *s = free_streams;
+            free_streams = s->next_free;
+            delete s;
+        }
+    }
+
+    Connection *conn = nullptr;
+    // Runs on the loop once a stream's headers are in, picks where its body goes (req.stream
+    // and sink). false refuses the body with a 413.
+    bool (*open_body)(H2Stream &s) = nullptr;
+    OutQueue scratch; // Where a stream's handler writes its HTTP/1.1 response
+
+    // Our SETTINGS and the bigger connection window, the first thing the server sends
+    // (after the 101 when it was an upgrade)
+    void start(){
+        char f[H2_FRAME_HEADER + 12 + H2_FRAME_HEADER + 4];
+        h2_frame_header(f, 12, H2_SETTINGS, 0, 0);
+        setting(f + H2_FRAME_HEADER, H2_SETTINGS_MAX_CONCURRENT_STREAMS, max_streams);
+        setting(f + H2_FRAME_HEADER + 6, H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_WINDOW);
+        h2_frame_header(f + H2_FRAME_HEADER + 12, 4, H2_WINDOW_UPDATE, 0, 0);
+        h2_put32(f + 2 * H2_FRAME_HEADER + 12, H2_WINDOW - H2_DEFAULT_WINDOW);
+        control.append(f, sizeof(f));
+        recv_window = H2_WINDOW;
+    }
+
+    // Upgrade: h2c, the 101 and our SETTINGS go out and the HTTP/1.1 request becomes stream 1
+    // settings is its HTTP2-Settings header, taken like a SETTINGS frame without an ACK.
+    // false if that doesn't decode, then nothing is queued and it's answered as HTTP/1.1.
+    bool upgrade(std::string_view settings, const HttpRequest &req){
+        Buffer payload;
+        if (!base64url_decode(settings, payload) || payload.size() % 6) return false;
+        static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+        control.append(switching, sizeof(switching) - 1);
+        start();
+        if (!apply_settings((const uint8_t *)payload.data(), payload.size())) return true; // GOAWAY is queued
+        H2Stream *s = open_stream(1);
+        last_stream = 1;
+        s->req = req;
+        s->req.version = "HTTP/2.0";
+        if (!copy_request(*s) || (!req.body.empty() && !s->body.reserve(req.body.size()))){
+            reset_stream(s, H2_INTERNAL_ERROR);
+            return true;
+        }
+        if (!req.body.empty()) s->body.append(req.body);
+        s->req.body = s->body.view();
+        s->recv_done = true;
+        make_ready(s);
+        return true;
+    }
+
+    // Bytes the next frame needs, so the read buffer can grow to fit it
+    size_t needed() const { return want; }
+
+    // Take whole frames off the front of p, returns how many bytes were used
+    // Once failed() nothing more is read, the GOAWAY is queued
+    size_t receive(const char *data, size_t n){
+        const uint8_t *p = (const uint8_t *)data;
+        size_t used = 0;
+        if (!prefaced){
+            size_t k = std::min(n, (size_t)H2_PREFACE_LEN);
+            if (memcmp(data, H2_PREFACE, k) != 0){
+                fail(H2_PROTOCOL_ERROR);
+                return n;
+            }
+            if (k < H2_PREFACE_LEN) return 0;
+            prefaced = true;
+            used = H2_PREFACE_LEN;
+        }
+        want = H2_FRAME_HEADER;
+        while (!failed_ && n - used >= H2_FRAME_HEADER){
+            const uint8_t *h = p + used;
+            size_t len = (size_t)h[0] << 16 | (size_t)h[1] << 8 | h[2];
+            if (len > H2_MAX_FRAME){
+                fail(H2_FRAME_SIZE_ERROR);
+                break;
+            }
+            if (n - used < H2_FRAME_HEADER + len){
+                want = H2_FRAME_HEADER + len;
+                break;
+            }
+            frame(h[3], h[4], h2_get32(h + 5) & 0x7fffffff, h + H2_FRAME_HEADER, len);
+            used += H2_FRAME_HEADER + len;
+        }
+        return failed_ ? n : used;
+    }
+
+    bool failed() const { return failed_; }
+    // The client said it's done with the connection
+    bool peer_done() const { return peer_goaway; }
+
+    H2Stream *next_ready(){
+        if (ready_next == ready.size()){
+            ready.clear();
+            ready_next = 0;
+            return nullptr;
+        }
+        H2Stream *s = ready[ready_next++];
+        s->queued = false;
+        return s;
+    }
+
+    bool has_ready() const { return ready_next < ready.size(); }
+
+    // Request complete, or a waiting handler can go on
+    void make_ready(H2Stream *s){
+        if (s->queued) return;
+        s->queued = true;
+        s->started = true;
+        ready.push_back(s);
+    }
+
+    // New streams on the ready list get REFUSED_STREAM, the client can retry them
+    // Waiting handlers still get to finish
+    void refuse_new(){
+        for (size_t i = ready_next; i < ready.size(); ++i){
+            H2Stream *s = ready[i];
+            if (s->task || s->reset) continue;
+            count(h2_stats.refused);
+            reset_stream(s, H2_REFUSED_STREAM);
+        }
+    }
+
+    // Add what the stream's handler wrote to scratch since last time, done once it finished
+    // Runs on whichever thread ran the handler
+    void respond(H2Stream &s, bool done){
+        size_t n = scratch.size();
+        if (s.reset){
+            scratch.clear();
+            s.resp_done = done;
+            return;
+        }
+        if (n){
+            if (!s.pending.reserve(n) || !scratch.gather(0, s.pending.tail())){
+                scratch.clear();
+                reset_stream(&s, H2_INTERNAL_ERROR);
+                return;
+            }
+            s.pending.commit(n);
+            s.resp_bytes += n;
+        }
+        scratch.clear();
+        if (!s.headers_out){
+            std::string_view rest(s.pending.data() + s.pending_off, s.pending.size() - s.pending_off);
+            size_t head = rest.find("\r\n\r\n");
+            if (head == std::string_view::npos){
+                if (done) reset_stream(&s, H2_INTERNAL_ERROR); // Not an HTTP response
+                return;
+            }
+            bool end = done && head + 4 == rest.size();
+            if (!send_headers(s, rest.substr(0, head + 2), end)){
+                reset_stream(&s, H2_INTERNAL_ERROR);
+                return;
+            }
+            s.pending_off += head + 4;
+            s.headers_out = true;
+            if (end){
+                s.resp_done = s.sent_done = true;
+                end_stream(&s);
+                return;
+            }
+        }
+        s.resp_done = done;
+    }
+
+    // Frame what's waiting: control frames and HEADERS first, then DATA round-robin over the
+    // streams as far as the windows go. Bodies are referenced from the streams' pending bytes,
+    // so nothing in a stream can move until out is written and collect() runs.
+    void pump(OutQueue &out){
+        if (!control.empty()){
+            out.append(control.view());
+            control.clear();
+        }
+        if (failed_) return;
+        bool progress = true;
+        while (progress && out.remaining() < H2_PUMP_MAX){
+            progress = false;
+            for (H2Stream *s : streams){
+                if (s->reset || s->sent_done || !s->headers_out) continue;
+                size_t avail = s->pending.size() - s->pending_off;
+                if (avail == 0 && !s->resp_done) continue;
+                int64_t room = std::min(conn_send, s->send_window);
+                size_t w = std::min(avail, (size_t)std::max<int64_t>(0, std::min<int64_t>(room, H2_MAX_FRAME)));
+                if (avail > 0 && w == 0) continue; // Waiting on a WINDOW_UPDATE
+                bool end = s->resp_done && w == avail;
+                char h[H2_FRAME_HEADER];
+                h2_frame_header(h, w, H2_DATA, end ? H2_FLAG_END_STREAM : 0, s->id);
+                out.append(h, sizeof(h));
+                out.body(std::string_view(s->pending.data() + s->pending_off, w), BODY_STABLE);
+                s->pending_off += w;
+                conn_send -= w;
+                s->send_window -= w;
+                progress = true;
+                if (end){
+                    s->sent_done = true;
+                    end_stream(s);
+                }
+            }
+        }
+        if (!control.empty()){
+            out.append(control.view()); // RST_STREAMs for requests answered before they finished
+            control.clear();
+        }
+    }
+
+    // Once what pump() queued is written: finished streams are freed, drained buffers reused
+    // Streams with a handler still waiting are the loop's to drop first
+    void collect(){
+        size_t keep = 0;
+        for (H2Stream *s : streams){
+            if ((s->sent_done || s->reset) && !s->task && !s->queued){
+                s->clear();
+                s->next_free = free_streams;
+                free_streams = s;
+                continue;
+            }
+            if (s->drained() && !s->pending.empty()){
+                s->pending.clear();
+                s->pending_off = 0;
+            }
+            streams[keep++] = s;
+        }
+        streams.resize(keep);
+    }
+
+    // Give up on the session, GOAWAY and every stream reset
+    void abort(H2Error err){
+        if (!failed_) fail(err);
+    }
+
+    // No streams left and nothing to send
+    bool idle() const { return streams.empty() && control.empty(); }
+
+    // Some request is still coming in
+    bool receiving() const {
+        for (H2Stream *s : streams){
+            if (!s->recv_done && !s->reset) return true;
+        }
+        return false;
+    }
+
+    // Some response is stuck behind the client's flow control window
+    bool blocked() const {
+        for (H2Stream *s : streams){
+            if (!s->reset && s->headers_out && !s->drained() && (conn_send <= 0 || s->send_window <= 0)) return true;
+        }
+        return false;
+    }
+
+    template <typename F>
+    void each(F fn){
+        for (H2Stream *s : streams) fn(*s);
+    }
+
+private:
+    static void setting(char *p, uint16_t id, uint32_t v){
+        p[0] = (char)(id >> 8);
+        p[1] = (char)id;
+        h2_put32(p + 2, v);
+    }
+
+    void frame(uint8_t type, uint8_t flags, uint32_t id, const uint8_t *p, size_t len){
+        // A header block is one piece, nothing can come between its frames
+        if (continuing && (type != H2_CONTINUATION || id != block_stream)){
+            fail(H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (!got_settings && type != H2_SETTINGS){
+            fail(H2_PROTOCOL_ERROR); // The preface ends with SETTINGS
+            return;
+        }
+        switch (type){
+            case H2_DATA: on_data(flags, id, p, len); break;
+            case H2_HEADERS: on_headers(flags, id, p, len); break;
+            case H2_PRIORITY:
+                if (id == 0) fail(H2_PROTOCOL_ERROR);
+                else if (len != 5) fail(H2_FRAME_SIZE_ERROR);
+                break; // Priorities are only a hint, every stream gets its turn
+            case H2_RST_STREAM: on_rst(id, p, len); break;
+            case H2_SETTINGS: on_settings(flags, id, p, len); break;
+            case H2_PUSH_PROMISE: fail(H2_PROTOCOL_ERROR); break; // Clients can't push
+            case H2_PING: on_ping(flags, id, p, len); break;
+            case H2_GOAWAY:
+                if (id != 0) fail(H2_PROTOCOL_ERROR);
+                peer_goaway = true;
+                break;
+            case H2_WINDOW_UPDATE: on_window_update(id, p, len); break;
+            case H2_CONTINUATION:
+                if (!continuing){
+                    fail(H2_PROTOCOL_ERROR);
+                    break;
+                }
+                if (block.size() + len > limits.header_bytes){
+                    fail(H2_ENHANCE_YOUR_CALM); // Can't skip it, the HPACK table would fall out of step
+                    break;
+                }
+                block.append((const char *)p, len);
+                if (flags & H2_FLAG_END_HEADERS){
+                    end_block((const uint8_t *)block.data(), block.size());
+                    block.clear();
+                }
+                break;
+            default: break; // Unknown frames are ignored
+        }
+    }
+
+    // Strips padding, false if there's more padding than frame
+    static bool unpad(uint8_t flags, const uint8_t *&p, size_t &len){
+        if (!(flags & H2_FLAG_PADDED)) return true;
+        if (len < 1 || p[0] >= len) return false;
+        len -= 1 + p[0];
+        ++p;
+        return true;
+    }
+
+    void on_headers(uint8_t flags, uint32_t id, const uint8_t *p, size_t len){
+        if (id == 0 || !(id & 1) || !unpad(flags, p, len)){
+            fail(H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (flags & H2_FLAG_PRIORITY){
+            if (len < 5){
+                fail(H2_FRAME_SIZE_ERROR);
+                return;
+            }
+            p += 5;
+            len -= 5;
+        }
+        block_stream = id;
+        block_end_stream = flags & H2_FLAG_END_STREAM;
+        if (flags & H2_FLAG_END_HEADERS){
+            end_block(p, len); // One frame, decoded right where it is
+            return;
+        }
+        continuing = true;
+        block.clear();
+        block.append((const char *)p, len);
+    }
+
+    // A whole header block for block_stream
+    void end_block(const uint8_t *p, size_t len){
+        continuing = false;
+        uint32_t id = block_stream;
+        H2Stream *s = find(id);
+        bool over;
+        if (s || id <= last_stream || failed_ || peer_goaway || streams.size() >= max_streams){
+            // Trailers, or a stream that won't be answered, only decoded to keep HPACK in step
+            junk.reset();
+            if (!decoder.decode(p, len, junk, 0, over, [](std::string_view, std::string_view){})){
+                fail(H2_COMPRESSION_ERROR);
+                return;
+            }
+            if (s){
+                if (s->recv_done || !block_end_stream){
+                    reset_stream(s, H2_PROTOCOL_ERROR); // Trailers have to end the stream
+                    return;
+                }
+                s->recv_done = true;
+                if (!s->started) make_ready(s);
+            }
+            else if (id > last_stream){
+                last_stream = id;
+                count(h2_stats.refused);
+                rst(id, H2_REFUSED_STREAM);
+            }
+            else{
+                fail(H2_STREAM_CLOSED); // Stream ids can't be reused
+            }
+            return;
+        }
+        last_stream = id;
+        s = open_stream(id);
+        // Pseudo-headers become the request line, :authority becomes Host
+        HttpRequest &req = s->req;
+        std::string_view authority;
+        bool host = false, malformed = false, too_many = false;
+        bool ok = decoder.decode(p, len, s->arena, limits.header_bytes, over,
+                                 [&](std::string_view name, std::string_view value){
+            if (!name.empty() && name[0] == ':'){
+                if (name == ":method") req.method = value;
+                else if (name == ":path") req.uri = value;
+                else if (name == ":authority") authority = value;
+                else if (name != ":scheme") malformed = true;
+                return;
+            }
+            host = host || name == "host";
+            if (req.header_count == limits.header_count){
+                too_many = true;
+                return;
+            }
+            req.headers[req.header_count++] = HttpHeader{name, value};
+        });
+        if (!ok){
+            fail(H2_COMPRESSION_ERROR);
+            return;
+        }
+        count(h2_stats.streams);
+        s->recv_done = block_end_stream;
+        if (malformed || !is_token(req.method) || req.uri.empty()){
+            reset_stream(s, H2_PROTOCOL_ERROR);
+            return;
+        }
+        req.version = "HTTP/2.0";
+        if (!authority.empty() && !host && req.header_count < MAX_HEADERS){
+            req.headers[req.header_count++] = HttpHeader{"host", authority};
+        }
+        if (over || too_many){
+            s->error = RESP_HEADERS_TOO_LARGE;
+        }
+        else if (open_body && !open_body(*s)){
+            s->error = RESP_BODY_TOO_LARGE;
+        }
+        // Refused ones are answered right away, the rest once their body is in
+        if (s->recv_done || s->error != RESP_COUNT) make_ready(s);
+    }
+
+    void on_data(uint8_t flags, uint32_t id, const uint8_t *p, size_t len){
+        if (id == 0){
+            fail(H2_PROTOCOL_ERROR);
+            return;
+        }
+        // Padding counts against the windows too
+        recv_window -= len;
+        if (recv_window < 0){
+            fail(H2_FLOW_CONTROL_ERROR);
+            return;
+        }
+        if (recv_window <= H2_WINDOW / 2){
+            window_update(0, H2_WINDOW - recv_window);
+            recv_window = H2_WINDOW;
+        }
+        size_t frame_len = len;
+        if (!unpad(flags, p, len)){
+            fail(H2_PROTOCOL_ERROR);
+            return;
+        }
+        H2Stream *s = find(id);
+        if (!s){
+            if (id > last_stream) fail(H2_PROTOCOL_ERROR); // Never opened
+            return; // Already answered and closed, dropped
+        }
+        if (s->recv_done){
+            reset_stream(s, H2_STREAM_CLOSED);
+            return;
+        }
+        s->recv_window -= frame_len;
+        if (s->recv_window < 0){
+            reset_stream(s, H2_FLOW_CONTROL_ERROR);
+            return;
+        }
+        s->recv_done = flags & H2_FLAG_END_STREAM;
+        if (s->reset || s->error != RESP_COUNT) return; // Answered already, the body isn't wanted
+        s->body_len += len;
+        if (s->sink){
+            if (s->body_len > limits.stream_body) s->error = RESP_BODY_TOO_LARGE;
+            else if (len) s->sink(s->req.stream, std::string_view((const char *)p, len));
+        }
+        else if (s->body_len > limits.body || !s->body.reserve(len)){
+            s->error = RESP_BODY_TOO_LARGE;
+        }
+        else{
+            s->body.append((const char *)p, len);
+        }
+        if (s->error != RESP_COUNT){
+            make_ready(s); // 413 now, the rest of the body is thrown away
+            return;
+        }
+        if (s->recv_done){
+            s->req.body = s->body.view();
+            make_ready(s);
+        }
+        else if (s->recv_window <= H2_WINDOW / 2){
+            window_update(id, H2_WINDOW - s->recv_window);
+            s->recv_window = H2_WINDOW;
+        }
+    }
+
+    void on_rst(uint32_t id, const uint8_t *, size_t len){
+        if (len != 4){
+            fail(H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (id == 0 || id > last_stream){
+            fail(H2_PROTOCOL_ERROR);
+            return;
+        }
+        count(h2_stats.resets_received);
+        H2Stream *s = find(id);
+        if (s) s->reset = true; // A handler waiting on it is dropped by the loop
+    }
+
+    void on_settings(uint8_t flags, uint32_t id, const uint8_t *p, size_t len){
+        if (id != 0){
+            fail(H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (flags & H2_FLAG_ACK){
+            if (len) fail(H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (len % 6){
+            fail(H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (!apply_settings(p, len)) return;
+        got_settings = true;
+        char ack[H2_FRAME_HEADER];
+        h2_frame_header(ack, 0, H2_SETTINGS, H2_FLAG_ACK, 0);
+        control.append(ack, sizeof(ack));
+    }
+
+    bool apply_settings(const uint8_t *p, size_t len){
+        for (size_t i = 0; i + 6 <= len; i += 6){
+            uint16_t key = (uint16_t)(p[i] << 8 | p[i + 1]);
+            uint32_t v = h2_get32(p + i + 2);
+            if (key == H2_SETTINGS_HEADER_TABLE_SIZE){
+                encoder.set_max(v);
+            }
+            else if (key == H2_SETTINGS_ENABLE_PUSH && v > 1){
+                fail(H2_PROTOCOL_ERROR);
+                return false;
+            }
+            else if (key == H2_SETTINGS_INITIAL_WINDOW_SIZE){
+                if (v > H2_MAX_WINDOW){
+                    fail(H2_FLOW_CONTROL_ERROR);
+                    return false;
+                }
+                // Moves every open stream's window by the difference, it can go negative
+                for (H2Stream *s : streams) s->send_window += (int64_t)v - peer_window;
+                peer_window = v;
+            }
+            else if (key == H2_SETTINGS_MAX_FRAME_SIZE && (v < H2_MAX_FRAME || v > 0xffffff)){
+                fail(H2_PROTOCOL_ERROR);
+                return false;
+            }
+            // Bigger frames, concurrency and header list limits for pushes don't change anything we send
+        }
+        return true;
+    }
+
+    void on_ping(uint8_t flags, uint32_t id, const uint8_t *p, size_t len){
+        if (id != 0){
+            fail(H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (len != 8){
+            fail(H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        if (flags & H2_FLAG_ACK) return;
+        char pong[H2_FRAME_HEADER + 8];
+        h2_frame_header(pong, 8, H2_PING, H2_FLAG_ACK, 0);
+        memcpy(pong + H2_FRAME_HEADER, p, 8);
+        control.append(pong, sizeof(pong));
+    }
+
+    void on_window_update(uint32_t id, const uint8_t *p, size_t len){
+        if (len != 4){
+            fail(H2_FRAME_SIZE_ERROR);
+            return;
+        }
+        int64_t inc = h2_get32(p) & 0x7fffffff;
+        if (id == 0){
+            conn_send += inc;
+            if (inc == 0) fail(H2_PROTOCOL_ERROR);
+            else if (conn_send > H2_MAX_WINDOW) fail(H2_FLOW_CONTROL_ERROR);
+            return;
+        }
+        H2Stream *s = find(id);
+        if (!s){
+            if (id > last_stream) fail(H2_PROTOCOL_ERROR);
+            return;
+        }
+        s->send_window += inc;
+        if (inc == 0) reset_stream(s, H2_PROTOCOL_ERROR);
+        else if (s->send_window > H2_MAX_WINDOW) reset_stream(s, H2_FLOW_CONTROL_ERROR);
+    }
+
+    // The HEADERS frame for an HTTP/1.1 response head, status line and header lines with CRLFs
+    // Headers that only mean something to HTTP/1.1 are dropped, the rest are lowercased
+    bool send_headers(H2Stream &s, std::string_view head, bool end){
+        size_t at = control.size();
+        if (!control.reserve(H2_FRAME_HEADER)) return false;
+        control.commit(H2_FRAME_HEADER);
+        encoder.begin(control);
+        size_t eol = head.find("\r\n");
+        std::string_view status = head.substr(0, eol);
+        if (status.size() < 12) return false;
+        encoder.encode(control, ":status", status.substr(9, 3), true);
+        head.remove_prefix(eol + 2);
+        char name[256];
+        while (!head.empty()){
+            eol = head.find("\r\n");
+            std::string_view line = head.substr(0, eol);
+            head.remove_prefix(eol == std::string_view::npos ? head.size() : eol + 2);
+            size_t colon = line.find(':');
+            if (colon == std::string_view::npos || colon > sizeof(name)) continue;
+            for (size_t i = 0; i < colon; ++i) name[i] = (char)tolower((unsigned char)line[i]);
+            std::string_view n(name, colon);
+            if (n == "connection" || n == "keep-alive" || n == "transfer-encoding" || n == "upgrade" ||
+                n == "proxy-connection"){
+                continue;
+            }
+            // Lengths change every response, remembering them would only push out the others
+            encoder.encode(control, n, trim(line.substr(colon + 1)), n != "content-length");
+        }
+        size_t block_len = control.size() - at - H2_FRAME_HEADER;
+        uint8_t flags = end ? H2_FLAG_END_STREAM : 0;
+        if (block_len <= H2_MAX_FRAME){
+            h2_frame_header(control.data() + at, block_len, H2_HEADERS, flags | H2_FLAG_END_HEADERS, s.id);
+            return true;
+        }
+        // Too big for one frame, the rest goes in CONTINUATIONs right behind it
+        char *copy = s.arena.alloc_chars(block_len);
+        if (!copy) return false;
+        memcpy(copy, control.data() + at + H2_FRAME_HEADER, block_len);
+        control.resize(at);
+        for (size_t off = 0; off < block_len; off += H2_MAX_FRAME){
+            size_t n = std::min(block_len - off, (size_t)H2_MAX_FRAME);
+            bool last = off + n == block_len;
+            char h[H2_FRAME_HEADER];
+            h2_frame_header(h, n, off ? H2_CONTINUATION : H2_HEADERS,
+                            (off ? 0 : flags) | (last ? H2_FLAG_END_HEADERS : 0), s.id);
+            control.append(h, sizeof(h));
+            control.append(copy + off, n);
+        }
+        return true;
+    }
+
+    // The response is all framed, if the request isn't all here yet say we don't want the rest
+    void end_stream(H2Stream *s){
+        if (!s->recv_done) rst(s->id, H2_NO_ERROR);
+    }
+
+    H2Stream *find(uint32_t id) const {
+        for (H2Stream *s : streams){
+            if (s->id == id) return s;
+        }
+        return nullptr;
+    }
+
+    H2Stream *open_stream(uint32_t id){
+        H2Stream *s = free_streams;
+        if (s) free_streams = s->next_free;
+        else s = new H2Stream();
+        s->id = id;
+        s->conn = conn;
+        s->send_window = peer_window;
+        s->recv_window = H2_WINDOW;
+        s->received_at = 0;
+        streams.push_back(s);
+        return s;
+    }
+
+    // Request's strings into the stream's arena, they pointed at the read buffer
+    bool copy_request(H2Stream &s){
+        auto copy = [&](std::string_view &v){
+            char *dst = s.arena.alloc_chars(v.size() + 1);
+            if (!dst) return false;
+            memcpy(dst, v.data(), v.size());
+            v = std::string_view(dst, v.size());
+            return true;
+        };
+        HttpRequest &req = s.req;
+        bool ok = copy(req.method) && copy(req.uri);
+        for (size_t i = 0; ok && i < req.header_count; ++i){
+            ok = copy(req.headers[i].name) && copy(req.headers[i].value);
+        }
+        return ok;
+    }
+
+    void reset_stream(H2Stream *s, H2Error err){
+        if (s->reset) return;
+        s->reset = true;
+        rst(s->id, err);
+    }
+
+    void rst(uint32_t id, H2Error err){
+        count(h2_stats.resets_sent);
+        char f[H2_FRAME_HEADER + 4];
+        h2_frame_header(f, 4, H2_RST_STREAM, 0, id);
+        h2_put32(f + H2_FRAME_HEADER, err);
+        control.append(f, sizeof(f));
+    }
+
+    void window_update(uint32_t id, uint32_t inc){
+        char f[H2_FRAME_HEADER + 4];
+        h2_frame_header(f, 4, H2_WINDOW_UPDATE, 0, id);
+        h2_put32(f + H2_FRAME_HEADER, inc);
+        control.append(f, sizeof(f));
+    }
+
+    // Connection error, GOAWAY says which and how far we got, nothing else goes out after
+    void fail(H2Error err){
+        count(h2_stats.goaways);
+        failed_ = true;
+        char f[H2_FRAME_HEADER + 8];
+        h2_frame_header(f, 8, H2_GOAWAY, 0, 0);
+        h2_put32(f + H2_FRAME_HEADER, last_stream);
+        h2_put32(f + H2_FRAME_HEADER + 4, err);
+        control.append(f, sizeof(f));
+        for (H2Stream *s : streams){
+            s->reset = true;
+            s->queued = false;
+        }
+        ready.clear();
+        ready_next = 0;
+    }
+
+    const RequestLimits &limits;
+    size_t max_streams;
+    HpackDecoder decoder;
+    HpackEncoder encoder;
+    Buffer control; // Frames that aren't flow controlled, sent before any DATA
+    Buffer block; // Header block split over CONTINUATIONs
+    Arena junk; // Fields of header blocks nobody will use
+    std::vector<H2Stream *> streams; // Open ones, in the order they came
+    std::vector<H2Stream *> ready;
+    size_t ready_next = 0;
+    H2Stream *free_streams = nullptr;
+    size_t want = H2_PREFACE_LEN;
+    uint32_t last_stream = 0; // Highest stream the client opened
+    uint32_t block_stream = 0;
+    bool block_end_stream = false;
+    bool continuing = false; // In a header block, only CONTINUATIONs for it can come next
+    bool prefaced = false;
+    bool got_settings = false;
+    bool failed_ = false;
+    bool peer_goaway = false;
+    int64_t conn_send = H2_DEFAULT_WINDOW; // Connection window for what we send
+    int64_t recv_window = H2_DEFAULT_WINDOW; // ...and for what the client sends
+    int64_t peer_window = H2_DEFAULT_WINDOW; // Client's SETTINGS_INITIAL_WINDOW_SIZE
+};
+
+#endif
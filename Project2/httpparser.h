@@ -0,0 +1,560 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Zero-copy HTTP request parser and form decoding
+
+#ifndef HTTPPARSER_H
+#define HTTPPARSER_H
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "arena.h"
+
+#define MAX_HEADERS 64 // Headers kept per request
+#define MAX_HEADER_BYTES 65536 // Request line plus headers
+#define CHUNK_LINE_MAX 1024 // Chunk size line with its extensions
+#define MAX_FORM_FIELDS 32 // key=value pairs kept from a form body
+
+// One header, both views point into the connection buffer
+struct HttpHeader {
+    std::string_view name;
+    std::string_view value;
+};
+
+// Parsed request, every field is a view into the connection buffer
+// Nothing is copied so it is only good until the buffer is reused
+struct HttpRequest {
+    std::string_view method; // GET/POST/DELTE
+    std::string_view uri; // /index /multiply
+    std::string_view version; // HTTP/1,1
+    HttpHeader headers[MAX_HEADERS]; // Header data
+    size_t header_count = 0;
+    std::string_view body; // POST data
+    void *stream = nullptr; // The route's BodyConsumer state when the body was streamed instead
+};
+
+// Case-insensitive compare for header names and tokens
+static inline bool iequals(std::string_view a, std::string_view b){
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i){
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) return false;
+    }
+    return true;
+}
+
+// RFC 9110 token, what a method or header name is made of
+static inline bool is_token(std::string_view v){
+    if (v.empty()) return false;
+    for (unsigned char ch : v){
+        if (!isalnum(ch) && std::string_view("!#$%&'*+-.^_`|~").find(ch) == std::string_view::npos) return false;
+    }
+    return true;
+}
+
+// Get rid of spaces on both ends
+static inline std::string_view trim(std::string_view v){
+    while (!v.empty() && (v.front() == ' ' || v.front() == '\t')) v.remove_prefix(1);
+    while (!v.empty() && (v.back() == ' ' || v.back() == '\t')) v.remove_suffix(1);
+    return v;
+}
+
+// Delimiter search
+// Index of the first byte in p[0..n) equal to a, b or c, n if there is none
+// Picks AVX2 or SSE4.2 at startup when the CPU has them
+static inline size_t find_any_scalar(const char *p, size_t n, char a, char b, char c){
+    for (size_t i = 0; i < n; ++i){
+        if (p[i] == a || p[i] == b || p[i] == c) return i;
+    }
+    return n;
+}
+
+__attribute__((target("sse4.2")))
+static inline size_t find_any_sse42(const char *p, size_t n, char a, char b, char c){
+    // Equal-any compare against the set, 16 bytes per step
+    // https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html#text=_mm_cmpestri
+    const __m128i set = _mm_setr_epi8(a, b, c, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16){
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(p + i));
+        int idx = _mm_cmpestri(set, 3, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (idx < 16) return i + idx;
+    }
+    return i + find_any_scalar(p + i, n - i, a, b, c);
+}
+
+__attribute__((target("avx2")))
+static inline size_t find_any_avx2(const char *p, size_t n, char a, char b, char c){
+    // Compare 32 bytes against each delimiter, first set bit of the mask is the match
+    const __m256i va = _mm256_set1_epi8(a);
+    const __m256i vb = _mm256_set1_epi8(b);
+    const __m256i vc = _mm256_set1_epi8(c);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32){
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, va), _mm256_cmpeq_epi8(chunk, vb)),
+                                      _mm256_cmpeq_epi8(chunk, vc));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + find_any_scalar(p + i, n - i, a, b, c);
+}
+
+typedef size_t (*find_any_fn)(const char *, size_t, char, char, char);
+
+static inline find_any_fn pick_find_any(){
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return find_any_avx2;
+    if (__builtin_cpu_supports("sse4.2")) return find_any_sse42;
+    return find_any_scalar;
+}
+static const find_any_fn find_any = pick_find_any();
+
+// Result of trying to parse what has been read so far
+enum ParseStatus {
+    PARSE_INCOMPLETE, // Need more bytes
+    PARSE_HEAD, // Headers are in, call start_body() before the body gets parsed
+    PARSE_DONE, // Full request in req
+    // Errors, the client is told which one and the connection closes
+    PARSE_INVALID, // Malformed, 400
+    PARSE_URI_TOO_LONG, // Request line over the limit, 414
+    PARSE_HEADERS_TOO_BIG, // Too many headers or header bytes, 431
+    PARSE_BODY_TOO_BIG, // Body over the limit, 413
+    PARSE_UNSUPPORTED // Transfer-Encoding we can't decode, 501
+};
+
+static inline bool parse_failed(ParseStatus st){ return st >= PARSE_INVALID; }
+
+// Request size limits, a request over any of them is refused before it takes more memory
+struct RequestLimits {
+    size_t request_line = 8192; // Method, URI and version with the CRLF
+    size_t header_count = MAX_HEADERS;
+    size_t header_bytes = MAX_HEADER_BYTES; // Request line plus headers
+    size_t body = 1 << 20; // Bodies kept in memory for the handler
+    size_t stream_body = (size_t)1 << 30; // Bodies handed to a BodyConsumer as they arrive
+};
+
+// Gets the body a piece at a time as it is parsed, for requests whose body isn't kept
+typedef void (*BodySinkFn)(void *state, std::string_view piece);
+
+// Resumable request parser
+// Works in place on the connection buffer and picks up where the last read stopped,
+// so bytes are only looked at once no matter how slowly they arrive.
+// Positions are offsets from the start of the request so the buffer can be moved.
+class HttpParser {
+public:
+    HttpParser(){ reset(); }
+
+    // Forget the current request, the next one starts fresh
+    void reset(){
+        state = REQUEST_LINE;
+        pos = 0;
+        line_start = 0;
+        header_count = 0;
+        content_length = 0;
+        has_length = false;
+        chunked = false;
+        body_start = 0;
+        body_end = 0;
+        remaining = 0;
+        body_size = 0;
+        max_body = 0;
+        trailer_bytes = 0;
+        sink = nullptr;
+        sink_state = nullptr;
+    }
+
+    // data is the first byte of the request, len is how much of it has arrived
+    // Chunk framing is cut out of the body in place and bytes a sink took are dropped,
+    // so len can come back smaller; whatever follows the request moves down with it.
+    // On PARSE_HEAD and PARSE_DONE req holds views into data, on PARSE_DONE consumed()
+    // is the request's size.
+    ParseStatus parse(char *data, size_t &len, HttpRequest &req, const RequestLimits &limits){
+        if (state == REQUEST_LINE || state == HEADERS){
+            ParseStatus st = parse_head(data, len, limits);
+            if (st != PARSE_HEAD) return st;
+        }
+        if (state == BODY_START){
+            fill(data, req); // Enough to pick where the body goes
+            return PARSE_HEAD;
+        }
+        if (state != COMPLETE){
+            ParseStatus st = parse_body(data, len, limits);
+            if (st != PARSE_DONE) return st;
+        }
+        fill(data, req);
+        return PARSE_DONE;
+    }
+
+    // After PARSE_HEAD, where the body goes
+    // fn gets it a piece at a time and req.body stays empty, or with no fn it's kept for req.body.
+    // False when the Content-Length is already over max, nothing has been read then.
+    bool start_body(BodySinkFn fn, void *state_arg, size_t max){
+        sink = fn;
+        sink_state = state_arg;
+        max_body = max;
+        if (content_length > max) return false;
+        remaining = content_length;
+        state = chunked ? CHUNK_SIZE : BODY;
+        return true;
+    }
+
+    // Bytes the finished request took, the next pipelined one starts after it
+    size_t consumed() const { return pos; }
+
+    // Bytes needed to hold the whole request, 0 while that isn't known
+    size_t needed() const { return state == BODY && !sink ? pos + remaining : 0; }
+
+    // Past the headers and waiting on the body
+    bool in_body() const { return state != REQUEST_LINE && state != HEADERS && state != COMPLETE; }
+
+private:
+    enum State { REQUEST_LINE, HEADERS, BODY_START, BODY, CHUNK_SIZE, CHUNK_DATA, CHUNK_END, TRAILERS, COMPLETE };
+    struct Span { uint32_t off, len; };
+
+    static Span span(std::string_view part, size_t line_off, const char *line){
+        return Span{(uint32_t)(line_off + (part.data() - line)), (uint32_t)part.size()};
+    }
+
+    // Request line and headers, PARSE_HEAD once the blank line is in
+    ParseStatus parse_head(const char *data, size_t len, const RequestLimits &limits){
+        while (true){
+            // Find the end of the current line, only scanning new bytes
+            size_t eol = pos + find_any(data + pos, len - pos, '\r', '\n', '\n');
+            if (eol == len){
+                pos = len;
+                return over_limit(len, limits); // Too much data already?
+            }
+            // Lines end in CRLF, a bare CR or LF is malformed
+            if (data[eol] != '\r') return PARSE_INVALID;
+            if (eol + 1 == len){
+                pos = eol; // Come back for the LF
+                return over_limit(len, limits);
+            }
+            if (data[eol + 1] != '\n') return PARSE_INVALID;
+            ParseStatus st = over_limit(eol + 2, limits);
+            if (st != PARSE_INCOMPLETE) return st;
+
+            std::string_view line(data + line_start, eol - line_start);
+            size_t at = line_start;
+            line_start = pos = eol + 2;
+            if (state == REQUEST_LINE){
+                if (!parse_request_line(line, at)) return PARSE_INVALID;
+                state = HEADERS;
+            }
+            else if (line.empty()){
+                // Blank line ends the headers
+                // Both framings at once is how requests get smuggled past proxies
+                if (chunked && has_length) return PARSE_INVALID;
+                body_start = body_end = pos;
+                state = (chunked || content_length) ? BODY_START : COMPLETE;
+                return PARSE_HEAD;
+            }
+            else{
+                st = parse_header(line, at, limits);
+                if (st != PARSE_DONE) return st;
+            }
+        }
+    }
+
+    // The head so far ends at end, has it gone over a limit
+    ParseStatus over_limit(size_t end, const RequestLimits &limits) const {
+        if (state == REQUEST_LINE && end > limits.request_line) return PARSE_URI_TOO_LONG;
+        if (end > limits.header_bytes) return PARSE_HEADERS_TOO_BIG;
+        return PARSE_INCOMPLETE;
+    }
+
+    // METHOD SP URI SP VERSION
+    bool parse_request_line(std::string_view line, size_t at){
+        std::string_view parts[3];
+        size_t n = 0;
+        size_t i = 0;
+        while (i < line.size()){
+            while (i < line.size() && line[i] == ' ') ++i;
+            if (i == line.size()) break;
+            size_t j = i;
+            while (j < line.size() && line[j] != ' ') ++j;
+            if (n == 3) return false; // Extra junk on the line
+            parts[n++] = line.substr(i, j - i);
+            i = j;
+        }
+        // If request doesn't have method/uri/version invalid
+        if (n != 3) return false;
+        method = span(parts[0], at, line.data());
+        uri = span(parts[1], at, line.data());
+        version = span(parts[2], at, line.data());
+        return true;
+    }
+
+    // format- key: value
+    // PARSE_DONE if the header is fine
+    ParseStatus parse_header(std::string_view line, size_t at, const RequestLimits &limits){
+        size_t c = find_any(line.data(), line.size(), ':', ':', ':');
+        if (c == line.size() || c == 0) return PARSE_INVALID;
+        if (header_count == limits.header_count) return PARSE_HEADERS_TOO_BIG;
+        std::string_view key = line.substr(0, c);
+        std::string_view val = trim(line.substr(c + 1));
+        // Get content length
+        if (iequals(key, "Content-Length")){
+            size_t n;
+            auto res = std::from_chars(val.data(), val.data() + val.size(), n);
+            if (res.ec == std::errc::result_out_of_range) return PARSE_BODY_TOO_BIG;
+            if (res.ec != std::errc() || res.ptr != val.data() + val.size()) return PARSE_INVALID; // Not a number
+            if (has_length && n != content_length) return PARSE_INVALID; // Two different lengths
+            content_length = n;
+            has_length = true;
+        }
+        else if (iequals(key, "Transfer-Encoding")){
+            // Only plain chunked, anything layered under it would need decoding too
+            if (!iequals(val, "chunked")) return PARSE_UNSUPPORTED;
+            if (chunked) return PARSE_INVALID;
+            chunked = true;
+        }
+        names[header_count] = span(key, at, line.data());
+        values[header_count] = span(val, at, line.data());
+        ++header_count;
+        return PARSE_DONE;
+    }
+
+    // Content-Length or chunked body, PARSE_DONE once all of it is in
+    ParseStatus parse_body(char *data, size_t &len, const RequestLimits &limits){
+        while (state != COMPLETE){
+            if (state == BODY || state == CHUNK_DATA){
+                size_t n = std::min(remaining, len - pos);
+                take(data, n);
+                remaining -= n;
+                if (remaining > 0) break; // Rest hasn't arrived
+                state = (state == BODY) ? COMPLETE : CHUNK_END;
+                continue;
+            }
+            // Chunked framing is all CRLF lines
+            size_t eol = pos + find_any(data + pos, len - pos, '\n', '\n', '\n');
+            if (eol == len){
+                if (state == TRAILERS && trailer_bytes + (len - pos) > limits.header_bytes) return PARSE_HEADERS_TOO_BIG;
+                if (state != TRAILERS && len - pos > CHUNK_LINE_MAX) return PARSE_INVALID;
+                break;
+            }
+            if (eol == pos || data[eol - 1] != '\r') return PARSE_INVALID;
+            std::string_view line(data + pos, eol - 1 - pos);
+            pos = eol + 1;
+            if (state == CHUNK_END){
+                if (!line.empty()) return PARSE_INVALID; // Chunk ran past its size
+                state = CHUNK_SIZE;
+            }
+            else if (state == CHUNK_SIZE){
+                // HEX[;extensions], nothing uses the extensions
+                size_t size;
+                auto res = std::from_chars(line.data(), line.data() + line.size(), size, 16);
+                if (res.ec == std::errc::result_out_of_range) return PARSE_BODY_TOO_BIG;
+                if (res.ec != std::errc()) return PARSE_INVALID;
+                std::string_view rest = trim(line.substr(res.ptr - line.data()));
+                if (!rest.empty() && rest.front() != ';') return PARSE_INVALID;
+                if (size > max_body - body_size) return PARSE_BODY_TOO_BIG;
+                body_size += size;
+                remaining = size;
+                state = size ? CHUNK_DATA : TRAILERS;
+            }
+            else{
+                // Trailer fields are skipped, a blank line ends the request
+                trailer_bytes += line.size() + 2;
+                if (trailer_bytes > limits.header_bytes) return PARSE_HEADERS_TOO_BIG;
+                if (line.empty()) state = COMPLETE;
+            }
+        }
+        // Close the gap framing or the sink left so the buffer only holds what's still needed
+        if (pos > body_end){
+            memmove(data + body_end, data + pos, len - pos);
+            len -= pos - body_end;
+            pos = body_end;
+        }
+        return state == COMPLETE ? PARSE_DONE : PARSE_INCOMPLETE;
+    }
+
+    // n body bytes at pos are in, keep them at body_end or hand them to the sink
+    void take(char *data, size_t n){
+        if (n == 0) return;
+        if (sink){
+            sink(sink_state, std::string_view(data + pos, n));
+        }
+        else{
+            if (body_end != pos) memmove(data + body_end, data + pos, n);
+            body_end += n;
+        }
+        pos += n;
+    }
+
+    // Turn the offsets into views
+    void fill(const char *data, HttpRequest &req) const {
+        req.method = std::string_view(data + method.off, method.len);
+        req.uri = std::string_view(data + uri.off, uri.len);
+        req.version = std::string_view(data + version.off, version.len);
+        req.header_count = header_count;
+        for (size_t i = 0; i < header_count; ++i){
+            req.headers[i].name = std::string_view(data + names[i].off, names[i].len);
+            req.headers[i].value = std::string_view(data + values[i].off, values[i].len);
+        }
+        req.body = std::string_view(data + body_start, body_end - body_start);
+        req.stream = sink_state;
+    }
+
+    State state;
+    size_t pos; // Scanned up to here
+    size_t line_start; // Where the line being scanned began
+    Span method, uri, version;
+    Span names[MAX_HEADERS];
+    Span values[MAX_HEADERS];
+    size_t header_count;
+    size_t content_length;
+    bool has_length; // Content-Length was sent
+    bool chunked; // Transfer-Encoding: chunked
+    size_t body_start; // Where the body begins
+    size_t body_end; // End of the body kept so far
+    size_t remaining; // Left in the Content-Length body or the current chunk
+    size_t body_size; // Chunk sizes added up
+    size_t max_body;
+    size_t trailer_bytes;
+    BodySinkFn sink; // Takes the body instead of the buffer
+    void *sink_state;
+};
+
+// Value of the first header called name, false if there isn't one
+static inline bool get_header(const HttpRequest &req, std::string_view name, std::string_view &value){
+    for (size_t i = 0; i < req.header_count; ++i){
+        if (iequals(req.headers[i].name, name)){
+            value = req.headers[i].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Does the client want the connection kept open after this request
+// HTTP/1.1 keeps it unless told to close, HTTP/1.0 closes unless asked to keep it
+static inline bool wants_keep_alive(const HttpRequest &req){
+    bool keep = (req.version == "HTTP/1.1");
+    for (size_t i = 0; i < req.header_count; ++i){
+        if (!iequals(req.headers[i].name, "Connection")) continue;
+        // Value is a comma separated token list
+        std::string_view v = req.headers[i].value;
+        while (!v.empty()){
+            size_t comma = v.find(',');
+            std::string_view token = trim(v.substr(0, comma));
+            if (iequals(token, "close")) keep = false;
+            else if (iequals(token, "keep-alive")) keep = true;
+            if (comma == std::string_view::npos) break;
+            v.remove_prefix(comma + 1);
+        }
+    }
+    return keep;
+}
+
+// Does any name header list token, like Upgrade: h2c or Connection: Upgrade
+static inline bool header_has_token(const HttpRequest &req, std::string_view name, std::string_view token){
+    for (size_t i = 0; i < req.header_count; ++i){
+        if (!iequals(req.headers[i].name, name)) continue;
+        std::string_view v = req.headers[i].value;
+        while (!v.empty()){
+            size_t comma = v.find(',');
+            if (iequals(trim(v.substr(0, comma)), token)) return true;
+            if (comma == std::string_view::npos) break;
+            v.remove_prefix(comma + 1);
+        }
+    }
+    return false;
+}
+
+// One decoded key=value pair from a form body
+struct FormField {
+    std::string_view key;
+    std::string_view value;
+};
+
+// Every field of an application/x-www-form-urlencoded body
+struct FormFields {
+    FormField fields[MAX_FORM_FIELDS];
+    size_t count = 0;
+
+    // First value whose key is exactly key, so "aa=1" is not a match for "a"
+    bool get(std::string_view key, std::string_view &value) const {
+        for (size_t i = 0; i < count; ++i){
+            if (fields[i].key == key){
+                value = fields[i].value;
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+// Hex dictionary
+static inline int hex_value(char ch){
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    return -1;
+}
+
+// Decodes form-encoded text to dst, returns the decoded view
+// dst needs s.size() bytes, decoding never makes text longer
+static inline std::string_view url_decode(std::string_view s, char *dst){
+    char *out = dst;
+    for (size_t i = 0; i < s.size(); ++i){
+        char c = s[i];
+        if (c == '+'){
+            *out++ = ' '; // form: + is a space
+        }
+        // form: %xx is followed by 2 digits of hex
+        else if (c == '%' && i + 2 < s.size() && hex_value(s[i + 1]) >= 0 && hex_value(s[i + 2]) >= 0){
+            *out++ = (char)((hex_value(s[i + 1]) << 4) | hex_value(s[i + 2]));
+            i += 2;
+        }
+        else *out++ = c;
+    }
+    return std::string_view(dst, out - dst);
+}
+
+// Parse POST form data in one pass: key=value&key2=value2
+// Decoded text goes into the request's arena, so it's gone when the arena resets.
+// When the body has no '%' or '+' (found with the SIMD scan) the views point straight at the body.
+static inline bool parse_form(std::string_view body, Arena &arena, FormFields &form){
+    form.count = 0;
+    bool plain = find_any(body.data(), body.size(), '%', '+', '+') == body.size();
+    char *scratch = nullptr;
+    if (!plain){
+        scratch = arena.alloc_chars(body.size());
+        if (!scratch) return false;
+    }
+    size_t pos = 0;
+    while (pos <= body.size()){
+        size_t amp = body.find('&', pos);
+        if (amp == std::string_view::npos) amp = body.size();
+        std::string_view pair = body.substr(pos, amp - pos);
+        pos = amp + 1;
+        if (pair.empty()) continue;
+        if (form.count == MAX_FORM_FIELDS) return false;
+        // A key with no '=' has an empty value
+        size_t eq = pair.find('=');
+        std::string_view key = pair.substr(0, eq);
+        std::string_view value = (eq == std::string_view::npos) ? std::string_view() : pair.substr(eq + 1);
+        FormField &f = form.fields[form.count++];
+        if (plain){
+            f.key = key;
+            f.value = value;
+        }
+        else{
+            f.key = url_decode(key, scratch);
+            scratch += f.key.size();
+            f.value = url_decode(value, scratch);
+            scratch += f.value.size();
+        }
+    }
+    return true;
+}
+
+#endif
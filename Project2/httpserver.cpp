@@ -5,411 +5,2649 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include <atomic>
 #include <cassert>
 #include <cerrno>
-#include <condition_variable>
+#include <charconv>
 #include <cstring>
-#include <functional>
 #include <iostream>
 #include <mutex>
-#include <queue>
-#include <regex>
+#include <optional>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
+#include "accesslog.h"
+#include "admission.h"
+#include "arena.h"
+#include "async.h"
+#include "compress.h"
+#include "filecache.h"
+#include "h2.h"
+#include "httpparser.h"
+#include "memocache.h"
+#include "metrics.h"
+#include "multiply.h"
+#include "outqueue.h"
+#include "response.h"
+#include "threadpool.h"
+#include "timerwheel.h"
+#include "uring.h"
+
 #define PORT 8080
-#define BUFFER_SIZE 4092
+#define MAX_POOLED_CONNS 4096 // Closed Connection objects each loop keeps for reuse
+#define LINGER_MS 2000 // How long a refused client gets to stop sending before the close
+#define LINGER_MAX (1 << 20) // Most bytes thrown away while waiting
+#define URING_ENTRIES 1024 // Submission queue per io_uring loop
+#define URING_BUFS 1024 // Provided recv buffers per io_uring loop, a power of two for the buffer ring
+#define URING_BUF_SIZE 4096
+#define URING_BGID 0 // Their buffer group
+#define URING_SLAB_BLOCKS 1024 // Pool blocks registered for fixed sends, 16MB
+#define URING_BACKLOG_MAX (64 * 1024) // Bytes kept for a connection that can't take them before recv pauses
+#define URING_IOVECS 16 // iovecs per SENDMSG
+#define SLEEP_MAX_MS 5000 // Longest /sleep, longer asks are cut to this
+#define BATCH_PIECE 65536 // Text products formatted this much at a time before it goes out
+
+// Count every heap allocation so steady state can be checked for zero mallocs
+// noinline so GCC doesn't see malloc/free inside and warn that they are mismatched with new/delete
+__attribute__((noinline)) void *operator new(size_t n){
+    count(alloc_stats.heap_allocs);
+    void *p = malloc(n ? n : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+    if (p) count(alloc_stats.heap_frees);
+    free(p);
+}
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept {
+    if (p) count(alloc_stats.heap_frees);
+    free(p);
+}
+
+// Read until something is read
+static ssize_t super_read(int fd, void *buf, size_t count){
+    ssize_t r;
+    do{
+        r = read(fd, buf, count);
+    } while (r < 0 && errno == EINTR); //
+    // EINTR errors are interrupted system calls, usually can just try again
+    // https://medium.com/@agadallh5/understanding-eintr-the-error-interrupt-signal-in-unix-systems-670a1bedc121 
+    
+    return r;
+}
+
+// Send part of a file straight from the page cache, retrying when interrupted
+// -1 with EAGAIN means the socket is full, 0 means the file got shorter
+static ssize_t super_sendfile(int fd, int file_fd, off_t off, size_t len){
+    ssize_t n;
+    do{
+        n = sendfile(fd, file_fd, &off, std::min(len, (size_t)1 << 30));
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) count(io_stats.sendfile_calls);
+    return n;
+}
+
+// Send iovecs in one call, retrying when interrupted
+// -1 with EAGAIN means the socket is full
+static ssize_t super_sendmsg(int fd, struct iovec *iov, int cnt, int flags){
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = cnt;
+    ssize_t n;
+    do{
+        n = sendmsg(fd, &msg, flags);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0){
+        count(io_stats.sendmsg_calls);
+        if (flags & MSG_ZEROCOPY) count(io_stats.zerocopy_sends);
+    }
+    return n;
+}
+
+// True if the socket has a pending error
+static bool socket_error(int fd){
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) return true;
+    return err != 0;
+}
+
+// Read MSG_ZEROCOPY completions off the socket error queue
+// Each one covers a range of sendmsg calls, returns how many finished
+static uint32_t reap_zerocopy(int fd){
+    uint32_t finished = 0;
+    while (true){
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0){
+            break; // EAGAIN once it's empty
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)){
+            bool ip = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                      (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if (!ip) continue;
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            uint32_t n = ee->ee_data - ee->ee_info + 1; // [ee_info, ee_data] inclusive
+            finished += n;
+            count(io_stats.zerocopy_done, n);
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) count(io_stats.zerocopy_copied, n);
+        }
+    }
+    return finished;
+}
+
+// Server settings from the command line
+struct ServerConfig {
+    int idle_timeout_ms = 5000; // Close keep-alive connections idle this long, 0 disables keep-alive
+    int header_timeout_ms = 10000; // Whole request line and headers have to arrive in this
+    int body_timeout_ms = 30000; // Longest wait between two reads of a request body
+    int write_timeout_ms = 30000; // Longest wait for a client to take more of a response
+    unsigned max_requests = 100; // Requests per connection before closing, 0 is unlimited
+    bool stats = false; // Serve allocator counters on /stats
+    bool debug_sleep = false; // Serve /sleep, for testing coroutine handlers
+    std::string docroot; // Serve files from here for paths no route has, empty for none
+    RequestLimits limits; // Bigger requests get a 413/414/431 instead of a buffer
+    size_t max_connections = 10000; // Open connections across all loops, 0 is unlimited
+    size_t max_per_ip = 0; // Open connections from one address, 0 is unlimited
+    size_t max_queue = 1024; // Batches waiting for a worker, 0 is unlimited
+    int codel_target_ms = 5; // Shed once queue waits stay over this, 0 turns it off
+    int codel_interval_ms = 100; // ...for this long
+    bool shed_reset = false; // Turn away excess connections with a RST instead of a 503
+    std::string access_log = "-"; // Access log file, "-" is stdout
+    unsigned log_sample = 1; // Log one request in this many, 0 turns the log off
+    bool uring = false; // Event loops run on io_uring instead of epoll
+    size_t memo_bytes = 16 << 20; // Memo cache budget for pure routes, 0 turns it off
+    int memo_ttl_ms = 60000; // Memoized responses are only good this long
+    size_t h2_streams = 100; // Concurrent streams per HTTP/2 connection, 0 turns h2c off
+};
+static ServerConfig config;
+
+// Which cached error a parse failure gets
+static RefusedKind refused_kind(ParseStatus st){
+    switch (st){
+        case PARSE_URI_TOO_LONG: return REFUSED_URI_TOO_LONG;
+        case PARSE_HEADERS_TOO_BIG: return REFUSED_HEADERS_TOO_LARGE;
+        case PARSE_BODY_TOO_BIG: return REFUSED_BODY_TOO_LARGE;
+        case PARSE_UNSUPPORTED: return REFUSED_UNSUPPORTED;
+        default: return REFUSED_INVALID;
+    }
+}
+
+static StaticResponse parse_error(ParseStatus st){
+    switch (st){
+        case PARSE_URI_TOO_LONG: return RESP_URI_TOO_LONG;
+        case PARSE_HEADERS_TOO_BIG: return RESP_HEADERS_TOO_LARGE;
+        case PARSE_BODY_TOO_BIG: return RESP_BODY_TOO_LARGE;
+        case PARSE_UNSUPPORTED: return RESP_NOT_IMPLEMENTED;
+        default: return RESP_BAD_REQUEST;
+    }
+}
+
+// Methods the router knows, anything else is HTTP_OTHER
+enum HttpMethod {
+    HTTP_GET,
+    HTTP_HEAD,
+    HTTP_POST,
+    HTTP_PUT,
+    HTTP_DELETE,
+    HTTP_OPTIONS,
+    HTTP_PATCH,
+    HTTP_OTHER,
+    HTTP_METHOD_COUNT
+};
+
+static const char *method_names[HTTP_METHOD_COUNT] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH", "?"
+};
+
+// Method token to enum, switch on length so it's one compare
+static HttpMethod parse_method(std::string_view m){
+    switch (m.size()){
+        case 3:
+            if (m == "GET") return HTTP_GET;
+            if (m == "PUT") return HTTP_PUT;
+            break;
+        case 4:
+            if (m == "POST") return HTTP_POST;
+            if (m == "HEAD") return HTTP_HEAD;
+            break;
+        case 5:
+            if (m == "PATCH") return HTTP_PATCH;
+            break;
+        case 6:
+            if (m == "DELETE") return HTTP_DELETE;
+            break;
+        case 7:
+            if (m == "OPTIONS") return HTTP_OPTIONS;
+            break;
+    }
+    return HTTP_OTHER;
+}
+
+// Route handler, appends the response to out
+typedef void (*RouteHandler)(const HttpRequest &req, Reply &reply);
+
+// Coroutine route handler, same but it can co_await the loop through its Reply
+// While it waits no thread is held, it carries on on a worker (or the loop in per-core mode)
+typedef Async<> (*CoRouteHandler)(const HttpRequest &req, Reply &reply);
+
+// Takes a request body as it is read, for routes that shouldn't have to hold all of it
+// open runs on the event loop once the headers are in and returns the route's state, made in
+// the arena (nullptr refuses the body with a 413). data then gets every piece in order,
+// chunked framing already stripped. The handler runs last with req.body empty and
+// req.stream pointing at the state, or null if the request had no body.
+struct BodyConsumer {
+    void *(*open)(const HttpRequest &req, Arena &arena);
+    BodySinkFn data;
+};
+
+// Path to handler lookup
+// Routes are registered at startup, then build() searches for a hash seed that puts every
+// path in its own slot. Dispatch is one hash, one slot and one compare, no matter how many
+// routes there are. Methods without a handler get a 405 with an Allow header automatically.
+class Router {
+public:
+    // Register a handler for method + path, consumer streams its body in
+    void add(HttpMethod method, const std::string &path, RouteHandler handler,
+             const BodyConsumer *consumer = nullptr){
+        route(method, path, consumer).handlers[method] = handler;
+    }
+
+    // Same for a coroutine handler
+    void add(HttpMethod method, const std::string &path, CoRouteHandler handler,
+             const BodyConsumer *consumer = nullptr){
+        route(method, path, consumer).co_handlers[method] = handler;
+    }
+
+    // The handler for method + path always answers the same request the same way,
+    // so its responses get remembered and repeats skip it
+    void pure(HttpMethod method, const std::string &path){
+        route(method, path, nullptr).pure[method] = true;
+    }
+
+    // Build the perfect hash table and each route's 405 responses
+    void build(){
+        size_t size = 1;
+        while (size < routes.size() * 2) size <<= 1;
+        // Try seeds until nothing collides, grow the table if it takes too long
+        while (true){
+            for (seed = 1; seed < 10000; ++seed){
+                if (try_seed(size)) break;
+            }
+            if (seed < 10000) break;
+            size <<= 1;
+        }
+        for (auto &r : routes){
+            build_not_allowed(r);
+        }
+    }
+
+    // Call the handler for path, false if no route has that path
+    // A coroutine handler is started and left in task, not done yet means it is waiting
+    bool dispatch(std::string_view path, HttpMethod method, const HttpRequest &req, Reply &reply,
+                  Async<> &task) const {
+        const Route *rp = find(path);
+        if (!rp) return false;
+        const Route &r = *rp;
+        reply.route = METRIC_ROUTE_FIRST + (rp - routes.data());
+        // Pure handlers answer from the memo cache when they can, without looking at the body
+        bool memo = r.pure[method] && memo_cache.enabled();
+        MemoKey key;
+        if (memo){
+            size_t q = req.uri.find('?');
+            std::string_view query = q == std::string_view::npos ? std::string_view() : req.uri.substr(q + 1);
+            key = MemoKey(rp - routes.data(), method, reply.keep_alive, reply.encoding, query, req.body);
+            if (memo_cache.answer(key, reply)) return true;
+        }
+        size_t from = reply.out.size();
+        if (r.handlers[method]){
+            r.handlers[method](req, reply);
+        }
+        else if (r.co_handlers[method]){
+            task = r.co_handlers[method](req, reply);
+            if (task) task.start();
+            else responses.append(reply, RESP_UNAVAILABLE); // No room for its frame
+        }
+        else{
+            reply.out.append(r.not_allowed[reply.keep_alive]);
+            reply.status = 405;
+        }
+        // Only what finished right away, a handler that waited isn't one to remember
+        if (memo && (!task || task.done())) memo_cache.remember(key, reply, from);
+        return true;
+    }
+
+    size_t size() const { return routes.size(); }
+    std::string_view path(size_t i) const { return routes[i].path; }
+
+    // Who streams the body for method + path, null if it should be buffered
+    const BodyConsumer *consumer(std::string_view path, HttpMethod method) const {
+        const Route *r = find(path);
+        return r && (r->handlers[method] || r->co_handlers[method]) ? r->consumers[method] : nullptr;
+    }
+
+private:
+    struct Route {
+        std::string path;
+        RouteHandler handlers[HTTP_METHOD_COUNT] = {}; // Null if the method isn't allowed
+        CoRouteHandler co_handlers[HTTP_METHOD_COUNT] = {}; // Or this one instead
+        const BodyConsumer *consumers[HTTP_METHOD_COUNT] = {}; // Null if the body is buffered
+        bool pure[HTTP_METHOD_COUNT] = {}; // Responses memoized
+        unsigned allowed = 0; // Bit per method
+        std::string not_allowed[2]; // 405 with Allow header, close and keep-alive
+    };
+
+    // Path's route, made if it's new, with method allowed on it
+    Route &route(HttpMethod method, const std::string &path, const BodyConsumer *consumer){
+        Route *r = nullptr;
+        for (auto &existing : routes){
+            if (existing.path == path) r = &existing;
+        }
+        if (!r){
+            routes.emplace_back();
+            r = &routes.back();
+            r->path = path;
+        }
+        r->consumers[method] = consumer;
+        r->allowed |= 1u << method;
+        return *r;
+    }
+
+    // FNV-1a with a seed mixed in
+    static uint32_t hash(std::string_view s, uint32_t seed){
+        uint32_t h = 2166136261u ^ seed;
+        for (char ch : s){
+            h ^= (unsigned char)ch;
+            h *= 16777619u;
+        }
+        return h ^ (h >> 15);
+    }
+
+    const Route *find(std::string_view path) const {
+        int idx = slots[hash(path, seed) & mask];
+        if (idx < 0 || routes[idx].path != path) return nullptr;
+        return &routes[idx];
+    }
+
+    bool try_seed(size_t size){
+        slots.assign(size, -1);
+        mask = size - 1;
+        for (size_t i = 0; i < routes.size(); ++i){
+            int &slot = slots[hash(routes[i].path, seed) & mask];
+            if (slot >= 0) return false;
+            slot = (int)i;
+        }
+        return true;
+    }
+
+    void build_not_allowed(Route &r){
+        std::string allow;
+        for (int m = 0; m < HTTP_OTHER; ++m){
+            if (!(r.allowed & (1u << m))) continue;
+            if (!allow.empty()) allow += ", ";
+            allow += method_names[m];
+        }
+        std::string extra = "Allow: " + allow + "\r\n";
+        for (int ka = 0; ka < 2; ++ka){
+            r.not_allowed[ka] = serialize_response(ka, ENC_IDENTITY, 405, "Method Not Allowed", "text/plain", "Method Not Allowed", extra);
+        }
+    }
+
+    std::vector<Route> routes;
+    std::vector<int> slots; // Index into routes, -1 for empty
+    size_t mask = 0;
+    uint32_t seed = 0;
+};
+static Router router;
+
+// Return default page
+static void route_index(const HttpRequest &, Reply &reply){
+    responses.append(reply, RESP_INDEX);
+}
+
+// GET /google
+static Async<> route_google(const HttpRequest &, Reply &reply){
+    // 301 Redirect
+    responses.append(reply, RESP_GOOGLE);
+    co_return;
+}
+
+// DELETE /database.php?data=all
+static void route_database_delete(const HttpRequest &, Reply &reply){
+    responses.append(reply, RESP_FORBIDDEN);
+}
+
+// Check s is [+-]?[0-9]+ and split off the sign
+// digits has leading zeros stripped, "0" stays "0"
+static bool split_integer(std::string_view s, bool &negative, std::string_view &digits){
+    negative = false;
+    if (!s.empty() && (s[0] == '+' || s[0] == '-')){
+        negative = (s[0] == '-');
+        s.remove_prefix(1);
+    }
+    if (s.empty()) return false;
+    for (char ch : s){
+        if (ch < '0' || ch > '9') return false;
+    }
+    while (s.size() > 1 && s[0] == '0') s.remove_prefix(1);
+    digits = s;
+    return true;
+}
+
+// Parse an already validated integer, false if it doesn't fit in long long
+static bool to_int64(std::string_view s, long long &value){
+    if (!s.empty() && s[0] == '+') s.remove_prefix(1); // from_chars doesn't take '+'
+    auto res = std::from_chars(s.data(), s.data() + s.size(), value);
+    return res.ec == std::errc() && res.ptr == s.data() + s.size();
+}
+
+// Arbitrary size multiply for operands that overflow long long
+// Schoolbook on base 1e9 limbs, least significant limb first
+// The product is written into the arena with a newline, ready to be the response body
+static std::string_view multiply_decimal(bool negative, std::string_view a, std::string_view b, Arena &arena){
+    const uint32_t BASE = 1000000000;
+    auto to_limbs = [](std::string_view d){
+        std::vector<uint32_t> limbs;
+        for (size_t end = d.size(); end > 0; end = (end > 9) ? end - 9 : 0){
+            size_t start = (end > 9) ? end - 9 : 0;
+            uint32_t limb = 0;
+            std::from_chars(d.data() + start, d.data() + end, limb);
+            limbs.push_back(limb);
+        }
+        return limbs;
+    };
+    std::vector<uint32_t> x = to_limbs(a);
+    std::vector<uint32_t> y = to_limbs(b);
+    std::vector<uint64_t> acc(x.size() + y.size() + 1, 0);
+    for (size_t i = 0; i < x.size(); ++i){
+        uint64_t carry = 0;
+        for (size_t j = 0; j < y.size(); ++j){
+            uint64_t cur = acc[i + j] + (uint64_t)x[i] * y[j] + carry;
+            acc[i + j] = cur % BASE;
+            carry = cur / BASE;
+        }
+        for (size_t k = i + y.size(); carry; ++k){
+            uint64_t cur = acc[k] + carry;
+            acc[k] = cur % BASE;
+            carry = cur / BASE;
+        }
+    }
+    while (acc.size() > 1 && acc.back() == 0) acc.pop_back();
+
+    // Most significant limb as is, the rest padded to 9 digits
+    size_t cap = 1 + acc.size() * 9 + 1;
+    char *result = arena.alloc_chars(cap);
+    if (!result) return std::string_view();
+    char *p = result;
+    if (negative && !(acc.size() == 1 && acc[0] == 0)) *p++ = '-';
+    p = std::to_chars(p, result + cap, acc.back()).ptr;
+    for (size_t k = acc.size() - 1; k-- > 0;){
+        char buf[16];
+        char *end = std::to_chars(buf, buf + sizeof(buf), acc[k]).ptr;
+        size_t pad = 9 - (end - buf);
+        memset(p, '0', pad);
+        memcpy(p + pad, buf, end - buf);
+        p += 9;
+    }
+    *p++ = '\n';
+    return std::string_view(result, p - result);
+}
+
+// POST /multiply
+static Async<> route_multiply(const HttpRequest &req, Reply &reply){
+    // Form-encoded body a=INT&b=INT
+    FormFields form;
+    std::string_view a_str, b_str;
+    if (!parse_form(req.body, reply.arena, form) || !form.get("a", a_str) || !form.get("b", b_str)){
+        responses.append(reply, RESP_BAD_FORM);
+        co_return;
+    }
+    // Validate integers, [+-]?[0-9]+
+    std::string_view a_digits, b_digits;
+    bool a_neg, b_neg;
+    if (!split_integer(a_str, a_neg, a_digits) || !split_integer(b_str, b_neg, b_digits)) {
+        responses.append(reply, RESP_BAD_INT);
+        co_return;
+    }
+    // The digit multiply is quadratic, keep one request from eating a core
+    if (a_digits.size() > MULTIPLY_MAX_DIGITS || b_digits.size() > MULTIPLY_MAX_DIGITS){
+        responses.append(reply, RESP_INT_TOO_LONG);
+        co_return;
+    }
+
+    // Compute product
+    long long a, b, prod;
+    if (to_int64(a_str, a) && to_int64(b_str, b) && !__builtin_mul_overflow(a, b, &prod)){
+        // Fits in 64 bits, the usual case
+        char buf[24];
+        char *end = std::to_chars(buf, buf + sizeof(buf), prod).ptr;
+        *end++ = '\n';
+        send_response(reply, 200, "OK", "text/plain", std::string_view(buf, end - buf));
+    }
+    else{
+        // Too big for long long, do it on the digits
+        std::string_view body = multiply_decimal(a_neg != b_neg, a_digits, b_digits, reply.arena);
+        send_response(reply, 200, "OK", "text/plain", body, std::string_view(), BODY_STABLE);
+    }
+}
+
+// POST /multiply/batch, many products in one request
+// text/plain (or anything else): "a,b" per line, answered with one product per line
+// application/octet-stream: little-endian int64 pairs, answered with little-endian 128-bit products
+// Operands have to fit in 64 bits, every product is exact. Text goes out a piece at a time
+// so a big batch never sits formatted in memory all at once.
+static Async<> route_multiply_batch(const HttpRequest &req, Reply &reply){
+    std::string_view type;
+    bool binary = get_header(req, "Content-Type", type) &&
+                  iequals(trim(type.substr(0, type.find(';'))), "application/octet-stream");
+    const char *pairs;
+    size_t n;
+    if (binary){
+        if (req.body.size() % 16){
+            send_response(reply, 400, "Bad Request", "text/plain", "Bad Request: expected pairs of little-endian int64");
+            co_return;
+        }
+        pairs = req.body.data(); // Multiplied right where it was read
+        n = req.body.size() / 16;
+    }
+    else{
+        size_t lines = std::count(req.body.begin(), req.body.end(), '\n') + 1;
+        int64_t *parsed = (int64_t *)reply.arena.alloc(lines * 16);
+        size_t bad_line;
+        if (!parsed){
+            responses.append(reply, RESP_UNAVAILABLE);
+            co_return;
+        }
+        if (!parse_pairs_text(req.body, parsed, n, bad_line)){
+            char *msg = reply.arena.alloc_chars(96);
+            if (!msg){
+                responses.append(reply, RESP_UNAVAILABLE);
+                co_return;
+            }
+            int len = snprintf(msg, 96, "Bad Request: line %zu, expected INT,INT with 64-bit integers", bad_line);
+            send_response(reply, 400, "Bad Request", "text/plain", std::string_view(msg, len));
+            co_return;
+        }
+        pairs = (const char *)parsed;
+    }
+    if (n == 0){
+        // Empty batch, empty answer
+        send_response(reply, 200, "OK", binary ? "application/octet-stream" : "text/plain", std::string_view());
+        co_return;
+    }
+    Product *products = (Product *)reply.arena.alloc(n * sizeof(Product), alignof(Product));
+    if (!products){
+        responses.append(reply, RESP_UNAVAILABLE);
+        co_return;
+    }
+    multiply_pairs(pairs, products, n);
+
+    if (binary){
+        // Sent from the arena as is, it lasts until the response is written
+        send_response(reply, 200, "OK", "application/octet-stream",
+                      std::string_view((const char *)products, n * sizeof(Product)), std::string_view(), BODY_STABLE);
+        co_return;
+    }
+    size_t len = 0;
+    for (size_t i = 0; i < n; ++i) len += product_text_len(products[i]) + 1;
+    OutQueue &out = reply.out;
+    begin_response(reply, 200, "OK");
+    out.append("Content-Type: text/plain\r\nContent-Length: ");
+    append_number(out, len);
+    out.append(reply.keep_alive ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+    size_t piece = 0;
+    for (size_t i = 0; i < n;){
+        char buf[4096];
+        char *p = buf;
+        while (i < n && p + PRODUCT_TEXT_MAX + 1 <= buf + sizeof(buf)){
+            p = format_product(p, products[i++]);
+            *p++ = '\n';
+        }
+        out.append(buf, p - buf);
+        piece += p - buf;
+        if (piece >= BATCH_PIECE && i < n){
+            co_await reply.write();
+            piece = 0;
+        }
+    }
+}
+
+// GET /sleep?ms=N, answers after N milliseconds, only with -D
+// The wait is on the event loop, so thousands of these at once hold no threads
+static Async<> route_sleep(const HttpRequest &req, Reply &reply){
+    FormFields form;
+    std::string_view ms_str;
+    long long ms;
+    size_t q = req.uri.find('?');
+    if (q == std::string_view::npos || !parse_form(req.uri.substr(q + 1), reply.arena, form) ||
+        !form.get("ms", ms_str) || !to_int64(ms_str, ms) || ms < 0){
+        send_response(reply, 400, "Bad Request", "text/plain", "Bad Request: expected ms=INT");
+        co_return;
+    }
+    co_await reply.sleep((int)std::min(ms, (long long)SLEEP_MAX_MS));
+    send_response(reply, 200, "OK", "text/plain", "OK\n");
+}
+
+// POST /upload
+// Streamed, the body is counted and checksummed as it comes in and never kept
+struct UploadState {
+    uint64_t bytes;
+    uLong crc;
+};
+
+static void *upload_open(const HttpRequest &, Arena &arena){
+    UploadState *u = (UploadState *)arena.alloc(sizeof(UploadState));
+    if (!u) return nullptr;
+    u->bytes = 0;
+    u->crc = crc32(0, nullptr, 0);
+    return u;
+}
+
+static void upload_data(void *state, std::string_view piece){
+    UploadState *u = (UploadState *)state;
+    u->bytes += piece.size();
+    u->crc = crc32(u->crc, (const Bytef *)piece.data(), (uInt)piece.size());
+}
+
+static const BodyConsumer upload_consumer = {upload_open, upload_data};
+
+static void route_upload(const HttpRequest &req, Reply &reply){
+    // No body at all means the consumer never opened
+    UploadState empty = {0, crc32(0, nullptr, 0)};
+    const UploadState *u = req.stream ? (const UploadState *)req.stream : &empty;
+    char buf[64];
+    int n = snprintf(buf, sizeof(buf), "%llu bytes crc32 %08lx\n", (unsigned long long)u->bytes, (unsigned long)u->crc);
+    send_response(reply, 200, "OK", "text/plain", std::string_view(buf, n));
+}
+
+// GET /stats, allocator and write path counters as "name value" lines
+static void route_stats(const HttpRequest &, Reply &reply){
+    struct Counter { const char *name; uint64_t value; };
+    Counter counters[] = {
+        {"heap_allocs", alloc_stats.heap_allocs.load(std::memory_order_relaxed)},
+        {"heap_frees", alloc_stats.heap_frees.load(std::memory_order_relaxed)},
+        {"block_acquires", alloc_stats.block_acquires.load(std::memory_order_relaxed)},
+        {"block_mallocs", alloc_stats.block_mallocs.load(std::memory_order_relaxed)},
+        {"block_releases", alloc_stats.block_releases.load(std::memory_order_relaxed)},
+        {"blocks_pooled", block_pool.size()},
+        {"big_mallocs", alloc_stats.big_mallocs.load(std::memory_order_relaxed)},
+        {"arena_allocs", alloc_stats.arena_allocs.load(std::memory_order_relaxed)},
+        {"arena_bytes", alloc_stats.arena_bytes.load(std::memory_order_relaxed)},
+        {"arena_resets", alloc_stats.arena_resets.load(std::memory_order_relaxed)},
+        {"sendmsg_calls", io_stats.sendmsg_calls.load(std::memory_order_relaxed)},
+        {"body_refs", io_stats.body_refs.load(std::memory_order_relaxed)},
+        {"zerocopy_sends", io_stats.zerocopy_sends.load(std::memory_order_relaxed)},
+        {"zerocopy_done", io_stats.zerocopy_done.load(std::memory_order_relaxed)},
+        {"zerocopy_copied", io_stats.zerocopy_copied.load(std::memory_order_relaxed)},
+        {"sendfile_calls", io_stats.sendfile_calls.load(std::memory_order_relaxed)},
+        {"uring_enters", io_stats.uring_enters.load(std::memory_order_relaxed)},
+        {"uring_sends", io_stats.uring_sends.load(std::memory_order_relaxed)},
+        {"uring_fixed_sends", io_stats.uring_fixed_sends.load(std::memory_order_relaxed)},
+        {"file_cache_hits", file_cache.hits.load(std::memory_order_relaxed)},
+        {"file_cache_misses", file_cache.misses.load(std::memory_order_relaxed)},
+        {"file_cache_invalidations", file_cache.invalidations.load(std::memory_order_relaxed)},
+        {"compress_cache_hits", compress_stats.cache_hits.load(std::memory_order_relaxed)},
+        {"compress_cache_misses", compress_stats.cache_misses.load(std::memory_order_relaxed)},
+        {"compress_dynamic", compress_stats.dynamic.load(std::memory_order_relaxed)},
+        {"compress_bytes_in", compress_stats.bytes_in.load(std::memory_order_relaxed)},
+        {"compress_bytes_out", compress_stats.bytes_out.load(std::memory_order_relaxed)},
+        {"open_connections", admission.connections()},
+        {"shed_conns", admission_stats.shed_conns.load(std::memory_order_relaxed)},
+        {"shed_ip", admission_stats.shed_ip.load(std::memory_order_relaxed)},
+        {"shed_queue", admission_stats.shed_queue.load(std::memory_order_relaxed)},
+        {"shed_codel", admission_stats.shed_codel.load(std::memory_order_relaxed)},
+        {"log_written", access_log.written.load(std::memory_order_relaxed)},
+        {"log_dropped", access_log.dropped.load(std::memory_order_relaxed)},
+        {"memo_hits", memo_cache.hits.load(std::memory_order_relaxed)},
+        {"memo_misses", memo_cache.misses.load(std::memory_order_relaxed)},
+        {"memo_inserts", memo_cache.inserts.load(std::memory_order_relaxed)},
+        {"memo_evictions", memo_cache.evictions.load(std::memory_order_relaxed)},
+        {"memo_expirations", memo_cache.expirations.load(std::memory_order_relaxed)},
+        {"memo_bytes", memo_cache.bytes.load(std::memory_order_relaxed)},
+        {"h2_sessions", h2_stats.sessions.load(std::memory_order_relaxed)},
+        {"h2_upgrades", h2_stats.upgrades.load(std::memory_order_relaxed)},
+        {"h2_streams", h2_stats.streams.load(std::memory_order_relaxed)},
+        {"h2_refused", h2_stats.refused.load(std::memory_order_relaxed)},
+        {"h2_resets_sent", h2_stats.resets_sent.load(std::memory_order_relaxed)},
+        {"h2_resets_received", h2_stats.resets_received.load(std::memory_order_relaxed)},
+        {"h2_goaways", h2_stats.goaways.load(std::memory_order_relaxed)},
+    };
+    // Built in the arena so reading the counters doesn't bump them
+    size_t cap = 0;
+    for (const Counter &c : counters) cap += strlen(c.name) + 22;
+    char *body = reply.arena.alloc_chars(cap);
+    if (!body) return;
+    char *p = body;
+    for (const Counter &c : counters){
+        size_t n = strlen(c.name);
+        memcpy(p, c.name, n);
+        p += n;
+        *p++ = ' ';
+        p = std::to_chars(p, body + cap, c.value).ptr;
+        *p++ = '\n';
+    }
+    send_response(reply, 200, "OK", "text/plain", std::string_view(body, p - body));
+}
+
+// Worker pool, for its queue depth on /metrics
+static ThreadPool *worker_pool = nullptr;
+
+// GET /metrics, Prometheus text format
+// Every thread counts into its own block, the sums only happen here
+static void route_metrics(const HttpRequest &, Reply &reply){
+    std::vector<std::string_view> labels = {"other", "static"};
+    for (size_t i = 0; i < router.size(); ++i) labels.push_back(router.path(i));
+    Sample samples[] = {
+        {"http_connections_active", "Connections open", admission.connections()},
+        {"threadpool_queue_depth", "Request batches waiting for a worker", worker_pool ? worker_pool->queued() : 0},
+        {"access_log_dropped_total", "Access log records lost to a full ring",
+         access_log.dropped.load(std::memory_order_relaxed), "counter"},
+        {"memo_cache_hits_total", "Responses answered from the memo cache",
+         memo_cache.hits.load(std::memory_order_relaxed), "counter"},
+        {"memo_cache_misses_total", "Memoizable requests the handler had to answer",
+         memo_cache.misses.load(std::memory_order_relaxed), "counter"},
+        {"memo_cache_evictions_total", "Memoized responses pushed out by the budget",
+         memo_cache.evictions.load(std::memory_order_relaxed), "counter"},
+        {"memo_cache_expirations_total", "Memoized responses found past their TTL",
+         memo_cache.expirations.load(std::memory_order_relaxed), "counter"},
+        {"memo_cache_bytes", "Bytes of memoized responses held", memo_cache.bytes.load(std::memory_order_relaxed)},
+    };
+    Buffer body;
+    metrics.render(body, labels, samples, sizeof(samples) / sizeof(samples[0]));
+    send_response(reply, 200, "OK", "text/plain; version=0.0.4", std::string_view(body.data(), body.size()));
+}
+
+// Every endpoint the server has
+static void register_routes(){
+    router.add(HTTP_GET, "/", route_index);
+    router.add(HTTP_GET, "/index.html", route_index);
+    router.add(HTTP_GET, "/google", route_google);
+    router.add(HTTP_DELETE, "/database.php", route_database_delete);
+    router.add(HTTP_POST, "/multiply", route_multiply);
+    router.pure(HTTP_POST, "/multiply");
+    router.add(HTTP_POST, "/multiply/batch", route_multiply_batch);
+    router.add(HTTP_POST, "/upload", route_upload, &upload_consumer);
+    router.add(HTTP_GET, "/metrics", route_metrics);
+    if (config.debug_sleep){
+        router.add(HTTP_GET, "/sleep", route_sleep);
+    }
+    if (config.stats){
+        router.add(HTTP_GET, "/stats", route_stats);
+    }
+    router.build();
+}
+
+// URL path to a file path under the docroot, written into dst
+// %xx is decoded, "." and empty segments dropped, ".." or a NUL refuses the whole path.
+// A path ending in '/' gets index.html. dst needs path.size() + 11 bytes.
+static bool docroot_path(std::string_view path, char *dst, std::string_view &rel){
+    char *out = dst;
+    size_t seg = 0; // Where the current segment started in dst
+    for (size_t i = 0; i <= path.size(); ++i){
+        char c = (i < path.size()) ? path[i] : '/';
+        if (c == '%' && i + 2 < path.size() && hex_value(path[i + 1]) >= 0 && hex_value(path[i + 2]) >= 0){
+            c = (char)((hex_value(path[i + 1]) << 4) | hex_value(path[i + 2]));
+            i += 2;
+            if (c == '\0') return false;
+        }
+        if (c != '/'){
+            *out++ = c;
+            continue;
+        }
+        std::string_view name(dst + seg, (out - dst) - seg);
+        if (name == "..") return false;
+        if (name.empty() || name == "."){
+            out = dst + seg; // Drop it
+            continue;
+        }
+        *out++ = '/';
+        seg = out - dst;
+    }
+    if (out > dst) --out; // Trailing '/' added by the loop
+    if (path.empty() || path.back() == '/' || out == dst){
+        if (out > dst) *out++ = '/';
+        memcpy(out, "index.html", 10);
+        out += 10;
+    }
+    rel = std::string_view(dst, out - dst);
+    return true;
+}
+
+// If-None-Match list against our ETag, weak comparison like RFC 9110 says
+static bool etag_matches(std::string_view list, std::string_view etag){
+    while (!list.empty()){
+        size_t comma = list.find(',');
+        std::string_view tag = trim(list.substr(0, comma));
+        if (tag == "*") return true;
+        if (tag.substr(0, 2) == "W/") tag.remove_prefix(2);
+        if (tag == etag) return true;
+        if (comma == std::string_view::npos) break;
+        list.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+// "Sun, 06 Nov 1994 08:49:37 GMT" to seconds
+static bool parse_http_date(std::string_view v, time_t &t){
+    char buf[40];
+    if (v.size() >= sizeof(buf)) return false;
+    memcpy(buf, v.data(), v.size());
+    buf[v.size()] = '\0';
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end) return false;
+    t = timegm(&tm);
+    return true;
+}
+
+// Range: bytes=FROM-TO, bytes=FROM- or bytes=-SUFFIX
+// 1 with the range to send, 0 to ignore the header (bad syntax or several ranges), -1 for a 416
+static int parse_range(std::string_view v, size_t size, size_t &from, size_t &len){
+    if (v.size() < 6 || !iequals(v.substr(0, 6), "bytes=")) return 0;
+    v = trim(v.substr(6));
+    if (v.find(',') != std::string_view::npos) return 0; // Whole file instead of multipart
+    size_t dash = v.find('-');
+    if (dash == std::string_view::npos) return 0;
+    std::string_view a = trim(v.substr(0, dash));
+    std::string_view b = trim(v.substr(dash + 1));
+    auto number = [](std::string_view s, size_t &n){
+        auto res = std::from_chars(s.data(), s.data() + s.size(), n);
+        return !s.empty() && res.ec == std::errc() && res.ptr == s.data() + s.size();
+    };
+    size_t first, last;
+    if (a.empty()){
+        // Last SUFFIX bytes
+        if (!number(b, last)) return 0;
+        if (last == 0 || size == 0) return -1;
+        len = std::min(last, size);
+        from = size - len;
+        return 1;
+    }
+    if (!number(a, first)) return 0;
+    if (b.empty()) last = size - 1;
+    else if (!number(b, last) || last < first) return 0;
+    if (first >= size) return -1;
+    last = std::min(last, size - 1);
+    from = first;
+    len = last - first + 1;
+    return 1;
+}
+
+// GET/HEAD for a path no route has, false if there is no such file
+// Cached files are sent from their mapping, others with sendfile, either way the body
+// never gets copied into the response buffer.
+static bool serve_static(const HttpRequest &req, HttpMethod method, std::string_view path, Reply &reply){
+    char *dst = reply.arena.alloc_chars(path.size() + 11);
+    std::string_view rel;
+    if (!dst || !docroot_path(path, dst, rel)) return false;
+    FileHandle h;
+    int err = file_cache.lookup(rel, h);
+    if (err == EACCES){
+        responses.append(reply, RESP_FORBIDDEN);
+        return true;
+    }
+    if (err) return false;
+    if (h.fd >= 0 && !reply.out.can_hold()){
+        // Too many files queued on this connection already, very deep pipelining
+        close(h.fd);
+        send_response(reply, 503, "Service Unavailable", "text/plain", "Service Unavailable");
+        return true;
+    }
+    const FileMeta &m = h.meta();
+    std::string_view v;
+
+    // Compressed variant of a cached text file, ranges are only done on the plain file
+    bool varies = h.cached && h.cached->varies;
+    FileVariant *variant = nullptr;
+    if (varies && reply.encoding != ENC_IDENTITY && !get_header(req, "Range", v)){
+        variant = file_cache.variant(h.cached, reply.encoding);
+    }
+    std::string_view etag = variant ? variant->etag : m.etag;
+
+    // Conditional GET, If-None-Match wins over If-Modified-Since
+    bool not_modified = false;
+    if (get_header(req, "If-None-Match", v)){
+        not_modified = etag_matches(v, etag);
+    }
+    else if (get_header(req, "If-Modified-Since", v)){
+        time_t since;
+        not_modified = parse_http_date(v, since) && m.mtime <= since;
+    }
+
+    size_t from = 0, len = m.size;
+    int range = 0;
+    if (!not_modified && !variant && get_header(req, "Range", v)){
+        // If-Range, only a range of the version the client already has
+        std::string_view cond;
+        if (!get_header(req, "If-Range", cond) || cond == m.etag || cond == m.last_modified){
+            range = parse_range(v, m.size, from, len);
+        }
+    }
+
+    OutQueue &out = reply.out;
+    bool send_body = false;
+    if (not_modified){
+        begin_response(reply, 304, "Not Modified");
+        out.append("ETag: ");
+        out.append(etag);
+        out.append("\r\nLast-Modified: ");
+        out.append(m.last_modified);
+        out.append(varies ? "\r\nVary: Accept-Encoding\r\n" : "\r\n");
+    }
+    else if (range < 0){
+        begin_response(reply, 416, "Range Not Satisfiable");
+        out.append("Content-Range: bytes */");
+        append_number(out, m.size);
+        out.append("\r\nContent-Length: 0\r\n");
+    }
+    else if (variant){
+        begin_response(reply, 200, "OK");
+        out.append(variant->headers);
+        send_body = true;
+    }
+    else if (range == 0 && h.cached){
+        begin_response(reply, 200, "OK");
+        out.append(h.cached->headers);
+        send_body = true;
+    }
+    else{
+        if (range > 0) begin_response(reply, 206, "Partial Content");
+        else begin_response(reply, 200, "OK");
+        out.append("Content-Type: ");
+        out.append(m.content_type);
+        out.append("\r\nContent-Length: ");
+        append_number(out, len);
+        if (range > 0){
+            out.append("\r\nContent-Range: bytes ");
+            append_number(out, from);
+            out.push_back('-');
+            append_number(out, from + len - 1);
+            out.push_back('/');
+            append_number(out, m.size);
+        }
+        if (varies) out.append("\r\nVary: Accept-Encoding");
+        out.append("\r\nETag: ");
+        out.append(m.etag);
+        out.append("\r\nLast-Modified: ");
+        out.append(m.last_modified);
+        out.append("\r\nAccept-Ranges: bytes\r\n");
+        send_body = true;
+    }
+    out.append(reply.keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+
+    if (!send_body || method == HTTP_HEAD || len == 0){
+        if (h.cached) FileCache::unref(h.cached);
+        else close(h.fd);
+        return true;
+    }
+    if (h.cached){
+        std::string_view body(h.cached->data + from, len);
+        if (variant) body = variant->body; // Lives as long as the file entry
+        if (out.can_hold()){
+            out.held(body, FileCache::unref, h.cached);
+        }
+        else{
+            out.append(body);
+            FileCache::unref(h.cached);
+        }
+    }
+    else{
+        out.file(h.fd, from, len, FileCache::close_fd, (void *)(intptr_t)h.fd);
+    }
+    return true;
+}
+
+// Separate path and query
+static std::string_view request_path(std::string_view uri){
+    size_t qpos = uri.find('?');
+    if (qpos != std::string_view::npos){
+        uri = uri.substr(0, qpos);
+    }
+    return uri;
+}
+
+// Handles a parsed HTTP request, response goes into the reply
+// A coroutine handler that has to wait is left in task
+static void handle_request(const HttpRequest &req, Reply &reply, Async<> &task){
+    std::string_view path = request_path(req.uri);
+
+    // Content-Encoding negotiation, handlers and the caches pick the variant
+    std::string_view accept;
+    if (response_config.gzip_level && get_header(req, "Accept-Encoding", accept)){
+        reply.encoding = choose_encoding(accept);
+    }
+
+    HttpMethod method = parse_method(req.method);
+    if (router.dispatch(path, method, req, reply, task)) return;
+    // Not a route, maybe a file
+    if (file_cache.enabled() && (method == HTTP_GET || method == HTTP_HEAD) &&
+        serve_static(req, method, path, reply)){
+        reply.route = METRIC_ROUTE_STATIC;
+        return;
+    }
+    // Unknown 404
+    responses.append(reply, RESP_NOT_FOUND);
+}
+
+// Monotonic clock in nanoseconds, for timing phases
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Monotonic clock in milliseconds
+static uint64_t now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Finer clock for queue waits, the coarse one only moves every few milliseconds
+static uint64_t now_us(){
+    return now_ns() / 1000;
+}
+
+// Per-connection read buffer, requests are parsed where they land
+// [start, end) are the bytes not consumed yet
+// Only taken from the block pool once the client sends something
+struct ConnBuffer {
+    char *data = nullptr;
+    size_t cap = 0;
+    size_t start = 0;
+    size_t end = 0;
+
+    ~ConnBuffer(){ release(); }
+
+    // Make space at the end to read into, keeping unconsumed bytes
+    // need is the full size of the request being parsed if that is known yet
+    // The parser refuses a request before it gets past the limits, so this only has to grow
+    bool make_room(size_t need){
+        if (!data){
+            data = (char *)block_pool.acquire();
+            if (!data) return false;
+            cap = BLOCK_SIZE;
+        }
+        if (end < cap) return true;
+        // Slide the unfinished request to the front
+        if (start > 0){
+            memmove(data, data + start, end - start);
+            end -= start;
+            start = 0;
+            return true;
+        }
+        // The whole buffer is one request
+        size_t want = std::max(need, cap * 2);
+        char *bigger = (char *)malloc(want);
+        if (!bigger) return false;
+        count(alloc_stats.big_mallocs);
+        memcpy(bigger, data, end);
+        drop();
+        data = bigger;
+        cap = want;
+        return true;
+    }
+
+    // Give the memory back while the connection sits idle
+    void release(){
+        drop();
+        data = nullptr;
+        cap = start = end = 0;
+    }
+
+private:
+    void drop(){
+        if (!data) return;
+        if (cap == BLOCK_SIZE) block_pool.release(data);
+        else free(data);
+    }
+};
+
+class EventLoop;
+
+// What a connection's deadline is for
+enum Phase {
+    PHASE_NONE, // No deadline, a worker has it or nothing is pending
+    PHASE_HEADER, // Reading request line and headers
+    PHASE_BODY, // Reading a request body
+    PHASE_IDLE, // Keep-alive, waiting for the next request
+    PHASE_WRITE, // Socket full, waiting for the client to read
+    PHASE_LINGER, // Refused, reading and dropping what the client still sends
+    PHASE_SLEEP // A coroutine handler is waiting on a timer
+};
+
+// One client socket owned by the event loop
+// Kept small so idle and slow clients are cheap
+struct Connection {
+    Connection(){ timer.owner = this; }
+
+    int fd;
+    EventLoop *loop; // Loop that owns it, workers hand the response back to it
+    uint32_t ip; // Client IP, for the access log and the per-address cap
+    ConnBuffer in; // Bytes read but not handled yet
+    HttpParser parser; // Where parsing of the request at in.start got to
+    OutQueue out; // Responses waiting to be written
+    Arena arena; // Request-scoped memory, reset once the responses are written
+    std::vector<HttpRequest> reqs; // Pipelined requests being answered together
+    unsigned served = 0; // Requests answered on this connection
+    bool busy = false; // A worker is handling reqs
+    bool peer_gone = false; // Socket broke while busy, free when worker is done
+    bool read_eof = false; // Client shut down its side
+    bool close_after = false; // Close once out is written
+    bool linger = false; // Half close and drain instead of closing outright
+    size_t lingered = 0; // Bytes drained
+    StaticResponse error = RESP_COUNT; // Sent after the batch when the next request was refused
+    bool zerocopy_on = false; // SO_ZEROCOPY set on the socket
+    uint32_t zerocopy_pending = 0; // MSG_ZEROCOPY sends not completed yet
+    TimerNode timer; // Deadline for the current phase, in the loop's timing wheel
+    uint64_t received_at = 0; // When reqs were read, microseconds
+    uint64_t ready_at = 0; // When their responses were done, nanoseconds
+    Phase phase = PHASE_NONE;
+    Connection *next_free = nullptr; // Connection pool free list
+    // io_uring only, recv runs on its own so bytes can land while the connection is busy
+    Buffer backlog; // Received but not moved into in yet
+    size_t backlog_off = 0; // Moved from the front of backlog
+    uint32_t inflight = 0; // SQEs the kernel may still complete for this connection
+    bool recv_armed = false; // Multishot recv running
+    bool recv_paused = false; // Recv cancelled while backlog is too big
+    bool recv_eof = false; // Recv saw the client shut down, read_eof once backlog is used up
+    bool sending = false; // A send or a wait for room is in flight
+    bool close_linked = false; // A close is linked after that send
+    bool recycle_wait = false; // Destroyed, reused once inflight is 0
+    // A batch with a coroutine handler in it can stop partway and pick up where it was
+    size_t next_req = 0; // reqs before this one are answered
+    std::optional<Reply> reply; // reqs[next_req]'s, its handler keeps a reference
+    Async<> task; // Its handler, when that's a coroutine that hasn't finished
+    std::coroutine_handle<> waiting; // Innermost coroutine of it, resumed when the wait is over
+    LoopWait wait = WAIT_NONE; // What it's waiting for
+    int wait_ms = 0;
+    bool resume_queued = false; // On the loop's list to resume
+    Connection *next_resume = nullptr;
+    size_t out_before = 0; // Response bytes before reqs[next_req]'s, for the access log
+    size_t streamed = 0; // Response bytes written and cleared while handlers waited
+    uint64_t handle_ns = 0; // Time reqs[next_req]'s handler spent running
+    H2Session *h2 = nullptr; // Set once it switched to HTTP/2, requests are its streams then
+
+    // Back to a fresh connection, memory that can be reused is kept
+    void reset(){
+        delete h2; // Streams' handler frames go with it
+        h2 = nullptr;
+        task = Async<>(); // Its frame is in the arena
+        reply.reset();
+        waiting = nullptr;
+        wait = WAIT_NONE;
+        resume_queued = false;
+        next_req = 0;
+        streamed = 0;
+        fd = -1;
+        in.release();
+        parser.reset();
+        out.release();
+        arena.release();
+        reqs.clear();
+        served = 0;
+        busy = peer_gone = read_eof = close_after = linger = false;
+        lingered = 0;
+        error = RESP_COUNT;
+        zerocopy_on = false;
+        zerocopy_pending = 0;
+        phase = PHASE_NONE;
+        backlog.release();
+        backlog_off = 0;
+        inflight = 0;
+        recv_armed = recv_paused = recv_eof = sending = close_linked = recycle_wait = false;
+    }
+};
+static_assert(alignof(Connection) >= 8, "io_uring user_data keeps the op in the low 3 bits");
+
+void LoopAwait::await_suspend(std::coroutine_handle<> h){
+    // The loop sees this once the worker hands the connection back
+    if (stream){
+        stream->waiting = h;
+        stream->wait = what;
+        stream->wait_ms = ms;
+        return;
+    }
+    conn->waiting = h;
+    conn->wait = what;
+    conn->wait_ms = ms;
+}
+
+// What an io_uring SQE was for, in the low bits of user_data next to its Connection*
+enum UringOp {
+    OP_ACCEPT,
+    OP_WAKE,
+    OP_PROVIDE, // Recv buffers handed back
+    OP_CANCEL,
+    OP_CLOSE,
+    OP_RECV,
+    OP_SEND,
+    OP_POLL // Waiting for room after sendfile filled the socket
+};
+
+// Queue the error for a request that was refused, it's logged without a method or URI
+// since it may not have parsed that far
+static void log_refused(Connection *c, Reply &reply, StaticResponse id){
+    size_t before = c->out.size();
+    responses.append(reply, id);
+    metrics.request(METRIC_ROUTE_OTHER, reply.status);
+    if (access_log.sampled()){
+        access_log.log("-", "-", c->ip, reply.status, c->out.size() - before, 0);
+    }
+}
+
+// Answer every request in the batch, responses go one after another into out
+// Handler for reqs[next_req] is done, count and log it
+static void end_request(Connection *c){
+    const Reply &reply = *c->reply;
+    metrics.latency(HIST_HANDLE, c->handle_ns);
+    metrics.request(reply.route, reply.status);
+    if (access_log.sampled()){
+        const HttpRequest &req = c->reqs[c->next_req];
+        access_log.log(req.method, req.uri, c->ip, reply.status, c->streamed + c->out.size() - c->out_before,
+                       now_us() - c->received_at);
+    }
+    c->task = Async<>();
+    c->reply.reset();
+    ++c->next_req;
+}
+
+// Where an HTTP/2 stream's body goes, picked once its headers are in like start_body does
+static bool h2_open_body(H2Stream &s){
+    if (s.recv_done) return true; // No body, the handler sees a null req.stream like HTTP/1.1
+    const BodyConsumer *bc = router.consumer(request_path(s.req.uri), parse_method(s.req.method));
+    if (!bc) return true;
+    s.req.stream = bc->open(s.req, s.arena);
+    if (!s.req.stream) return false;
+    s.sink = bc->data;
+    return true;
+}
+
+// Stream's handler is done, count and log it and hand the rest of its response to the session
+static void finish_stream(Connection *c, H2Stream *s){
+    const Reply &reply = *s->reply;
+    metrics.latency(HIST_HANDLE, s->handle_ns);
+    metrics.request(reply.route, reply.status);
+    c->h2->respond(*s, true);
+    if (access_log.sampled()){
+        std::string_view method = s->req.method.empty() ? "-" : s->req.method;
+        std::string_view uri = s->req.uri.empty() ? "-" : s->req.uri;
+        access_log.log(method, uri, c->ip, reply.status, s->resp_bytes, now_us() - s->received_at);
+    }
+    s->task = Async<>();
+    s->reply.reset();
+}
+
+// HTTP/2's answer_requests, every ready stream is started or resumed
+// A handler that waits only holds up its own stream, the rest carry on past it
+static bool answer_streams(Connection *c){
+    H2Session &h2 = *c->h2;
+    while (H2Stream *s = h2.next_ready()){
+        if (s->reset) continue; // Client cancelled it, the loop drops a waiting handler
+        uint64_t start = now_ns();
+        if (s->task){
+            std::coroutine_handle<> h = s->waiting;
+            s->waiting = nullptr;
+            s->wait = WAIT_NONE;
+            h.resume();
+        }
+        else{
+            // Written as HTTP/1.1 into the session's scratch queue, respond() turns it into frames
+            s->reply.emplace(Reply{h2.scratch, s->arena, true});
+            s->reply->conn = c;
+            s->reply->stream = s;
+            s->received_at = c->received_at;
+            if (s->error != RESP_COUNT) responses.append(*s->reply, s->error);
+            else handle_request(s->req, *s->reply, s->task);
+        }
+        s->handle_ns += now_ns() - start;
+        if (s->task && !s->task.done()){
+            h2.respond(*s, false); // What it wrote before the wait can go out meanwhile
+            continue;
+        }
+        finish_stream(c, s);
+    }
+    c->ready_at = now_ns();
+    return true;
+}
+
+// false if a coroutine handler is waiting on the loop
+// Called again once the wait is over, it resumes the handler and the batch carries on
+static bool answer_requests(Connection *c){
+    if (c->h2) return answer_streams(c);
+    if (c->task){
+        uint64_t start = now_ns();
+        std::coroutine_handle<> h = c->waiting;
+        c->waiting = nullptr;
+        c->wait = WAIT_NONE;
+        h.resume();
+        c->handle_ns += now_ns() - start;
+        if (!c->task.done()) return false;
+        end_request(c);
+    }
+    while (c->next_req < c->reqs.size()){
+        size_t i = c->next_req;
+        // Only the last one in the batch can be the closing one, unless an error comes after it
+        bool keep_alive = !(c->close_after && i + 1 == c->reqs.size() && c->error == RESP_COUNT);
+        c->reply.emplace(Reply{c->out, c->arena, keep_alive});
+        c->reply->conn = c;
+        c->out_before = c->streamed + c->out.size();
+        uint64_t start = now_ns();
+        handle_request(c->reqs[i], *c->reply, c->task);
+        c->handle_ns = now_ns() - start;
+        if (c->task && !c->task.done()) return false;
+        end_request(c);
+    }
+    c->reqs.clear();
+    c->next_req = 0;
+    if (c->error != RESP_COUNT){
+        Reply reply{c->out, c->arena, false};
+        log_refused(c, reply, c->error);
+    }
+    c->ready_at = now_ns();
+    return true;
+}
+
+// Overloaded, the batch gets one 503 instead of answers and the connection closes
+// On HTTP/2 only the new streams are refused, the connection and waiting handlers carry on
+static void shed(Connection *c){
+    if (c->h2){
+        c->h2->refuse_new();
+        answer_streams(c);
+        return;
+    }
+    c->reqs.clear();
+    c->error = RESP_UNAVAILABLE;
+    c->close_after = true;
+    c->linger = true;
+    answer_requests(c);
+}
+
+// Over a connection cap, turned away without ever getting a Connection
+// The 503 is copied from the cache and sent in one go, or a RST is cheaper still
+static void turn_away(int fd){
+    if (config.shed_reset){
+        struct linger lg = {1, 0}; // Zero linger makes close send a RST
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    else{
+        // Take any request that already came so the close isn't a reset that loses the 503
+        char scratch[4096];
+        ssize_t r = recv(fd, scratch, sizeof(scratch), MSG_DONTWAIT);
+        char buf[512];
+        size_t n = responses.copy(RESP_UNAVAILABLE, false, buf, sizeof(buf));
+        r = send(fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+        (void)r;
+    }
+    close(fd);
+}
+
+// Upgrade: h2c on a request that can become stream 1 of an HTTP/2 connection
+// Not for streamed bodies, their consumer is already reading into the connection's arena
+static bool wants_h2c(const HttpRequest &req){
+    std::string_view settings;
+    return config.h2_streams && req.version == "HTTP/1.1" && header_has_token(req, "Upgrade", "h2c") &&
+           get_header(req, "HTTP2-Settings", settings) &&
+           !router.consumer(request_path(req.uri), parse_method(req.method));
+}
+
+// Edge-triggered epoll reactor
+// Owns every socket, only full requests go to the worker threads
+// With no pool the loop handles requests itself (one loop per core mode)
+// With -e uring the same loop runs on io_uring instead: accept and recv are multishot, sends
+// are SQEs, and everything queued in a pass goes to the kernel in the one io_uring_enter that
+// waits for the next completions. Parsing, handlers, deadlines and workers are shared.
+class EventLoop {
+public:
+    EventLoop(int lfd, ThreadPool *pool) : listen_fd(lfd), pool(pool){
+        uring = config.uring && start_uring();
+        // Workers poke this when a response is ready, io_uring waits on it with a READ so it blocks
+        wake_fd = eventfd(0, uring ? EFD_CLOEXEC : EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd < 0){
+            perror("eventfd");
+            exit(1);
+        }
+        if (uring) return;
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0){
+            perror("epoll setup");
+            exit(1);
+        }
+        // Listener and wakeup fd are told apart by pointer, connections by their Connection*
+        add_fd(listen_fd, EPOLLIN | EPOLLET, &listen_fd);
+        add_fd(wake_fd, EPOLLIN | EPOLLET, &wake_fd);
+    }
+
+    ~EventLoop(){
+        close(wake_fd);
+        if (epoll_fd >= 0) close(epoll_fd);
+    }
+
+    // Runs forever handling socket events
+    void run(){
+        if (uring){
+            run_uring();
+            return;
+        }
+        const int MAX_EVENTS = 256;
+        struct epoll_event events[MAX_EVENTS];
+        while (true){
+            // Sleep until the wheel has a deadline due, or forever
+            int timeout = resumable ? 0 : wheel.next_timeout(now_ms());
+            int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+            if (n < 0){
+                if (errno == EINTR) continue;
+                perror("epoll_wait");
+                return;
+            }
+            for (int i = 0; i < n; ++i){
+                void *ptr = events[i].data.ptr;
+                if (ptr == &listen_fd){
+                    accept_clients();
+                }
+                else if (ptr == &wake_fd){
+                    finish_responses();
+                }
+                else{
+                    on_event((Connection *)ptr, events[i].events);
+                }
+            }
+            resume_handlers();
+            expire_deadlines();
+            recycle_dead();
+        }
+    }
+
+private:
+    void add_fd(int fd, uint32_t ev, void *ptr){
+        struct epoll_event e;
+        memset(&e, 0, sizeof(e));
+        e.events = ev;
+        e.data.ptr = ptr;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &e) < 0){
+            perror("epoll_ctl");
+        }
+    }
+
+    // Accept everything waiting, edge-triggered so drain until EAGAIN
+    void accept_clients(){
+        while (true){
+            struct sockaddr_in client_addr; // Client
+            socklen_t client_len = sizeof(client_addr);
+            int client_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &client_len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_fd < 0){
+                if (errno == EINTR) continue; // If call interupted
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return; // Nothing left
+                perror("accept");
+                return;
+            }
+            Connection *c = admit_client(client_fd, client_addr);
+            if (!c) continue;
+            add_fd(client_fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, c);
+            // Connecting and never sending anything runs out the header deadline
+            set_deadline(c, PHASE_HEADER, config.header_timeout_ms);
+        }
+    }
+
+    // A Connection for a new client, null if a cap turned it away
+    Connection *admit_client(int client_fd, const struct sockaddr_in &client_addr){
+        uint32_t ip = ntohl(client_addr.sin_addr.s_addr);
+        if (admission.admit(ip) != ADMIT_OK){
+            turn_away(client_fd);
+            return nullptr;
+        }
+        metrics.accepted();
+        Connection *c = new_connection();
+        c->fd = client_fd;
+        c->ip = ip;
+        c->loop = this;
+        return c;
+    }
+
+    void on_event(Connection *c, uint32_t ev){
+        if (c->fd < 0) return; // Closed earlier in this batch of events
+        // Zerocopy completions also show up as EPOLLERR, only a socket error is fatal
+        if ((ev & EPOLLERR) && c->zerocopy_pending && !socket_error(c->fd)){
+            uint32_t n = reap_zerocopy(c->fd);
+            c->zerocopy_pending -= std::min(n, c->zerocopy_pending);
+            ev &= ~EPOLLERR;
+        }
+        if (ev & (EPOLLERR | EPOLLHUP)){
+            // Socket is dead, wait for the worker if it still has the requests
+            if (c->busy) c->peer_gone = true;
+            else destroy(c);
+            return;
+        }
+        if (c->phase == PHASE_LINGER){
+            drain(c);
+            return;
+        }
+        if (c->busy) return; // Picked up again once the worker finishes
+        if (!c->out.done()){
+            if (ev & EPOLLOUT) flush(c);
+            return;
+        }
+        if (c->task) return; // A handler is waiting, more requests are read once the batch is done
+        if (ev & (EPOLLIN | EPOLLRDHUP)){
+            read_more(c);
+        }
+    }
+
+    // Read everything available then pull out every whole request that is here
+    void read_more(Connection *c){
+        if (c->h2){
+            h2_read_more(c);
+            return;
+        }
+        // Header and body deadlines carry on, the others are over once the client talks
+        if (c->phase == PHASE_IDLE || c->phase == PHASE_WRITE){
+            clear_deadline(c);
+        }
+        while (true){
+            // Make room at the end of the buffer
+            if (!c->in.make_room(c->parser.needed())){
+                metrics.refused(c->parser.in_body() ? REFUSED_BODY_TOO_LARGE : REFUSED_HEADERS_TOO_LARGE);
+                reject(c, c->parser.in_body() ? RESP_BODY_TOO_LARGE : RESP_HEADERS_TOO_LARGE);
+                return;
+            }
+            bool drained;
+            if (!read_in(c, drained)) return;
+
+            // HTTP/2 with prior knowledge starts with the preface instead of a request
+            if (config.h2_streams && c->served == 0 && c->in.start == 0 && c->in.end > 0 &&
+                memcmp(c->in.data, H2_PREFACE, std::min(c->in.end, (size_t)H2_PREFACE_LEN)) == 0){
+                if (c->in.end >= H2_PREFACE_LEN){
+                    start_h2(c, nullptr);
+                    h2_read_more(c);
+                }
+                else if (c->read_eof){
+                    destroy(c);
+                }
+                else if (!drained){
+                    continue;
+                }
+                else if (c->phase != PHASE_HEADER){
+                    set_deadline(c, PHASE_HEADER, config.header_timeout_ms);
+                }
+                return;
+            }
+
+            // Pipelining, take requests off the front until one is incomplete
+            // Only timed when the read brought something, EOF and EAGAIN passes would skew it
+            bool parsing = c->in.start < c->in.end;
+            uint64_t parse_start = parsing ? now_ns() : 0;
+            ParseStatus st = PARSE_INCOMPLETE;
+            while (c->in.start < c->in.end){
+                c->reqs.emplace_back();
+                HttpRequest &req = c->reqs.back();
+                st = parse_next(c, req);
+                if (st == PARSE_HEAD){
+                    // Headers are in, pick where the body goes before any of it is parsed
+                    st = start_body(c, req);
+                    if (st == PARSE_DONE) st = parse_next(c, req);
+                }
+                if (st != PARSE_DONE){
+                    c->reqs.pop_back();
+                    break;
+                }
+                c->in.start += c->parser.consumed();
+                c->parser.reset();
+                // Anything after an Upgrade: h2c request is HTTP/2 if the upgrade happens
+                if (wants_h2c(c->reqs.back())) break;
+                bool keep = config.idle_timeout_ms > 0 && wants_keep_alive(c->reqs.back());
+                // Last request this connection gets
+                if (!keep || (config.max_requests && c->served + c->reqs.size() >= config.max_requests)){
+                    c->close_after = true;
+                    break;
+                }
+            }
+            // Everything consumed, the views in reqs stay good until the next read
+            if (c->in.start == c->in.end){
+                c->in.start = c->in.end = 0;
+            }
+            if (parsing) metrics.latency(HIST_PARSE, now_ns() - parse_start);
+            if (parse_failed(st)) metrics.refused(refused_kind(st));
+            if (c->reqs.size() == 1 && wants_h2c(c->reqs[0]) && start_h2(c, &c->reqs[0])){
+                h2_read_more(c);
+                return;
+            }
+
+            if (c->reqs.empty()){
+                if (parse_failed(st)){
+                    // Malformed or over a limit, say which before closing
+                    reject(c, parse_error(st));
+                }
+                else if (c->read_eof && c->in.end > 0){
+                    // Client left partway through a request
+                    destroy(c);
+                }
+                else if (c->read_eof){
+                    destroy(c); // Client left between requests
+                }
+                else if (!drained){
+                    continue; // Buffer filled up in the middle of a request, keep going
+                }
+                else if (c->served > 0 && c->in.end == 0){
+                    idle_add(c); // Waiting on the next keep-alive request
+                }
+                else if (c->parser.in_body()){
+                    // Body deadline is per read, a big upload just has to keep moving
+                    set_deadline(c, PHASE_BODY, config.body_timeout_ms);
+                }
+                else if (c->phase != PHASE_HEADER){
+                    // Header deadline covers the whole head, trickling doesn't extend it
+                    set_deadline(c, PHASE_HEADER, config.header_timeout_ms);
+                }
+                return;
+            }
+            // Nothing more will come, answer what we have then close
+            if (parse_failed(st)){
+                c->error = parse_error(st);
+                c->close_after = true;
+                c->linger = true;
+            }
+            else if (c->read_eof){
+                c->close_after = true;
+            }
+            c->served += c->reqs.size();
+            c->received_at = now_us();
+            clear_deadline(c); // Ours until the response starts going out
+            break;
+        }
+        dispatch(c);
+    }
+
+    // Read what the socket has into the connection buffer, drained once it had no more
+    // false if the connection broke and was closed
+    bool read_in(Connection *c, bool &drained){
+        drained = false;
+        if (uring){
+            drained = !c->read_eof && use_backlog(c);
+            return true;
+        }
+        // Read straight into the connection buffer
+        while (!c->read_eof && c->in.end < c->in.cap){
+            ssize_t n = super_read(c->fd, c->in.data + c->in.end, c->in.cap - c->in.end);
+            if (n < 0){
+                if (errno == EAGAIN || errno == EWOULDBLOCK){
+                    drained = true;
+                    break;
+                }
+                destroy(c);
+                return false;
+            }
+            if (n == 0){
+                c->read_eof = true; // Connection closed
+                break;
+            }
+            metrics.bytes_in(n);
+            c->in.end += n;
+        }
+        return true;
+    }
+
+    // Requests are read, answer them
+    void dispatch(Connection *c){
+        // Per-core mode, answer right here on this CPU
+        if (!pool){
+            answer_requests(c);
+            flush(c);
+            return;
+        }
+
+        // Queue is so deep these wouldn't be answered in time anyway
+        if (config.max_queue && pool->queued() >= config.max_queue){
+            count(admission_stats.shed_queue);
+            shed(c);
+            flush(c);
+            return;
+        }
+
+        // Hand the requests to a worker
+        c->busy = true;
+        Task task;
+        task.fn = work;
+        task.arg = c;
+        pool->enqueue(task);
+    }
+
+    // Switch the connection to HTTP/2, upgrade is the HTTP/1.1 request that asked for it or
+    // null when the client started with the preface
+    // false if the upgrade's HTTP2-Settings don't decode, the request is answered as HTTP/1.1
+    bool start_h2(Connection *c, const HttpRequest *upgrade){
+        H2Session *h2 = new H2Session(config.limits, config.h2_streams);
+        h2->conn = c;
+        h2->open_body = h2_open_body;
+        if (upgrade){
+            std::string_view settings;
+            get_header(*upgrade, "HTTP2-Settings", settings);
+            if (!h2->upgrade(settings, *upgrade)){
+                delete h2;
+                return false;
+            }
+            count(h2_stats.upgrades);
+            c->reqs.clear(); // Stream 1 has its own copy
+        }
+        else{
+            h2->start();
+        }
+        count(h2_stats.sessions);
+        c->h2 = h2;
+        c->close_after = c->read_eof; // Connection: close and -m are HTTP/1.1's, HTTP/2 ends with GOAWAY
+        return true;
+    }
+
+    // HTTP/2's read_more, whole frames are taken off the buffer as they arrive
+    // Streams whose requests are complete get answered like a batch
+    void h2_read_more(Connection *c){
+        H2Session &h2 = *c->h2;
+        clear_deadline(c); // h2_output picks the next one
+        while (!h2.failed()){
+            if (!c->in.make_room(h2.needed())){
+                destroy(c);
+                return;
+            }
+            bool drained;
+            if (!read_in(c, drained)) return;
+            c->in.start += h2.receive(c->in.data + c->in.start, c->in.end - c->in.start);
+            if (c->in.start == c->in.end){
+                c->in.start = c->in.end = 0;
+            }
+            if (drained || c->read_eof) break;
+        }
+        if (h2.failed()){
+            // GOAWAY then close, whatever the client still sends is drained
+            c->close_after = true;
+            c->linger = true;
+        }
+        else if (c->read_eof || h2.peer_done()){
+            c->close_after = true; // Streams already here still get answered
+        }
+        if (h2.has_ready()){
+            c->received_at = now_us();
+            dispatch(c);
+            return;
+        }
+        h2_output(c, true);
+    }
 
-// Worker thread pool
-class ThreadPool {
-public:
-    // Starts worker threads that will wait for tasks
-    ThreadPool(size_t n) : stop_flag(false){
-        for (size_t i = 0; i < n; ++i) {
-            workers.emplace_back([this] {this->worker_loop();});
+    // Frame what the streams have and write it, then wait on whatever comes next
+    // from_read means the socket was just read dry, otherwise it's read once the writing is done
+    void h2_output(Connection *c, bool from_read){
+        H2Session &h2 = *c->h2;
+        while (true){
+            // All written, nothing in the streams is referenced any more
+            c->out.clear();
+            c->arena.reset();
+            settle_streams(c);
+            h2.pump(c->out);
+            if (c->out.done()) break;
+            if (uring){
+                send_more(c, false); // Comes back through flushed()
+                return;
+            }
+            if (!write_out(c)) return; // EPOLLOUT carries on, or it broke
+        }
+        if (c->ready_at){
+            metrics.latency(HIST_WRITE, now_ns() - c->ready_at);
+            c->ready_at = 0;
+        }
+        if (h2.has_ready()){
+            queue_resume(c); // Handlers whose waits are over
+            return;
+        }
+        if (c->close_after && (h2.failed() || h2.idle())){
+            if (c->linger) start_linger(c);
+            else destroy(c);
+            return;
+        }
+        if (!from_read){
+            h2_read_more(c);
+            return;
+        }
+        if (h2.idle() && c->in.end == 0){
+            idle_add(c);
+        }
+        else if (h2.receiving() || c->in.end > 0){
+            set_deadline(c, PHASE_BODY, config.body_timeout_ms);
+        }
+        else if (h2.blocked()){
+            set_deadline(c, PHASE_WRITE, config.write_timeout_ms); // Client has to open its window
+        }
+        else{
+            clear_deadline(c); // Only handlers are waiting
         }
     }
 
-    // Deconstructor to shut down worker threads
-    ~ThreadPool() {
-        {
-            // Locks queue
-            std::unique_lock<std::mutex> lk(queue_mutex);
-            stop_flag = true;
+    // Between writes: drop handlers of cancelled streams, start the waits of the others
+    void settle_streams(Connection *c){
+        H2Session &h2 = *c->h2;
+        h2.each([&](H2Stream &s){
+            if (!s.task) return;
+            if (s.reset){
+                // Client reset it or the session ended, its handler never comes back
+                wheel.cancel(&s.timer);
+                s.task = Async<>();
+                s.reply.reset();
+                s.waiting = nullptr;
+                s.wait = WAIT_NONE;
+                return;
+            }
+            if (s.queued) return;
+            if (s.wait == WAIT_SLEEP && !s.timer.armed){
+                wheel.schedule(&s.timer, now_ms() + s.wait_ms);
+            }
+            else if (s.wait == WAIT_WRITE && s.drained()){
+                h2.make_ready(&s);
+            }
+        });
+        h2.collect();
+    }
+
+    // A stream's sleep is over
+    void on_stream_timeout(H2Stream *s){
+        Connection *c = s->conn;
+        if (c->busy){
+            // A worker has the session, look again next tick
+            wheel.schedule(&s->timer, now_ms() + WHEEL_TICK_MS);
+            return;
+        }
+        c->h2->make_ready(s);
+        if (c->out.done()) queue_resume(c); // Otherwise h2_output does once it's written
+    }
+
+    // Parse what's at the front of the buffer, the parser can shrink it
+    static ParseStatus parse_next(Connection *c, HttpRequest &req){
+        size_t len = c->in.end - c->in.start;
+        ParseStatus st = c->parser.parse(c->in.data + c->in.start, len, req, config.limits);
+        c->in.end = c->in.start + len;
+        return st;
+    }
+
+    // Body is next, stream it to the route's consumer or keep it for the handler
+    // PARSE_HEAD means wait: requests ahead of this one in the batch have to be answered
+    // first, their responses would reset the arena the consumer's state lives in and a
+    // 100 Continue can't jump ahead of them.
+    ParseStatus start_body(Connection *c, const HttpRequest &req){
+        const BodyConsumer *bc = router.consumer(request_path(req.uri), parse_method(req.method));
+        std::string_view expect;
+        bool expects = req.version == "HTTP/1.1" && get_header(req, "Expect", expect) &&
+                       iequals(expect, "100-continue");
+        if ((bc || expects) && c->reqs.size() > 1) return PARSE_HEAD;
+        void *state = nullptr;
+        if (bc){
+            state = bc->open(req, c->arena);
+            if (!state) return PARSE_BODY_TOO_BIG;
         }
-        cv.notify_all();  // Notifies all workers
-        for (auto &t : workers){
-            // If thread stil running, wait before deconstruction
-            if (t.joinable()){
-                t.join();
+        const RequestLimits &limits = config.limits;
+        if (!c->parser.start_body(bc ? bc->data : nullptr, state, bc ? limits.stream_body : limits.body)){
+            return PARSE_BODY_TOO_BIG; // Refused before the client sends it
+        }
+        if (expects){
+            // Client is waiting to hear the body is wanted, nothing else is queued so it goes straight out
+            static const char cont[] = "HTTP/1.1 100 Continue\r\n\r\n";
+            ssize_t r = send(c->fd, cont, sizeof(cont) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+            (void)r;
+        }
+        return PARSE_DONE;
+    }
+
+    // Runs on a worker thread
+    static void work(void *arg){
+        Connection *c = (Connection *)arg;
+        EventLoop *self = c->loop;
+        thread_local CoDel codel;
+        uint64_t now = now_us();
+        if (c->task){
+            answer_requests(c); // Back from a wait, it was let in already
+        }
+        else{
+            metrics.latency(HIST_WAIT, (now - c->received_at) * 1000);
+            if (config.codel_target_ms &&
+                codel.should_drop(now, now - c->received_at, config.codel_target_ms * 1000ull,
+                                  config.codel_interval_ms * 1000ull)){
+                count(admission_stats.shed_codel);
+                shed(c);
+            }
+            else{
+                answer_requests(c);
             }
         }
+        {
+            std::lock_guard<std::mutex> lk(self->done_mutex);
+            self->done.push_back(c);
+        }
+        uint64_t one = 1;
+        ssize_t r = write(self->wake_fd, &one, sizeof(one)); // Wake the loop
+        (void)r;
     }
 
-    // Add task
-    void enqueue(std::function<void()> task){
+    // Responses the workers finished since the last wakeup
+    void finish_responses(){
+        uint64_t cnt;
+        while (!uring && read(wake_fd, &cnt, sizeof(cnt)) > 0){} // io_uring's READ already took it
         {
-            // Locks queue
-            std::unique_lock<std::mutex> lk(queue_mutex);
-            // Add new task to queue
-            tasks.push(std::move(task));
+            std::lock_guard<std::mutex> lk(done_mutex);
+            ready.swap(done);
         }
-        cv.notify_one(); // Calls a worker thread for task
+        for (Connection *c : ready){
+            c->busy = false;
+            if (c->peer_gone) destroy(c);
+            else flush(c);
+        }
+        ready.clear();
     }
-private:
-    // Worker thread's life loop
-    void worker_loop(){
-        while (true){
-            std::function<void()> task;
-            {
-                // Locks queue
-                std::unique_lock<std::mutex> lk(queue_mutex);
-                cv.wait(lk, [this] { return stop_flag || !tasks.empty(); }); // Wait for task
-                // If shutdown, and not running a task
-                if (stop_flag && tasks.empty()){
-                    return;
+
+    // Write as much of the responses as the socket takes
+    void flush(Connection *c){
+        if (uring){
+            send_more(c, false);
+            return;
+        }
+        if (write_out(c)) flushed(c);
+    }
+
+    // epoll's half of flush, true once out is all written
+    // Headers and bodies go out together with one sendmsg per batch of iovecs
+    bool write_out(Connection *c){
+        bool progress = false;
+        while (!c->out.done()){
+            int file_fd;
+            off_t file_off;
+            size_t file_len;
+            if (c->out.next_file(file_fd, file_off, file_len)){
+                ssize_t w = super_sendfile(c->fd, file_fd, file_off, file_len);
+                if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                    write_blocked(c, progress);
+                    return false; // EPOLLOUT tells us when there is room again
                 }
-                task = std::move(tasks.front()); // Take task at front of queue
-                tasks.pop();
+                if (w <= 0){
+                    destroy(c); // Socket broke or the file was cut short under us
+                    return false;
+                }
+                metrics.bytes_out(w);
+                c->out.advance(w);
+                progress = true;
+                continue;
+            }
+            struct iovec iov[MAX_IOVECS];
+            bool zerocopy;
+            int cnt = c->out.fill(iov, MAX_IOVECS, zerocopy);
+            if (zerocopy && !c->zerocopy_on){
+                // Turned on the first time a connection sends something big
+                int one = 1;
+                c->zerocopy_on = setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
             }
-            try{
-                task(); // Do task
+            zerocopy = zerocopy && c->zerocopy_on;
+            ssize_t w = super_sendmsg(c->fd, iov, cnt, zerocopy ? MSG_ZEROCOPY : 0);
+            if (w < 0 && zerocopy && errno == ENOBUFS){
+                // Out of pinned page budget, copy this one
+                zerocopy = false;
+                w = super_sendmsg(c->fd, iov, cnt, 0);
             }
-            catch (const std::exception &e){
-                std::cerr<<"Task exception: "<<e.what()<<"\n";
+            if (w < 0){
+                if (errno == EAGAIN || errno == EWOULDBLOCK){
+                    write_blocked(c, progress);
+                    return false; // EPOLLOUT tells us when there is room again
+                }
+                destroy(c);
+                return false;
             }
+            if (zerocopy) ++c->zerocopy_pending;
+            metrics.bytes_out(w);
+            c->out.advance(w);
+            progress = true;
         }
+        return true;
     }
 
-    std::vector<std::thread> workers;  // Worker threads
-    std::queue<std::function<void()>> tasks; // Task queue
-    std::mutex queue_mutex; // Protect queue
-    std::condition_variable cv; // Notifies worker threads
-    bool stop_flag;  // Shutdown flag
-};
+    // Everything queued went out
+    void flushed(Connection *c){
+        if (c->h2){
+            h2_output(c, false); // Frames the next round, streams finish one by one
+            return;
+        }
+        if (c->task){
+            park(c); // The batch isn't over, a handler is waiting
+            return;
+        }
+        if (c->ready_at){
+            metrics.latency(HIST_WRITE, now_ns() - c->ready_at);
+            c->ready_at = 0;
+        }
+        if (c->close_after){
+            if (c->linger) start_linger(c);
+            else destroy(c); // Connection: close
+            return;
+        }
+        // Keep-alive, start on whatever the client sent meanwhile
+        c->out.clear();
+        c->arena.reset();
+        read_more(c);
+    }
 
-// Read until something is read
-static ssize_t super_read(int fd, void *buf, size_t count){
-    ssize_t r;
-    do{
-        r = read(fd, buf, count);
-    } while (r < 0 && errno == EINTR); //
-    // EINTR errors are interrupted system calls, usually can just try again
-    // https://medium.com/@agadallh5/understanding-eintr-the-error-interrupt-signal-in-unix-systems-670a1bedc121 
-    
-    return r;
-}
+    // What a waiting handler wrote is out, start on what it waits for
+    void park(Connection *c){
+        if (c->wait == WAIT_SLEEP){
+            set_deadline(c, PHASE_SLEEP, c->wait_ms);
+        }
+        else if (c->wait == WAIT_WRITE && !c->resume_queued){
+            // Sent bytes are only needed for counting now
+            c->streamed += c->out.size();
+            c->out.clear();
+            queue_resume(c);
+        }
+    }
 
-// Write until all bytes are written
-static ssize_t super_write(int fd, const void *buf, size_t count){
-    ssize_t w = 0; // Total bytes written
-    const char *p = (const char *)buf;
-    size_t left = count; // Bytes to be written
-    // Keeps calling write()
-    while (left > 0){
-        ssize_t n = write(fd, p + w, left);
-        if (n < 0){
-            if (errno == EINTR) continue; // Interrupted writes
-            return -1;
-        } 
-        left -= n;
-        w += n;
-    }
-    return w;
-}
-
-// Decodes form-encoded data for POST
-static std::string url_decode(const std::string &s){
-    std::string out;
-    out.reserve(s.size());
-    for (size_t i = 0; i < s.size(); ++i){
-        char c = s[i];
-        if (c == '+'){
-            out.push_back(' '); // form: + is a space
-        }
-        // form: %xx is followed by 2 digits of hex
-        else if (c == '%' && i + 2 < s.size()){
-            int hi, lo;
-            // Hex dictionary
-            auto hex = [](char ch) -> int {
-                if (ch >= '0' && ch <= '9') return ch - '0';
-                if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
-                if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
-                return -1;
-            };
-            hi = hex(s[i + 1]);
-            lo = hex(s[i + 2]);
-            // Return decoded characters
-            if (hi >= 0 && lo >= 0){
-                out.push_back((char)((hi << 4) | lo));
-                i += 2;
-            }
-            else{
-                out.push_back('%');
+    // Resumed after this pass, right away could recurse once per piece in per-core mode
+    void queue_resume(Connection *c){
+        if (c->resume_queued) return;
+        c->resume_queued = true;
+        c->next_resume = resumable;
+        resumable = c;
+    }
+
+    // A waiting handler can carry on, like a new batch but nothing is shed this late
+    // HTTP/2 streams are a new batch, new streams read meanwhile can be shed with them
+    void resume_handler(Connection *c){
+        if (c->h2){
+            // Busy or still writing, h2_output queues it again once that's over
+            if (c->busy || !c->out.done() || !c->h2->has_ready()) return;
+            c->received_at = now_us();
+            dispatch(c);
+            return;
+        }
+        if (!pool){
+            answer_requests(c);
+            flush(c);
+            return;
+        }
+        c->busy = true;
+        Task task;
+        task.fn = work;
+        task.arg = c;
+        pool->enqueue(task);
+    }
+
+    // Handlers whose writes went out since the last pass
+    void resume_handlers(){
+        resuming = resumable;
+        resumable = nullptr;
+        while (resuming){
+            Connection *c = resuming;
+            resuming = c->next_resume;
+            c->resume_queued = false;
+            resume_handler(c);
+        }
+    }
+
+    // Closed while on a resume list, take it off so it can be recycled
+    void unqueue_resume(Connection *c){
+        for (Connection **list : {&resumable, &resuming}){
+            for (Connection **p = list; *p; p = &(*p)->next_resume){
+                if (*p == c){
+                    *p = c->next_resume;
+                    c->resume_queued = false;
+                    return;
+                }
             }
         }
-        else out.push_back(c); 
     }
-    return out;
-}
 
-// Parse POST query encoded data: key=value&key2=value2
-static bool parse_POST(const std::string &s, const std::string &key, std::string &value) {
-    size_t pos = s.find(key + "="); // Find first value
-    if (pos == std::string::npos) return false; 
-    pos += key.size() + 1; // pos at value
-    size_t end = s.find('&', pos); // end of first value
-    value = s.substr(pos, (end == std::string::npos) ? std::string::npos : end - pos);
-    value = url_decode(value); // Get actual value
-    return true;
-}
+    // Refuse the request being read, the response says why and the connection closes after
+    void reject(Connection *c, StaticResponse id){
+        Reply reply{c->out, c->arena, false};
+        log_refused(c, reply, id);
+        c->close_after = true;
+        c->linger = true;
+        flush(c);
+    }
 
-// Helper to read until CRLFCRLF
-struct HttpRequest {
-    std::string method; // GET/POST/DELTE
-    std::string uri; // /index /multiply
-    std::string version; // HTTP/1,1
-    std::vector<std::pair<std::string, std::string>> headers; // Header data
-    std::string body; // POST data
-};
+    // Closing with unread bytes sends a reset, which can throw away the error response before
+    // the client reads it. So only our side is shut and the rest is read and dropped until the
+    // client stops, or LINGER_MS / LINGER_MAX run out.
+    void start_linger(Connection *c){
+        shutdown(c->fd, SHUT_WR);
+        c->in.release();
+        c->out.release();
+        c->backlog.release();
+        c->backlog_off = 0;
+        set_deadline(c, PHASE_LINGER, LINGER_MS);
+        drain(c);
+    }
 
-static bool parse_request(int client_fd, HttpRequest &req){
-    std::string data;
-    data.reserve(8192);
-    char buf[BUFFER_SIZE];
-    ssize_t n;
-    // Read until we have headers end
-    while (true){
-        n = super_read(client_fd, buf, sizeof(buf)); // Read from client
-        if (n < 0) return false;
-        if (n == 0) break; // Connection closed
-        data.append(buf, buf + n); // Add to data
-        if (data.find("\r\n\r\n") != std::string::npos) break; // Until end characters
-        if (data.size() > 65536) break; // Too much data
-    }
-
-    size_t hdr_end = data.find("\r\n\r\n");
-    if (hdr_end == std::string::npos) return false; // invalid request
-
-    std::string headers_block = data.substr(0, hdr_end);
-    size_t pos = 0;
-    // Reads each line at a time
-    auto next_line = [&](std::string &line) -> bool {
-        // Checks if more lines
-        if (pos >= headers_block.size()){
-            return false;
+    void drain(Connection *c){
+        if (uring){
+            // Recv drops whatever comes in from here on, see take()
+            if (c->recv_eof){
+                destroy(c);
+                return;
+            }
+            c->recv_paused = false;
+            if (!c->recv_armed) arm_recv(c);
+            return;
         }
-        size_t lf = headers_block.find("\r\n", pos);
-        // If final line
-        if (lf == std::string::npos){
-            line = headers_block.substr(pos);
-            pos = headers_block.size();
-            return true;
+        char scratch[16384];
+        while (true){
+            ssize_t n = super_read(c->fd, scratch, sizeof(scratch));
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (n <= 0){
+                destroy(c); // Client is done too
+                return;
+            }
+            c->lingered += n;
+            if (c->lingered > LINGER_MAX){
+                destroy(c);
+                return;
+            }
         }
-        // If more lines, take substring, advance pos
-        line = headers_block.substr(pos, lf - pos);
-        pos = lf + 2;
-        return true;
-    };
+    }
 
-    // Request line
-    std::string line;
-    if (!next_line(line)){
-        return false;
+    // Socket is full, the client gets write_timeout_ms to take more
+    // Restarted whenever something got written, so a slow reader is fine but a stuck one isn't
+    void write_blocked(Connection *c, bool progress){
+        if (progress || c->phase != PHASE_WRITE){
+            set_deadline(c, PHASE_WRITE, config.write_timeout_ms);
+        }
     }
-    {
-        std::istringstream iss(line); // Stream to parse line
-        // If request doesn't have method/uri/version invalid
-        if (!(iss >> req.method >> req.uri >> req.version)){
-            return false;
+
+    // Keep-alive, nothing to do until the client sends another request
+    void idle_add(Connection *c){
+        // Blocks go back to the pool while nothing is happening
+        c->in.release();
+        c->out.release();
+        c->arena.release();
+        c->backlog.release();
+        set_deadline(c, PHASE_IDLE, config.idle_timeout_ms);
+    }
+
+    void set_deadline(Connection *c, Phase phase, int timeout_ms){
+        c->phase = phase;
+        wheel.schedule(&c->timer, now_ms() + timeout_ms);
+    }
+
+    void clear_deadline(Connection *c){
+        c->phase = PHASE_NONE;
+        wheel.cancel(&c->timer);
+    }
+
+    // Deal with every connection whose deadline passed
+    void expire_deadlines(){
+        wheel.advance(now_ms(), [this](void *owner){
+            // Low bit set is an HTTP/2 stream's sleep
+            if ((uintptr_t)owner & 1) on_stream_timeout((H2Stream *)((uintptr_t)owner & ~(uintptr_t)1));
+            else on_timeout((Connection *)owner);
+        });
+    }
+
+    void on_timeout(Connection *c){
+        Phase phase = c->phase;
+        c->phase = PHASE_NONE;
+        if (c->h2 && (phase == PHASE_BODY || phase == PHASE_IDLE)){
+            // HTTP/2 says goodbye with a GOAWAY instead of a 408 or just closing
+            if (phase == PHASE_BODY) metrics.refused(REFUSED_TIMEOUT);
+            c->h2->abort(H2_NO_ERROR);
+            c->close_after = true;
+            c->linger = phase == PHASE_BODY;
+            h2_output(c, false);
+            return;
+        }
+        if (phase == PHASE_HEADER || phase == PHASE_BODY){
+            // Slow or silent client, tell it why before closing
+            metrics.refused(REFUSED_TIMEOUT);
+            c->out.clear();
+            reject(c, RESP_TIMEOUT);
+            return;
         }
+        if (phase == PHASE_SLEEP){
+            resume_handler(c);
+            return;
+        }
+        destroy(c); // Idle keep-alive, a client that stopped reading or done lingering
     }
 
-    // Headers
-    while (next_line(line)){
-        size_t c = line.find(':'); // format- key: value
-        if (c != std::string::npos) {
-            // Get key and value
-            std::string key = line.substr(0, c);
-            std::string val = line.substr(c + 1);
-            // Get rid of spaces
-            while (!val.empty() && (val[0] == ' ' || val[0] == '\t')) val.erase(0, 1);
-            while (!val.empty() && (val.back() == ' ' || val.back() == '\t')) val.pop_back();
-            req.headers.emplace_back(key, val); // Store header
+    void destroy(Connection *c){
+        clear_deadline(c);
+        admission.leave(c->ip);
+        if (c->resume_queued) unqueue_resume(c);
+        c->task = Async<>(); // A handler waiting on it never comes back
+        if (c->h2){
+            c->h2->each([this](H2Stream &s){
+                wheel.cancel(&s.timer);
+                s.task = Async<>();
+            });
+        }
+        if (uring){
+            // Stop whatever is still running on it, the close goes in the same submit
+            if (c->recv_armed) cancel(c, OP_RECV);
+            if (c->sending){
+                cancel(c, OP_SEND); // One of these two is in flight, the other finds nothing
+                cancel(c, OP_POLL);
+            }
+            if (!c->close_linked) close_async(c->fd);
+            c->fd = -1;
+            // Completions still coming would land on whoever got it next
+            if (c->inflight){
+                c->recycle_wait = true;
+                return;
+            }
         }
+        else{
+            close(c->fd); // Also removes it from epoll
+            c->fd = -1;
+        }
+        // Events for it may still be in this batch, recycle it after
+        c->next_free = dead;
+        dead = c;
     }
 
-    // Body (POST)
-    size_t body_start = hdr_end + 4; // Skips end characters
-    size_t content_length = 0;
-    for (auto &h : req.headers){
-        // Get content length 
-        if (strcasecmp(h.first.c_str(), "Content-Length") == 0){
-            content_length = (size_t)std::stoul(h.second);
+    // io_uring setup, false to fall back to epoll
+    bool start_uring(){
+        if (!ring.init(URING_ENTRIES) ||
+            !bufs.init(ring, URING_BGID, URING_BUFS, URING_BUF_SIZE, tag(nullptr, OP_PROVIDE))){
+            perror("io_uring unavailable, using epoll");
+            return false;
         }
+        // The whole block slab is fixed buffer 0, responses built in it skip pinning pages per send
+        struct iovec slab = {block_pool.slab(), block_pool.slab_size()};
+        fixed_sends = slab.iov_base && ring.register_buffers(&slab, 1);
+        return true;
     }
-    // Copy bytes that were already received
-    if (data.size() > body_start){
-        req.body = data.substr(body_start);
+
+    static uint64_t tag(Connection *c, UringOp op){
+        return (uint64_t)(uintptr_t)c | op;
     }
-    // Read remaining bytes
-    while (req.body.size() < content_length){
-        ssize_t r = super_read(client_fd, buf, sizeof(buf));
-        if (r <= 0) return false; // Connection closed or error
-        req.body.append(buf, buf + r);
+
+    void run_uring(){
+        arm_accept();
+        arm_wake();
+        while (true){
+            // Submits everything the last pass queued, then sleeps until a completion or a deadline
+            int timeout = resumable ? 0 : wheel.next_timeout(now_ms());
+            count(io_stats.uring_enters);
+            if (ring.wait(timeout) < 0 && errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY){
+                perror("io_uring_enter");
+                return;
+            }
+            ring.reap([this](const struct io_uring_cqe &cqe){ on_completion(cqe); });
+            resume_handlers();
+            expire_deadlines();
+            recycle_dead();
+        }
     }
 
-    return true;
-}
+    void on_completion(const struct io_uring_cqe &cqe){
+        UringOp op = (UringOp)(cqe.user_data & 7);
+        Connection *c = (Connection *)(uintptr_t)(cqe.user_data & ~7ull);
+        if (op == OP_ACCEPT){
+            on_accept(cqe.res);
+            if (!(cqe.flags & IORING_CQE_F_MORE)) arm_accept(); // Multishot stopped, an error ends it
+            return;
+        }
+        if (op == OP_WAKE){
+            finish_responses();
+            arm_wake();
+            return;
+        }
+        if (!c) return; // Buffer hand-backs, cancels and closes, nothing waits on those
+        if (!(cqe.flags & IORING_CQE_F_MORE)) --c->inflight; // Last completion this SQE posts
+        if (op == OP_RECV) on_recv(c, cqe);
+        else if (op == OP_SEND) on_sent(c, cqe);
+        else on_writable(c);
+        // Destroyed earlier, free once the kernel is done with it
+        if (c->recycle_wait && c->inflight == 0){
+            c->recycle_wait = false;
+            c->next_free = dead;
+            dead = c;
+        }
+    }
 
-// HTTP Response
-static void send_response(int client_fd, int code, const std::string &reason,
-                          const std::string &content_type, const std::string &body,
-                          const std::vector<std::pair<std::string, std::string>> &extra_headers = {}) {
-    std::ostringstream oss;
-    oss << "HTTP/1.1 " << code << " " << reason << "\r\n";
-    oss << "Content-Type: " << content_type << "\r\n";
-    oss << "Content-Length: " << body.size() << "\r\n";
-    // For requests with location
-    for (auto &h : extra_headers){
-        oss << h.first << ": " << h.second << "\r\n";
-    }
-    oss << "Connection: close\r\n";
-    oss << "\r\n";
-    oss << body;
-    std::string resp = oss.str();
-    super_write(client_fd, resp.data(), resp.size()); // Write to the socket
-}
-
-// Default HTML page
-static void default_html(int client_fd){
-    const std::string page =
-        "<!doctype html>\n<html><head><meta charset=\"utf-8\"><title>Index</title></head>\n"
-        "<body><h1>Hello from Allison's server :)</h1>\n"
-        "</body></html>\n";
-    send_response(client_fd, 200, "OK", "text/html", page);
-}
-
-// Handles a HTTP request
-static void handle_client(int client_fd){
-    // Get peer info for logging
-    struct sockaddr_in peer_addr;
-    socklen_t peer_len = sizeof(peer_addr);
-    char peerbuf[INET_ADDRSTRLEN] = "?";
-    // Get IP of client
-    if (getpeername(client_fd, (struct sockaddr *)&peer_addr, &peer_len) == 0){
-        inet_ntop(AF_INET, &peer_addr.sin_addr, peerbuf, sizeof(peerbuf));
-        // https://man7.org/linux/man-pages/man3/inet_ntop.3.html
-        // Turning binary IP into readable IP
-    }
-
-    HttpRequest req;
-    // Get method/uri/version, header, and body
-    if (!parse_request(client_fd, req)){
-        // Malformed request
-        std::cerr << "Invalid request from " << peerbuf << "\n";
-        close(client_fd);
-        return;
+    void on_accept(int client_fd){
+        if (client_fd < 0){
+            errno = -client_fd;
+            perror("accept");
+            return;
+        }
+        // Multishot accept has one address buffer for every connection, ask the socket instead
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        if (getpeername(client_fd, (struct sockaddr *)&client_addr, &client_len) < 0){
+            close(client_fd);
+            return;
+        }
+        Connection *c = admit_client(client_fd, client_addr);
+        if (!c) return;
+        arm_recv(c);
+        set_deadline(c, PHASE_HEADER, config.header_timeout_ms);
     }
 
-    // Log and output request
-    std::cout << "[" << peerbuf << "] " << req.method << " " << req.uri << " " << req.version << "\n";
+    void on_recv(Connection *c, const struct io_uring_cqe &cqe){
+        if (!(cqe.flags & IORING_CQE_F_MORE)) c->recv_armed = false;
+        if (cqe.flags & IORING_CQE_F_BUFFER){
+            uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (c->fd >= 0 && cqe.res > 0) take(c, bufs.buffer(bid), cqe.res);
+            bufs.give_back(ring, bid);
+        }
+        if (c->fd < 0) return; // Closed, this is the tail end of it
+        if (cqe.res == 0){
+            c->recv_eof = true; // Client shut down its side
+        }
+        else if (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED){
+            // Socket is dead, wait for the worker if it still has the requests
+            if (c->busy) c->peer_gone = true;
+            else destroy(c);
+            return;
+        }
+        // Multishot stops when the buffers run out or the kernel wants it to, start another
+        if (!c->recv_armed && !c->recv_paused && !c->recv_eof) arm_recv(c);
+        if (c->phase == PHASE_LINGER){
+            if (c->recv_eof || c->lingered > LINGER_MAX) destroy(c);
+            return;
+        }
+        if (!c->busy && !c->sending && !c->task && c->out.done()) read_more(c);
+    }
 
-    // Route handling
-    std::string method = req.method;
-    std::string uri = req.uri;
+    // Bytes recv brought in, kept until read_more wants them
+    void take(Connection *c, const char *data, size_t n){
+        metrics.bytes_in(n);
+        if (c->phase == PHASE_LINGER){
+            c->lingered += n; // Thrown away
+            return;
+        }
+        c->backlog.append(data, n);
+        // Busy or stuck writing and the client keeps sending, stop taking it like a full socket would
+        if (c->backlog.size() - c->backlog_off > URING_BACKLOG_MAX && c->recv_armed && !c->recv_paused){
+            c->recv_paused = true;
+            cancel(c, OP_RECV);
+        }
+    }
 
-    // Separate path and query
-    std::string path = uri;
-    std::string query;
-    size_t qpos = uri.find('?');
-    if (qpos != std::string::npos){
-        path = uri.substr(0, qpos);
-        query = uri.substr(qpos + 1);
+    // io_uring's read, move what recv already brought in into the connection buffer
+    // true once all of it is used, like EAGAIN from read
+    bool use_backlog(Connection *c){
+        size_t avail = c->backlog.size() - c->backlog_off;
+        size_t n = std::min(avail, c->in.cap - c->in.end);
+        if (n > 0){
+            memcpy(c->in.data + c->in.end, c->backlog.data() + c->backlog_off, n);
+            c->in.end += n;
+            c->backlog_off += n;
+        }
+        if (n < avail) return false;
+        c->backlog.clear();
+        c->backlog_off = 0;
+        if (c->recv_paused){
+            c->recv_paused = false; // Caught up, take more
+            if (!c->recv_armed && !c->recv_eof) arm_recv(c);
+        }
+        if (c->recv_eof){
+            c->read_eof = true;
+            return false;
+        }
+        return true;
+    }
+
+    // io_uring's flush, one send in flight at a time and its completion sends the next
+    void send_more(Connection *c, bool progress){
+        if (c->sending) return; // The completion carries on
+        while (!c->out.done()){
+            int file_fd;
+            off_t file_off;
+            size_t file_len;
+            if (c->out.next_file(file_fd, file_off, file_len)){
+                // io_uring has no sendfile, so call it here and wait for room when the socket fills
+                ssize_t w = super_sendfile(c->fd, file_fd, file_off, file_len);
+                if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                    poll_writable(c);
+                    write_blocked(c, progress);
+                    return;
+                }
+                if (w <= 0){
+                    destroy(c); // Socket broke or the file was cut short under us
+                    return;
+                }
+                metrics.bytes_out(w);
+                c->out.advance(w);
+                progress = true;
+                continue;
+            }
+            if (submit_send(c)) write_blocked(c, progress);
+            return;
+        }
+        flushed(c);
     }
 
-    // Implement request functions
-    // Return default page
-    if ((path == "/" || path == "/index.html")){
-        if(method == "GET"){
-            default_html(client_fd);
+    // One SQE for the front of out, false if the connection had to be closed
+    bool submit_send(Connection *c){
+        struct iovec iov[URING_IOVECS];
+        bool zerocopy;
+        int cnt = c->out.fill(iov, URING_IOVECS, zerocopy);
+        size_t len = 0;
+        for (int i = 0; i < cnt; ++i) len += iov[i].iov_len;
+        struct msghdr *msg = nullptr;
+        if (cnt > 1){
+            // SENDMSG reads these at submit, the arena keeps them until the responses are done
+            msg = (struct msghdr *)c->arena.alloc(sizeof(struct msghdr) + cnt * sizeof(struct iovec));
+            if (!msg){
+                destroy(c);
+                return false;
+            }
+            struct iovec *copy = (struct iovec *)(msg + 1);
+            memcpy(copy, iov, cnt * sizeof(struct iovec));
+            memset(msg, 0, sizeof(*msg));
+            msg->msg_iov = copy;
+            msg->msg_iovlen = cnt;
+        }
+        // Connection: close and this is the rest of it, the close rides right behind the send
+        // Not while a handler waits on it, more is coming
+        // Nor on HTTP/2, whether it closes is only known once the streams are looked at
+        bool link = c->close_after && !c->linger && !c->task && !c->h2 && !zerocopy && len == c->out.remaining();
+        ring.make_room(link ? 2 : 1);
+        struct io_uring_sqe *e = ring.sqe();
+        e->fd = c->fd;
+        e->user_data = tag(c, OP_SEND);
+        if (msg){
+            e->opcode = IORING_OP_SENDMSG;
+            e->addr = (uint64_t)(uintptr_t)msg;
+            e->len = 1;
+            e->msg_flags = link ? MSG_WAITALL : 0;
+        }
+        else if (zerocopy){
+            // Static body, the kernel sends the pages themselves and says when it's done with them
+            e->opcode = IORING_OP_SEND_ZC;
+            e->addr = (uint64_t)(uintptr_t)iov[0].iov_base;
+            e->len = len;
+            e->ioprio = IORING_SEND_ZC_REPORT_USAGE;
+            count(io_stats.zerocopy_sends);
+        }
+        else if (fixed_sends && block_pool.in_slab(iov[0].iov_base, len)){
+            // Built in registered memory, nothing to look up or pin for this one
+            // A short write breaks the link by itself
+            e->opcode = IORING_OP_WRITE_FIXED;
+            e->addr = (uint64_t)(uintptr_t)iov[0].iov_base;
+            e->len = len;
+            e->buf_index = 0;
+            count(io_stats.uring_fixed_sends);
         }
         else{
-            send_response(client_fd, 405, "Method Not Allowed", "text/plain", "Method Not Allowed");
+            e->opcode = IORING_OP_SEND;
+            e->addr = (uint64_t)(uintptr_t)iov[0].iov_base;
+            e->len = len;
+            e->msg_flags = link ? MSG_WAITALL : 0;
         }
+        ++c->inflight;
+        c->sending = true;
+        if (link){
+            e->flags |= IOSQE_IO_LINK;
+            close_async(c->fd);
+            c->close_linked = true;
+        }
+        return true;
     }
-    // GET /google
-    else if (path == "/google"){
-        if(method == "GET"){
-            // 301 Redirect
-            std::vector<std::pair<std::string, std::string>> extra;
-            extra.emplace_back("Location", "https://google.com");
-            send_response(client_fd, 301, "Moved Permanently", "text/plain", "Moved Permanently", extra);
+
+    void on_sent(Connection *c, const struct io_uring_cqe &cqe){
+        if (cqe.flags & IORING_CQE_F_NOTIF){
+            // SEND_ZC's second completion, the kernel is done with the pages
+            count(io_stats.zerocopy_done);
+            if (cqe.res & IORING_NOTIF_USAGE_ZC_COPIED) count(io_stats.zerocopy_copied);
+            return;
         }
-        else{
-            send_response(client_fd, 405, "Method Not Allowed", "text/plain", "Method Not Allowed");
+        c->sending = false;
+        if (c->fd < 0) return;
+        if (cqe.res <= 0){
+            c->close_linked = false; // Cancelled along with it
+            destroy(c);
+            return;
         }
+        count(io_stats.uring_sends);
+        metrics.bytes_out(cqe.res);
+        c->out.advance(cqe.res);
+        if (c->close_linked && !c->out.done()) c->close_linked = false; // Short, the close was cancelled
+        send_more(c, true);
+    }
+
+    void on_writable(Connection *c){
+        c->sending = false;
+        if (c->fd >= 0) send_more(c, false);
+    }
+
+    void arm_accept(){
+        struct io_uring_sqe *e = ring.sqe();
+        e->opcode = IORING_OP_ACCEPT;
+        e->fd = listen_fd;
+        e->ioprio = IORING_ACCEPT_MULTISHOT;
+        e->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        e->user_data = tag(nullptr, OP_ACCEPT);
+    }
+
+    void arm_wake(){
+        struct io_uring_sqe *e = ring.sqe();
+        e->opcode = IORING_OP_READ;
+        e->fd = wake_fd;
+        e->addr = (uint64_t)(uintptr_t)&wake_count;
+        e->len = sizeof(wake_count);
+        e->user_data = tag(nullptr, OP_WAKE);
     }
-    // DELETE /database.php?data=all
-    else if (path == "/database.php" && method == "DELETE"){
-        send_response(client_fd, 403, "Forbidden", "text/plain", "Forbidden");
+
+    // Multishot, one completion per chunk received into a provided buffer
+    void arm_recv(Connection *c){
+        struct io_uring_sqe *e = ring.sqe();
+        e->opcode = IORING_OP_RECV;
+        e->fd = c->fd;
+        e->ioprio = IORING_RECV_MULTISHOT;
+        e->flags = IOSQE_BUFFER_SELECT;
+        e->buf_group = bufs.id();
+        e->user_data = tag(c, OP_RECV);
+        c->recv_armed = true;
+        ++c->inflight;
+    }
+
+    void poll_writable(Connection *c){
+        struct io_uring_sqe *e = ring.sqe();
+        e->opcode = IORING_OP_POLL_ADD;
+        e->fd = c->fd;
+        e->poll32_events = POLLOUT;
+        e->user_data = tag(c, OP_POLL);
+        ++c->inflight;
+        c->sending = true;
+    }
+
+    void cancel(Connection *c, UringOp op){
+        struct io_uring_sqe *e = ring.sqe();
+        e->opcode = IORING_OP_ASYNC_CANCEL;
+        e->addr = tag(c, op);
+        e->flags = IOSQE_CQE_SKIP_SUCCESS;
+        e->user_data = tag(nullptr, OP_CANCEL);
     }
-    //non-DELETE database.php
-    else if(path == "/database.php"){
-        send_response(client_fd, 405, "Method Not Allowed", "text/plain", "Method Not Allowed");
+
+    void close_async(int fd){
+        struct io_uring_sqe *e = ring.sqe();
+        e->opcode = IORING_OP_CLOSE;
+        e->fd = fd;
+        e->flags = IOSQE_CQE_SKIP_SUCCESS;
+        e->user_data = tag(nullptr, OP_CLOSE);
     }
-    // POST /multiply
-    else if (path == "/multiply"){
-        if (method != "POST"){
-            send_response(client_fd, 405, "Method Not Allowed", "text/plain", "Method Not Allowed");
+
+    // Reuse a closed connection if there is one
+    Connection *new_connection(){
+        if (!free_conns){
+            return new Connection();
         }
-        else{
-            // Form-encoded body a=INT&b=INT
-            std::string a_str, b_str;
-            bool ok_a = parse_POST(req.body, "a", a_str);
-            bool ok_b = parse_POST(req.body, "b", b_str);
-            if (!ok_a || !ok_b){
-                send_response(client_fd, 400, "Bad Request", "text/plain", "Bad Request: expected a=INT&b=INT");
+        Connection *c = free_conns;
+        free_conns = c->next_free;
+        --free_count;
+        return c;
+    }
+
+    // Connections closed during the last batch go back on the free list
+    void recycle_dead(){
+        while (dead){
+            Connection *c = dead;
+            dead = c->next_free;
+            c->reset();
+            if (free_count < MAX_POOLED_CONNS){
+                c->next_free = free_conns;
+                free_conns = c;
+                ++free_count;
             }
             else{
-                // Validate integers
-                std::regex int_re("^[+-]?[0-9]+$");
-                if (!std::regex_match(a_str, int_re) || !std::regex_match(b_str, int_re)) {
-                    send_response(client_fd, 400, "Bad Request", "text/plain", "Bad Request: a and b must be integers");
-                } else {
-                    // Compute product
-                    long long a = atoll(a_str.c_str());
-                    long long b = atoll(b_str.c_str());
-                    long long prod = a * b;
-                    std::ostringstream body;
-                    body << prod << "\n";
-                    send_response(client_fd, 200, "OK", "text/plain", body.str());
-                }
+                delete c;
             }
         }
     }
-    else{
-        // Unknown 404
-        send_response(client_fd, 404, "Not Found", "text/plain", "Not Found");
-    }
 
-    close(client_fd);
-}
+    int listen_fd;
+    int epoll_fd = -1;
+    int wake_fd;
+    bool uring = false; // io_uring engine, otherwise epoll
+    Uring ring;
+    BufferGroup bufs; // Recv buffers the kernel picks from
+    bool fixed_sends = false; // Block slab registered as fixed buffer 0
+    uint64_t wake_count = 0; // Where the wake_fd READ lands
+    Connection *resumable = nullptr; // Handlers to resume after this pass
+    Connection *resuming = nullptr; // The ones being resumed now
+    ThreadPool *pool; // Null when handling inline
+    std::mutex done_mutex; // Protect done
+    std::vector<Connection *> done; // Filled by workers
+    std::vector<Connection *> ready; // Swapped out of done by the loop
+    TimerWheel wheel{now_ms()}; // Every connection deadline this loop has
+    Connection *dead = nullptr; // Closed this batch
+    Connection *free_conns = nullptr; // Ready for reuse
+    size_t free_count = 0;
+};
 
-// Entry point
-int main() {
+// Make the listening socket
+// reuseport lets every per-core loop bind its own socket on PORT
+static int make_listener(bool reuseport){
     // Create listening socket
-    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (listen_fd < 0) {
         perror("Socket couldn't listen");
-        return 1;
+        return -1;
     }
 
     // Refresh rate of socket
@@ -419,6 +2657,13 @@ int main() {
         // https://linuxjournal.rubdos.be/ljarchive/LJ/298/12538.html
         // Let socket be reopened without waiting
     }
+    // Kernel spreads new connections across all sockets bound with SO_REUSEPORT
+    // https://lwn.net/Articles/542629/
+    if (reuseport && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("Failure setting reuseport");
+        close(listen_fd);
+        return -1;
+    }
 
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
@@ -430,39 +2675,240 @@ int main() {
     if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         perror("Failed to bind");
         close(listen_fd);
-        return 1;
+        return -1;
     }
 
     // Listen to port open
     if (listen(listen_fd, SOMAXCONN) < 0) {
         perror("Failed to listen");
         close(listen_fd);
-        return 1;
+        return -1;
+    }
+    return listen_fd;
+}
+
+// Keep the calling thread on one CPU
+static void pin_to_core(unsigned int core){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0){
+        std::cerr << "Couldn't pin to core " << core << ": " << strerror(rc) << "\n";
     }
+}
 
+// One loop per core, each with its own listener, nothing shared between them
+static int run_per_core(unsigned int loops){
     unsigned int hw = std::thread::hardware_concurrency(); // Number of CPU cores on the machine running
-    size_t threads = (hw == 0) ? 8 : std::max<unsigned int>(4, hw * 2); // Use number of CPUs to calc number of worker threads
-    std::cout << "Starting server on port " << PORT << " with " << threads << " worker threads\n";
+    if (hw == 0) hw = 1;
+    std::cout << "Starting server on port " << PORT << " with " << loops << " per-core event loops" << std::endl;
 
-    ThreadPool pool(threads); // Starts worker threads
+    // Bind every listener up front so a failure is reported before serving
+    std::vector<int> listeners;
+    for (unsigned int i = 0; i < loops; ++i){
+        int fd = make_listener(true);
+        if (fd < 0){
+            for (int l : listeners) close(l);
+            return 1;
+        }
+        listeners.push_back(fd);
+    }
 
-    while (true) {
-        struct sockaddr_in client_addr; // Client
-        socklen_t client_len = sizeof(client_addr);
-        int client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &client_len); // Accept clients 
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < loops; ++i){
+        int fd = listeners[i];
+        threads.emplace_back([i, hw, fd]() {
+            pin_to_core(i % hw);
+            EventLoop loop(fd, nullptr); // Accept, parse and respond all on this core
+            loop.run();
+        });
+    }
+    for (auto &t : threads) t.join();
+    for (int l : listeners) close(l);
+    return 0;
+}
 
-        // If call interupted 
-        if (client_fd < 0) {
-            if (errno == EINTR) continue;
-            perror("accept");
-            break;
+static void usage(const char *prog){
+    std::cerr << "Usage: " << prog << " [-r LOOPS] [-k SECONDS] [-m REQUESTS] [-d] [-s] [-D] [-z BYTES] [-w DIR]\n"
+              << "       [-g LEVEL] [-G BYTES] [-H SECONDS] [-B SECONDS] [-W SECONDS]\n"
+              << "       [-L BYTES] [-N COUNT] [-S BYTES] [-b BYTES] [-U BYTES]\n"
+              << "       [-c CONNS] [-i CONNS] [-q DEPTH] [-C MS] [-R] [-a FILE] [-A N] [-e ENGINE]\n"
+              << "       [-M BYTES] [-T SECONDS] [-2 STREAMS]\n"
+              << "  -r LOOPS     run LOOPS per-core event loops with SO_REUSEPORT listeners\n"
+              << "               (0 = one loop plus worker threads, the default; -1 = one per core)\n"
+              << "  -k SECONDS   keep-alive idle timeout, 0 turns keep-alive off (default 5)\n"
+              << "  -m REQUESTS  max requests per connection, 0 is unlimited (default 100)\n"
+              << "  -d           send a Date header\n"
+              << "  -s           serve allocator counters on GET /stats\n"
+              << "  -D           serve GET /sleep?ms=N for testing, answers after N ms (at most 5000)\n"
+              << "  -z BYTES     send static bodies this big with MSG_ZEROCOPY, 0 turns it off (default 65536)\n"
+              << "  -w DIR       serve static files from DIR for paths that aren't routes\n"
+              << "  -g LEVEL     gzip/deflate level 1-9, 0 turns compression off (default 6)\n"
+              << "  -G BYTES     smallest body worth compressing (default 128)\n"
+              << "  -H SECONDS   time allowed for a request line and headers (default 10)\n"
+              << "  -B SECONDS   longest gap between reads of a request body (default 30)\n"
+              << "  -W SECONDS   longest a client can leave a response unread (default 30)\n"
+              << "  -L BYTES     longest request line, 414 past it (default 8192)\n"
+              << "  -N COUNT     most headers in a request, 431 past it (default and max " << MAX_HEADERS << ")\n"
+              << "  -S BYTES     most bytes of request line plus headers, 431 past it (default " << MAX_HEADER_BYTES << ")\n"
+              << "  -b BYTES     biggest request body kept in memory, 413 past it (default 1048576)\n"
+              << "  -U BYTES     biggest request body streamed to a route, 413 past it (default 1073741824)\n"
+              << "  -c CONNS     most open connections, more get a 503, 0 is unlimited (default 10000)\n"
+              << "  -i CONNS     most open connections from one address, 0 is unlimited (default 0)\n"
+              << "  -q DEPTH     most request batches waiting for a worker, 0 is unlimited (default 1024)\n"
+              << "  -C MS        CoDel target, shed once queue waits stay over it for 100ms, 0 is off (default 5)\n"
+              << "  -R           turn away connections over a cap with a reset instead of a 503\n"
+              << "  -a FILE      access log, - for stdout (default -)\n"
+              << "  -A N         log one request in N, 0 turns the access log off (default 1)\n"
+              << "  -e ENGINE    epoll or uring, what the event loops wait on (default epoll)\n"
+              << "  -M BYTES     memo cache for pure routes like /multiply, 0 turns it off (default 16777216)\n"
+              << "  -T SECONDS   how long a memoized response is good for (default 60)\n"
+              << "  -2 STREAMS   concurrent streams per HTTP/2 (h2c) connection, 0 turns HTTP/2 off (default 100)\n";
+}
+
+// Entry point
+int main(int argc, char *argv[]) {
+    // Writing to a client that already left shouldn't kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Command line options
+    int loops = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:k:m:dsDz:w:g:G:H:B:W:L:N:S:b:U:c:i:q:C:Ra:A:e:M:T:2:h")) != -1){
+        if (opt == 'r'){
+            loops = atoi(optarg);
+        }
+        else if (opt == 'k'){
+            config.idle_timeout_ms = std::max(0, (int)(atof(optarg) * 1000));
+        }
+        else if (opt == 'm'){
+            config.max_requests = (unsigned)std::max(0, atoi(optarg));
+        }
+        else if (opt == 'd'){
+            response_config.send_date = true;
+        }
+        else if (opt == 's'){
+            config.stats = true;
+        }
+        else if (opt == 'D'){
+            config.debug_sleep = true;
+        }
+        else if (opt == 'z'){
+            response_config.zerocopy_min = (size_t)std::max(0L, atol(optarg));
+        }
+        else if (opt == 'w'){
+            config.docroot = optarg;
+        }
+        else if (opt == 'g'){
+            response_config.gzip_level = std::min(9, std::max(0, atoi(optarg)));
+        }
+        else if (opt == 'G'){
+            response_config.gzip_min = (size_t)std::max(0L, atol(optarg));
+        }
+        else if (opt == 'H'){
+            config.header_timeout_ms = std::max(1, (int)(atof(optarg) * 1000));
+        }
+        else if (opt == 'B'){
+            config.body_timeout_ms = std::max(1, (int)(atof(optarg) * 1000));
+        }
+        else if (opt == 'W'){
+            config.write_timeout_ms = std::max(1, (int)(atof(optarg) * 1000));
+        }
+        else if (opt == 'L'){
+            config.limits.request_line = (size_t)std::max(16L, atol(optarg));
+        }
+        else if (opt == 'N'){
+            config.limits.header_count = (size_t)std::min((long)MAX_HEADERS, std::max(0L, atol(optarg)));
+        }
+        else if (opt == 'S'){
+            config.limits.header_bytes = (size_t)std::max(16L, atol(optarg));
+        }
+        else if (opt == 'b'){
+            config.limits.body = (size_t)std::max(0L, atol(optarg));
+        }
+        else if (opt == 'U'){
+            config.limits.stream_body = (size_t)std::max(0L, atol(optarg));
         }
+        else if (opt == 'c'){
+            config.max_connections = (size_t)std::max(0L, atol(optarg));
+        }
+        else if (opt == 'i'){
+            config.max_per_ip = (size_t)std::max(0L, atol(optarg));
+        }
+        else if (opt == 'q'){
+            config.max_queue = (size_t)std::max(0L, atol(optarg));
+        }
+        else if (opt == 'C'){
+            config.codel_target_ms = std::max(0, atoi(optarg));
+        }
+        else if (opt == 'R'){
+            config.shed_reset = true;
+        }
+        else if (opt == 'a'){
+            config.access_log = optarg;
+        }
+        else if (opt == 'A'){
+            config.log_sample = (unsigned)std::max(0, atoi(optarg));
+        }
+        else if (opt == 'e' && (strcmp(optarg, "epoll") == 0 || strcmp(optarg, "uring") == 0)){
+            config.uring = strcmp(optarg, "uring") == 0;
+        }
+        else if (opt == 'M'){
+            config.memo_bytes = (size_t)std::max(0L, atol(optarg));
+        }
+        else if (opt == 'T'){
+            config.memo_ttl_ms = std::max(1, (int)(atof(optarg) * 1000));
+        }
+        else if (opt == '2'){
+            config.h2_streams = (size_t)std::max(0L, atol(optarg));
+        }
+        else{
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    // Blocks io_uring can register for fixed sends, mapped before any loop starts
+    if (config.uring && !block_pool.reserve(URING_SLAB_BLOCKS)){
+        perror("block slab");
+    }
+    file_cache.set_compression(response_config.gzip_level, response_config.gzip_min);
+    admission.set_limits(config.max_connections, config.max_per_ip);
+    memo_cache.configure(config.memo_bytes, config.memo_ttl_ms);
+    if (config.log_sample && !access_log.open(config.access_log, config.log_sample)){
+        perror(config.access_log.c_str());
+        return 1;
+    }
+    if (!config.docroot.empty() && !file_cache.open(config.docroot)){
+        perror(config.docroot.c_str());
+        return 1;
+    }
+
+    // Serialize the fixed responses once, options have to be known first
+    responses.build();
+    register_routes();
+
+    unsigned int hw = std::thread::hardware_concurrency(); // Number of CPU cores on the machine running
+    if (loops != 0){
+        return run_per_core(loops < 0 ? std::max(1u, hw) : (unsigned int)loops);
+    }
 
-        // For each accepted connection, enqueue a job to handle it
-        pool.enqueue([client_fd]() { handle_client(client_fd); });
+    int listen_fd = make_listener(false);
+    if (listen_fd < 0) {
+        return 1;
     }
 
+    size_t threads = (hw == 0) ? 8 : std::max<unsigned int>(4, hw * 2); // Use number of CPUs to calc number of worker threads
+    std::cout << "Starting server on port " << PORT << " with " << threads << " worker threads" << std::endl; // Log lines skip cout's buffer
+
+    ThreadPool pool(threads); // Starts worker threads
+    worker_pool = &pool;
+
+    // Event loop accepts and reads, workers only see full requests
+    EventLoop loop(listen_fd, &pool);
+    loop.run();
+
     close(listen_fd);
     return 0;
 }
-
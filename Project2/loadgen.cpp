@@ -0,0 +1,876 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Load generator for the server, wrk style
+// Closed loop (default) keeps every connection busy. Open loop (-R) sends at a fixed rate and
+// times each request from when it should have gone out, so a server that stalls can't hide
+// the requests that queued up behind the stall (coordinated omission).
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#define LAT_SUB_BITS 7 // 128 buckets per power of two, values within 1%
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (40 * LAT_SUB) // Up to 2^41ns
+#define MAX_PIPELINE 64
+#define READ_CHUNK 65536
+#define STATUS_MAX 600
+#define RETRY_CONNECT_MS 100 // Wait before reconnecting after connect failed
+#define BAD_PAUSE_MS 250 // Between a misbehaving client's attempts
+#define TRICKLE_MS 250 // Random byte every this long, autograder test 6
+#define SLOW_MS 100 // Valid request one byte every this long, same
+#define SLOW_WAIT_MS 3000 // How long the slow client waits for its answer
+#define SPAM_MAX (100u * 1000 * 1000) // Bytes a spammer sends before giving up
+
+typedef uint64_t ns_t;
+
+static ns_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ns_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    int connections = 64;
+    int threads = 2;
+    double duration = 10; // Seconds
+    double rate = 0; // Requests per second over all connections, 0 for closed loop
+    int pipeline = 1; // Requests in flight per connection
+    bool close_each = false; // New connection per request
+    double timeout = 5; // Seconds before an unanswered request counts as timed out
+    double hold = 10; // Seconds a silent client keeps its connection
+    std::string scenario;
+};
+static Options opt;
+
+// One request a scenario sends
+struct Request {
+    std::string name; // METHOD PATH, for the report
+    std::string wire[2]; // Serialized, keep-alive and Connection: close
+    int expect; // Status it should get
+    unsigned weight;
+};
+
+// Clients that misbehave the way autograder test 6 does, kept open alongside the load
+enum BadKind {
+    BAD_SILENT, // Connects and sends nothing for opt.hold seconds
+    BAD_TRICKLE, // Random bytes one at a time
+    BAD_SLOW, // Valid request one byte at a time, should still get a 200
+    BAD_GARBAGE, // Malformed request
+    BAD_SPAM, // Random bytes as fast as the server takes them
+    BAD_COUNT
+};
+static const char *bad_names[BAD_COUNT] = {"silent", "trickle", "slow", "garbage", "spam"};
+
+struct Scenario {
+    std::vector<Request> reqs;
+    std::vector<unsigned> cumulative; // Running weight total, for picking
+    unsigned bad[BAD_COUNT] = {}; // How many of each to keep open
+};
+static Scenario scenario;
+
+static std::string serialize(const std::string &method, const std::string &path, const std::string &body, bool close){
+    std::string s = method + " " + path + " HTTP/1.1\r\nHost: " + opt.host + "\r\n";
+    if (!body.empty() || method == "POST" || method == "PUT"){
+        s += "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: " + std::to_string(body.size()) + "\r\n";
+    }
+    if (close) s += "Connection: close\r\n";
+    s += "\r\n";
+    s += body;
+    return s;
+}
+
+static void add_request(const std::string &method, const std::string &path, int expect, unsigned weight,
+                        const std::string &body){
+    Request r;
+    r.name = method + " " + path;
+    r.wire[0] = serialize(method, path, body, false);
+    r.wire[1] = serialize(method, path, body, true);
+    r.expect = expect;
+    r.weight = weight;
+    scenario.reqs.push_back(r);
+}
+
+// Scenario file, one directive per line, # starts a comment
+//   req WEIGHT METHOD PATH STATUS [BODY]   send this, picked by weight, expect STATUS back
+//   bad COUNT KIND                         keep COUNT misbehaving clients of KIND open
+static bool load_scenario(const std::string &path){
+    std::ifstream in(path);
+    if (!in){
+        perror(path.c_str());
+        return false;
+    }
+    std::string line;
+    int lineno = 0;
+    while (std::getline(in, line)){
+        ++lineno;
+        size_t hash = line.find('#');
+        if (hash != std::string::npos) line.resize(hash);
+        std::istringstream ss(line);
+        std::string kind;
+        if (!(ss >> kind)) continue;
+        bool ok = false;
+        if (kind == "req"){
+            unsigned weight;
+            std::string method, target, body;
+            int expect;
+            ok = (ss >> weight >> method >> target >> expect) && weight > 0;
+            ss >> body;
+            if (ok) add_request(method, target, expect, weight, body);
+        }
+        else if (kind == "bad"){
+            unsigned count;
+            std::string name;
+            if (ss >> count >> name){
+                for (int k = 0; k < BAD_COUNT; ++k){
+                    if (name == bad_names[k]){
+                        scenario.bad[k] += count;
+                        ok = true;
+                    }
+                }
+            }
+        }
+        if (!ok){
+            fprintf(stderr, "%s:%d: can't read \"%s\"\n", path.c_str(), lineno, line.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+static void build_scenario(){
+    if (scenario.reqs.empty()) add_request("GET", "/", 200, 1, "");
+    unsigned total = 0;
+    for (auto &r : scenario.reqs){
+        total += r.weight;
+        scenario.cumulative.push_back(total);
+    }
+}
+
+// Log-linear latency histogram, same layout as the server's but finer
+// 128 buckets per power of two keeps every percentile within 1%
+struct LatencyHist {
+    std::vector<uint64_t> buckets = std::vector<uint64_t>(LAT_BUCKETS);
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    ns_t max = 0;
+
+    static size_t index(ns_t ns){
+        if (ns < LAT_SUB) return ns;
+        int msb = 63 - __builtin_clzll(ns);
+        size_t i = (size_t)(msb - LAT_SUB_BITS + 1) * LAT_SUB + (ns >> (msb - LAT_SUB_BITS)) - LAT_SUB;
+        return i < LAT_BUCKETS ? i : LAT_BUCKETS - 1;
+    }
+
+    // Largest value that lands in bucket i
+    static ns_t upper(size_t i){
+        if (i < LAT_SUB) return i;
+        size_t oct = i / LAT_SUB;
+        size_t sub = i % LAT_SUB;
+        return ((ns_t)(LAT_SUB + sub + 1) << (oct - 1)) - 1;
+    }
+
+    void record(ns_t ns, uint64_t n = 1){
+        buckets[index(ns)] += n;
+        total += n;
+        sum += ns * n;
+        max = std::max(max, ns);
+    }
+
+    void merge(const LatencyHist &o){
+        for (size_t i = 0; i < LAT_BUCKETS; ++i) buckets[i] += o.buckets[i];
+        total += o.total;
+        sum += o.sum;
+        max = std::max(max, o.max);
+    }
+
+    ns_t percentile(double p) const {
+        if (total == 0) return 0;
+        uint64_t want = (uint64_t)(p / 100 * total);
+        if (want >= total) want = total - 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < LAT_BUCKETS; ++i){
+            seen += buckets[i];
+            if (seen > want) return std::min(upper(i), max);
+        }
+        return max;
+    }
+
+    // Closed loop only sends when the last answer came back, so a stall of S only shows up
+    // as one slow sample instead of the S/interval requests that would have been sent meanwhile.
+    // Put those back the way HdrHistogram does: a value v also counts as v - interval,
+    // v - 2*interval, ... down to interval.
+    LatencyHist corrected(ns_t interval) const {
+        LatencyHist c = *this;
+        if (interval == 0) return c;
+        for (size_t i = 0; i < LAT_BUCKETS; ++i){
+            if (!buckets[i]) continue;
+            ns_t v = std::min(upper(i), max);
+            for (ns_t missed = v - std::min(v, interval); missed >= interval; missed -= interval){
+                c.record(missed, buckets[i]);
+            }
+        }
+        c.max = max;
+        return c;
+    }
+};
+
+// Everything one thread counts, summed at the end
+struct Stats {
+    uint64_t requests = 0; // Answered
+    uint64_t bytes = 0; // Response bytes read
+    uint64_t connects = 0;
+    uint64_t err_connect = 0;
+    uint64_t err_read = 0; // Closed or reset with requests in flight
+    uint64_t err_timeout = 0;
+    uint64_t err_status = 0; // Answered, but not with the status the scenario expects
+    uint64_t err_parse = 0; // Answer didn't look like HTTP
+    uint64_t status[STATUS_MAX] = {};
+    uint64_t bad_conns[BAD_COUNT] = {}; // Connections made
+    uint64_t bad_cut[BAD_COUNT] = {}; // Closed by the server
+    uint64_t slow_ok = 0; // Slow clients answered with a 200
+    uint64_t slow_fail = 0;
+    LatencyHist hist;
+    LatencyHist lag; // Open loop, how far behind schedule requests went out
+
+    void merge(const Stats &o){
+        requests += o.requests;
+        bytes += o.bytes;
+        connects += o.connects;
+        err_connect += o.err_connect;
+        err_read += o.err_read;
+        err_timeout += o.err_timeout;
+        err_status += o.err_status;
+        err_parse += o.err_parse;
+        for (int i = 0; i < STATUS_MAX; ++i) status[i] += o.status[i];
+        for (int k = 0; k < BAD_COUNT; ++k){
+            bad_conns[k] += o.bad_conns[k];
+            bad_cut[k] += o.bad_cut[k];
+        }
+        slow_ok += o.slow_ok;
+        slow_fail += o.slow_fail;
+        hist.merge(o.hist);
+        lag.merge(o.lag);
+    }
+};
+
+// A request written and not answered yet
+struct Sent {
+    const Request *req;
+    ns_t intended; // When it should have gone out, open loop times from here
+    ns_t sent_at;
+};
+
+// Load connection, requests are answered in order so in-flight is a FIFO
+struct Conn {
+    int fd = -1;
+    bool connected = false;
+    Sent fifo[MAX_PIPELINE];
+    size_t head = 0;
+    size_t count = 0;
+    std::string out; // Not written yet
+    size_t out_off = 0;
+    std::string in; // Read and not parsed yet
+    ns_t next_send = 0; // Open loop, when the next request is due
+    ns_t retry_at = 0; // Connect failed, try again then
+    bool closing = false; // Sent Connection: close, nothing more goes on this one
+};
+
+// Misbehaving client
+struct BadConn {
+    BadKind kind;
+    int fd = -1;
+    bool connected = false;
+    ns_t next_at = 0; // Next thing it does
+    ns_t started = 0;
+    size_t sent = 0;
+    std::string in;
+};
+
+static const char slow_request[] = "GET / HTTP/1.1\r\nContent-Length: 0\r\n\r\n";
+static const char garbage_request[] = "GET / HTTP/0.9\r\nContent-Length: 0\n\n\r";
+
+static struct sockaddr_in server_addr;
+
+// One thread's share of the connections on its own epoll
+class Worker {
+public:
+    Worker(int conns, double rate, const unsigned *bad, unsigned seed) : rng(seed | 1){
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        this->conns.resize(conns);
+        if (rate > 0 && conns > 0) interval = (ns_t)(1e9 * conns / rate);
+        for (int k = 0; k < BAD_COUNT; ++k){
+            for (unsigned i = 0; i < bad[k]; ++i){
+                BadConn b;
+                b.kind = (BadKind)k;
+                bads.push_back(b);
+            }
+        }
+    }
+
+    ~Worker(){
+        for (auto &c : conns) if (c.fd >= 0) close(c.fd);
+        for (auto &b : bads) if (b.fd >= 0) close(b.fd);
+        close(epoll_fd);
+    }
+
+    void run(ns_t start, ns_t end){
+        ns_t now = now_ns();
+        for (size_t i = 0; i < conns.size(); ++i){
+            // Spread open loop connections over one interval so they don't all fire together
+            conns[i].next_send = start + (interval ? interval * i / conns.size() : 0);
+            connect_load(conns[i], now);
+        }
+        for (auto &b : bads) b.next_at = start;
+        ns_t next_scan = now;
+        struct epoll_event events[256];
+        while ((now = now_ns()) < end){
+            if (now >= next_scan){
+                scan(now);
+                next_scan = now + 10000000; // Every 10ms
+            }
+            ns_t wake = std::min(end, next_scan);
+            if (interval){
+                for (auto &c : conns){
+                    if (c.connected && c.count < depth()) wake = std::min(wake, c.next_send);
+                }
+            }
+            int timeout = wake > now ? (int)((wake - now) / 1000000) : 0;
+            int n = epoll_wait(epoll_fd, events, 256, timeout);
+            now = now_ns();
+            for (int i = 0; i < n; ++i){
+                uintptr_t tag = (uintptr_t)events[i].data.u64;
+                if (tag & 1) on_bad(bads[tag >> 1], events[i].events, now);
+                else on_load(conns[tag >> 1], events[i].events, now);
+            }
+            if (interval){
+                for (auto &c : conns) if (c.connected) fill(c, now);
+            }
+        }
+    }
+
+    Stats stats;
+
+private:
+    size_t depth() const { return opt.close_each ? 1 : (size_t)opt.pipeline; }
+
+    uint64_t random(){
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        return rng;
+    }
+
+    const Request &pick(){
+        unsigned w = random() % scenario.cumulative.back();
+        size_t i = std::upper_bound(scenario.cumulative.begin(), scenario.cumulative.end(), w) - scenario.cumulative.begin();
+        return scenario.reqs[i];
+    }
+
+    // Non-blocking connect, EPOLLOUT says when it's done
+    int open_socket(uint64_t tag){
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS){
+            close(fd);
+            return -1;
+        }
+        struct epoll_event e;
+        memset(&e, 0, sizeof(e));
+        e.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        e.data.u64 = tag;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &e);
+        return fd;
+    }
+
+    void connect_load(Conn &c, ns_t now){
+        c.fd = open_socket((uint64_t)(&c - conns.data()) << 1);
+        c.connected = false;
+        c.closing = false;
+        c.in.clear();
+        c.out.clear();
+        c.out_off = 0;
+        if (c.fd < 0){
+            ++stats.err_connect;
+            c.retry_at = now + RETRY_CONNECT_MS * 1000000ull;
+            return;
+        }
+        c.retry_at = 0;
+        ++stats.connects;
+    }
+
+    // Close and start over, unanswered requests are sent again on the new connection
+    void reconnect(Conn &c, ns_t now){
+        close(c.fd);
+        c.fd = -1;
+        connect_load(c, now);
+    }
+
+    void on_load(Conn &c, uint32_t ev, ns_t now){
+        if (c.fd < 0) return;
+        if (!c.connected){
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err || (ev & (EPOLLERR | EPOLLHUP))){
+                ++stats.err_connect;
+                close(c.fd);
+                c.fd = -1;
+                c.retry_at = now + RETRY_CONNECT_MS * 1000000ull;
+                return;
+            }
+            if (!(ev & EPOLLOUT)) return;
+            c.connected = true;
+            // Whatever was in flight when the last one closed goes again
+            for (size_t k = 0; k < c.count; ++k){
+                Sent &s = c.fifo[(c.head + k) % MAX_PIPELINE];
+                s.sent_at = now;
+                c.out += s.req->wire[opt.close_each];
+                if (opt.close_each) c.closing = true;
+            }
+            fill(c, now);
+            return;
+        }
+        if (ev & EPOLLOUT) write_out(c);
+        if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) read_in(c, now);
+    }
+
+    // Top up to the pipeline depth, closed loop right away, open loop when each one is due
+    void fill(Conn &c, ns_t now){
+        if (c.fd < 0 || !c.connected) return;
+        while (c.count < depth() && !c.closing){
+            ns_t intended = now;
+            if (interval){
+                if (c.next_send > now) break;
+                intended = c.next_send;
+                c.next_send += interval;
+                stats.lag.record(now - intended);
+            }
+            const Request &r = pick();
+            c.out += r.wire[opt.close_each];
+            c.fifo[(c.head + c.count) % MAX_PIPELINE] = {&r, intended, now};
+            ++c.count;
+            if (opt.close_each) c.closing = true;
+        }
+        write_out(c);
+    }
+
+    void write_out(Conn &c){
+        while (c.out_off < c.out.size()){
+            ssize_t w = send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+            if (w < 0) return; // EAGAIN waits for EPOLLOUT, errors show up on the read side
+            c.out_off += w;
+        }
+        c.out.clear();
+        c.out_off = 0;
+    }
+
+    void read_in(Conn &c, ns_t now){
+        char buf[READ_CHUNK];
+        bool eof = false;
+        while (true){
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n <= 0){
+                eof = true; // Answers that came in with the FIN still count
+                break;
+            }
+            stats.bytes += n;
+            c.in.append(buf, n);
+        }
+        bool close_after = false;
+        while (c.count > 0){
+            int r = parse_response(c, close_after);
+            if (r == 0) break;
+            if (r < 0){
+                ++stats.err_parse;
+                c.count = 0;
+                reconnect(c, now);
+                return;
+            }
+            Sent &s = c.fifo[c.head];
+            c.head = (c.head + 1) % MAX_PIPELINE;
+            --c.count;
+            ++stats.requests;
+            stats.hist.record(now - (interval ? s.intended : s.sent_at));
+            if (close_after) break;
+        }
+        if (eof && !close_after && c.count > 0) ++stats.err_read; // Closed still owing answers
+        if (eof || close_after || (opt.close_each && c.count == 0)){
+            reconnect(c, now);
+            return;
+        }
+        fill(c, now);
+    }
+
+    // 1 and the response taken off c.in, 0 if it isn't all here, -1 if it's not HTTP
+    int parse_response(Conn &c, bool &close_after){
+        size_t end = c.in.find("\r\n\r\n");
+        if (end == std::string::npos) return c.in.size() > 65536 ? -1 : 0;
+        std::string_view head(c.in.data(), end);
+        if (head.size() < 12 || head.substr(0, 5) != "HTTP/") return -1;
+        int status = atoi(c.in.c_str() + 9);
+        size_t body = 0;
+        bool have_length = false;
+        size_t pos = head.find("\r\n");
+        while (pos != std::string_view::npos && pos < head.size()){
+            size_t next = head.find("\r\n", pos + 2);
+            std::string_view line = head.substr(pos + 2, (next == std::string_view::npos ? head.size() : next) - pos - 2);
+            size_t colon = line.find(':');
+            if (colon != std::string_view::npos){
+                std::string name(line.substr(0, colon));
+                std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+                std::string_view value = line.substr(colon + 1);
+                while (!value.empty() && value[0] == ' ') value.remove_prefix(1);
+                if (name == "content-length"){
+                    body = strtoull(std::string(value).c_str(), nullptr, 10);
+                    have_length = true;
+                }
+                else if (name == "connection" && (value == "close" || value == "Close")){
+                    close_after = true;
+                }
+            }
+            pos = next;
+        }
+        // Every response the server sends has a length, or none at all on 1xx/204/304
+        if (!have_length && status >= 200 && status != 204 && status != 304) return -1;
+        if (c.in.size() < end + 4 + body) return 0;
+        c.in.erase(0, end + 4 + body);
+        if (status > 0 && status < STATUS_MAX) ++stats.status[status];
+        if (status != c.fifo[c.head].req->expect) ++stats.err_status;
+        return 1;
+    }
+
+    // Timeouts, reconnects and misbehaving clients, all on a 10ms tick
+    void scan(ns_t now){
+        ns_t limit = (ns_t)(opt.timeout * 1e9);
+        for (auto &c : conns){
+            if (c.fd < 0){
+                if (now >= c.retry_at) connect_load(c, now);
+                continue;
+            }
+            if (c.count > 0 && now - c.fifo[c.head].sent_at > limit){
+                // Given up on, these are dropped rather than sent again
+                stats.err_timeout += c.count;
+                c.count = 0;
+                reconnect(c, now);
+            }
+        }
+        for (auto &b : bads){
+            if (now >= b.next_at) step_bad(b, now);
+        }
+    }
+
+    void start_bad(BadConn &b, ns_t now){
+        b.fd = open_socket(((uint64_t)(&b - bads.data()) << 1) | 1);
+        b.connected = false;
+        b.started = now;
+        b.sent = 0;
+        b.in.clear();
+        b.next_at = now;
+        if (b.fd < 0){
+            b.next_at = now + RETRY_CONNECT_MS * 1000000ull;
+            return;
+        }
+        ++stats.bad_conns[b.kind];
+    }
+
+    // Done with this one, the next attempt starts after a pause
+    void end_bad(BadConn &b, ns_t now){
+        if (b.fd >= 0) close(b.fd);
+        b.fd = -1;
+        b.next_at = now + BAD_PAUSE_MS * 1000000ull;
+    }
+
+    // Whatever this client does next, on its own schedule
+    void step_bad(BadConn &b, ns_t now){
+        if (b.fd < 0){
+            start_bad(b, now);
+            return;
+        }
+        if (!b.connected){
+            b.next_at = now + 10000000;
+            return;
+        }
+        switch (b.kind){
+            case BAD_SILENT:
+                end_bad(b, now); // Held the whole time and the server let it
+                break;
+            case BAD_TRICKLE: {
+                char ch = (char)random();
+                if (send(b.fd, &ch, 1, MSG_NOSIGNAL) < 0){
+                    ++stats.bad_cut[b.kind];
+                    end_bad(b, now);
+                    return;
+                }
+                b.next_at = now + TRICKLE_MS * 1000000ull;
+                break;
+            }
+            case BAD_SLOW:
+                if (b.sent < sizeof(slow_request) - 1){
+                    if (send(b.fd, slow_request + b.sent, 1, MSG_NOSIGNAL) < 0){
+                        ++stats.slow_fail;
+                        end_bad(b, now);
+                        return;
+                    }
+                    ++b.sent;
+                    b.next_at = now + (b.sent < sizeof(slow_request) - 1 ? SLOW_MS : SLOW_WAIT_MS) * 1000000ull;
+                }
+                else{
+                    ++stats.slow_fail; // Sent it all and nothing came back in time
+                    end_bad(b, now);
+                }
+                break;
+            case BAD_GARBAGE:
+                end_bad(b, now); // Server never answered or closed, counted as not cut
+                break;
+            case BAD_SPAM:
+                spam(b, now);
+                break;
+            case BAD_COUNT:
+                break;
+        }
+    }
+
+    void spam(BadConn &b, ns_t now){
+        char junk[16384];
+        for (size_t i = 0; i < sizeof(junk); i += 8){
+            uint64_t r = random();
+            memcpy(junk + i, &r, 8);
+        }
+        while (b.sent < SPAM_MAX){
+            ssize_t w = send(b.fd, junk, sizeof(junk), MSG_NOSIGNAL);
+            if (w < 0){
+                if (errno == EAGAIN || errno == EWOULDBLOCK){
+                    b.next_at = now + 10000000;
+                    return;
+                }
+                ++stats.bad_cut[b.kind];
+                end_bad(b, now);
+                return;
+            }
+            b.sent += w;
+        }
+        end_bad(b, now);
+    }
+
+    void on_bad(BadConn &b, uint32_t ev, ns_t now){
+        if (b.fd < 0) return;
+        if (!b.connected){
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(b.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err || !(ev & EPOLLOUT)){
+                if (err) end_bad(b, now);
+                return;
+            }
+            b.connected = true;
+            b.next_at = now + (b.kind == BAD_SILENT ? (ns_t)(opt.hold * 1e9) : 0);
+            if (b.kind == BAD_GARBAGE){
+                ssize_t w = send(b.fd, garbage_request, sizeof(garbage_request) - 1, MSG_NOSIGNAL);
+                (void)w;
+                b.next_at = now + SLOW_WAIT_MS * 1000000ull;
+            }
+            return;
+        }
+        if (!(ev & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))){
+            if (b.kind == BAD_SPAM) spam(b, now);
+            return;
+        }
+        char buf[4096];
+        bool closed = false;
+        while (true){
+            ssize_t n = recv(b.fd, buf, sizeof(buf), 0);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (n <= 0){
+                closed = true;
+                break;
+            }
+            if (b.in.size() < 64) b.in.append(buf, std::min((size_t)n, 64 - b.in.size()));
+        }
+        if (b.kind == BAD_SLOW && b.in.size() >= 12){
+            // Answered, that's all it wanted
+            if (b.in.compare(0, 12, "HTTP/1.1 200") == 0) ++stats.slow_ok;
+            else ++stats.slow_fail;
+            end_bad(b, now);
+            return;
+        }
+        if (closed){
+            if (b.kind == BAD_SLOW) ++stats.slow_fail;
+            else ++stats.bad_cut[b.kind];
+            end_bad(b, now);
+        }
+    }
+
+    int epoll_fd;
+    std::vector<Conn> conns;
+    std::vector<BadConn> bads;
+    ns_t interval = 0; // Open loop, time between requests on one connection
+    uint64_t rng;
+};
+
+static void print_latency(const char *label, const LatencyHist &h){
+    printf("  %-10s %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n", label,
+           h.total ? h.sum / 1e6 / h.total : 0.0, h.percentile(50) / 1e6, h.percentile(90) / 1e6,
+           h.percentile(99) / 1e6, h.percentile(99.9) / 1e6, h.max / 1e6);
+}
+
+static void report(const Stats &s, double secs){
+    printf("\n%llu requests in %.2fs, %.2f MB read\n", (unsigned long long)s.requests, secs, s.bytes / 1e6);
+    printf("  %.1f requests/s, %.2f MB/s\n", s.requests / secs, s.bytes / 1e6 / secs);
+    printf("  %llu connections", (unsigned long long)s.connects);
+    printf(", errors: connect %llu, closed %llu, timeout %llu, bad status %llu, unparsable %llu\n",
+           (unsigned long long)s.err_connect, (unsigned long long)s.err_read, (unsigned long long)s.err_timeout,
+           (unsigned long long)s.err_status, (unsigned long long)s.err_parse);
+    printf("  status:");
+    for (int i = 0; i < STATUS_MAX; ++i){
+        if (s.status[i]) printf(" %d=%llu", i, (unsigned long long)s.status[i]);
+    }
+    printf("\n\nlatency ms   %9s %9s %9s %9s %9s %9s\n", "mean", "p50", "p90", "p99", "p99.9", "max");
+    if (opt.rate > 0){
+        print_latency("intended", s.hist); // Open loop is corrected by construction
+        print_latency("send lag", s.lag);
+        printf("  (open loop, from when each request was due, send lag is this end falling behind)\n");
+    }
+    else{
+        ns_t mean = s.hist.total ? s.hist.sum / s.hist.total : 0;
+        print_latency("measured", s.hist);
+        print_latency("corrected", s.hist.corrected(mean));
+        printf("  (closed loop, corrected for coordinated omission at the %.3fms mean)\n", mean / 1e6);
+    }
+
+    bool any_bad = false;
+    for (int k = 0; k < BAD_COUNT; ++k) any_bad = any_bad || s.bad_conns[k];
+    if (!any_bad) return;
+    printf("\nmisbehaving clients  connections  cut off by server\n");
+    for (int k = 0; k < BAD_COUNT; ++k){
+        if (!s.bad_conns[k]) continue;
+        printf("  %-18s %11llu %18llu\n", bad_names[k], (unsigned long long)s.bad_conns[k],
+               (unsigned long long)s.bad_cut[k]);
+    }
+    if (s.slow_ok || s.slow_fail){
+        printf("  slow requests answered %llu, failed %llu\n", (unsigned long long)s.slow_ok,
+               (unsigned long long)s.slow_fail);
+    }
+}
+
+static void usage(const char *prog){
+    fprintf(stderr,
+            "Usage: %s [-c CONNS] [-t THREADS] [-d SECS] [-R RATE] [-p DEPTH] [-C] [-T SECS] [-H SECS]\n"
+            "       [-s SCENARIO] [HOST[:PORT]]\n"
+            "  -c CONNS     connections (default 64)\n"
+            "  -t THREADS   threads, each with its own epoll (default 2)\n"
+            "  -d SECS      how long to run (default 10)\n"
+            "  -R RATE      open loop at RATE requests/s in total, latency from the intended send time\n"
+            "  -p DEPTH     requests pipelined per connection (default 1)\n"
+            "  -C           Connection: close, a new connection per request\n"
+            "  -T SECS      an unanswered request times out after this long (default 5)\n"
+            "  -H SECS      how long silent clients hold their connection (default 10)\n"
+            "  -s SCENARIO  request mix and misbehaving clients, see scenarios/\n"
+            "  HOST[:PORT]  server (default 127.0.0.1:8080)\n",
+            prog);
+}
+
+int main(int argc, char *argv[]){
+    int o;
+    while ((o = getopt(argc, argv, "c:t:d:R:p:CT:H:s:h")) != -1){
+        if (o == 'c') opt.connections = std::max(1, atoi(optarg));
+        else if (o == 't') opt.threads = std::max(1, atoi(optarg));
+        else if (o == 'd') opt.duration = std::max(0.1, atof(optarg));
+        else if (o == 'R') opt.rate = std::max(0.0, atof(optarg));
+        else if (o == 'p') opt.pipeline = std::min(MAX_PIPELINE, std::max(1, atoi(optarg)));
+        else if (o == 'C') opt.close_each = true;
+        else if (o == 'T') opt.timeout = std::max(0.01, atof(optarg));
+        else if (o == 'H') opt.hold = std::max(0.0, atof(optarg));
+        else if (o == 's') opt.scenario = optarg;
+        else{
+            usage(argv[0]);
+            return o == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc){
+        std::string target = argv[optind];
+        size_t colon = target.rfind(':');
+        if (colon != std::string::npos){
+            opt.port = atoi(target.c_str() + colon + 1);
+            target.resize(colon);
+        }
+        opt.host = target;
+    }
+    if (!opt.scenario.empty() && !load_scenario(opt.scenario)) return 1;
+    build_scenario();
+
+    // Look the server up once, every connection goes to the same address
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(opt.host.c_str(), nullptr, &hints, &res) != 0){
+        fprintf(stderr, "can't resolve %s\n", opt.host.c_str());
+        return 1;
+    }
+    server_addr = *(struct sockaddr_in *)res->ai_addr;
+    server_addr.sin_port = htons(opt.port);
+    freeaddrinfo(res);
+    signal(SIGPIPE, SIG_IGN);
+
+    opt.threads = std::min(opt.threads, opt.connections);
+    printf("%s:%d, %d connections on %d threads for %.1fs, ", opt.host.c_str(), opt.port, opt.connections,
+           opt.threads, opt.duration);
+    if (opt.rate > 0) printf("open loop at %.0f requests/s", opt.rate);
+    else printf("closed loop");
+    printf(", %s", opt.close_each ? "a connection per request" : "keep-alive");
+    if (opt.pipeline > 1 && !opt.close_each) printf(", pipelining %d", opt.pipeline);
+    printf("\n");
+
+    // Connections, rate and misbehaving clients split as evenly as they go
+    std::vector<Worker *> workers;
+    for (int t = 0; t < opt.threads; ++t){
+        int conns = opt.connections / opt.threads + (t < opt.connections % opt.threads);
+        unsigned bad[BAD_COUNT];
+        for (int k = 0; k < BAD_COUNT; ++k){
+            bad[k] = scenario.bad[k] / opt.threads + ((unsigned)t < scenario.bad[k] % opt.threads);
+        }
+        workers.push_back(new Worker(conns, opt.rate * conns / opt.connections, bad, 0x9e3779b9u * (t + 1)));
+    }
+    ns_t start = now_ns();
+    ns_t end = start + (ns_t)(opt.duration * 1e9);
+    std::vector<std::thread> threads;
+    for (Worker *w : workers){
+        threads.emplace_back([w, start, end]{ w->run(start, end); });
+    }
+    for (auto &t : threads) t.join();
+    double secs = (now_ns() - start) / 1e9;
+
+    Stats total;
+    for (Worker *w : workers){
+        total.merge(w->stats);
+        delete w;
+    }
+    report(total, secs);
+    return 0;
+}
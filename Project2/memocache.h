@@ -0,0 +1,230 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Memoized responses for routes whose answer only depends on the request
+
+#ifndef MEMOCACHE_H
+#define MEMOCACHE_H
+
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <unordered_map>
+
+#include "arena.h"
+#include "outqueue.h"
+#include "response.h"
+
+#define MEMO_SHARDS 16 // Lock stripes, the key's hash picks one
+#define MEMO_ENTRY_SHARE 8 // One response can take at most 1/8 of its shard's budget
+
+// What a memoized response is looked up by
+// The route and method stand in for the path, so /multiply and /multiply?x are the same route
+// with different arguments. Keep-alive and encoding change the bytes, so they're part of it too.
+struct MemoKey {
+    uint32_t tag = 0; // Route, method, keep-alive and encoding packed together
+    std::string_view query; // After the '?'
+    std::string_view body;
+    uint64_t hash = 0;
+
+    MemoKey() {}
+    MemoKey(size_t route, int method, bool keep_alive, Encoding encoding, std::string_view query,
+            std::string_view body)
+        : tag((uint32_t)route << 16 | (uint32_t)method << 8 | (uint32_t)keep_alive << 4 | (uint32_t)encoding),
+          query(query), body(body){
+        std::hash<std::string_view> h;
+        hash = h(body) ^ (h(query) * 0x9e3779b97f4a7c15ull) ^ ((uint64_t)tag * 0xff51afd7ed558ccdull);
+    }
+};
+
+// One remembered response, the key and response bytes follow it in the same allocation
+struct MemoEntry {
+    uint64_t hash;
+    uint64_t expires_ms;
+    uint32_t tag;
+    uint32_t query_len;
+    uint32_t body_len;
+    uint32_t resp_len;
+    uint32_t date_off; // Where the Date goes, 0 if there is no Date header
+    int status;
+    MemoEntry *lru_prev = nullptr; // Newer
+    MemoEntry *lru_next = nullptr; // Older
+
+    const char *query() const { return (const char *)(this + 1); }
+    const char *body() const { return query() + query_len; }
+    const char *resp() const { return body() + body_len; }
+    size_t bytes() const { return sizeof(MemoEntry) + query_len + body_len + resp_len; }
+
+    bool matches(const MemoKey &k) const {
+        return hash == k.hash && tag == k.tag && query_len == k.query.size() && body_len == k.body.size() &&
+               std::string_view(query(), query_len) == k.query && std::string_view(body(), body_len) == k.body;
+    }
+};
+
+// Sharded LRU of whole serialized responses
+// A key's hash picks a shard and only that shard's mutex is taken, so workers answering
+// different arguments rarely meet. Each shard keeps its share of the byte budget in LRU order
+// and entries older than the TTL count as misses. A hit is a memcpy of the stored response,
+// the handler and everything it would have parsed are skipped.
+class MemoCache {
+public:
+    ~MemoCache(){
+        for (Shard &s : shards){
+            while (s.lru_head) remove(s, s.lru_head);
+        }
+    }
+
+    // Budget is split over the shards, 0 bytes turns the cache off
+    // Call before any threads start
+    void configure(size_t budget, int ttl){
+        shard_budget = budget / MEMO_SHARDS;
+        ttl_ms = ttl;
+    }
+
+    bool enabled() const { return shard_budget > 0; }
+
+    // Put the remembered response for key on the reply, false on a miss
+    bool answer(const MemoKey &key, Reply &reply){
+        Shard &s = shard(key);
+        uint64_t now = now_ms();
+        std::lock_guard<std::mutex> lk(s.mutex);
+        auto it = s.index.find(key.hash);
+        if (it == s.index.end() || !it->second->matches(key)){
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        MemoEntry *e = it->second;
+        if (now >= e->expires_ms){
+            remove(s, e);
+            expirations.fetch_add(1, std::memory_order_relaxed);
+            misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        char *dst = reply.out.claim(e->resp_len);
+        if (!dst) return false;
+        memcpy(dst, e->resp(), e->resp_len);
+        if (e->date_off) memcpy(dst + e->date_off, http_date(), DATE_LEN);
+        reply.status = e->status;
+        touch(s, e);
+        hits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Remember what the handler put on the reply since from, for the next request with key
+    // Server errors aren't kept, the next try might work
+    void remember(const MemoKey &key, const Reply &reply, size_t from){
+        if (reply.status <= 0 || reply.status >= 500) return;
+        size_t resp_len = reply.out.size() - from;
+        size_t need = sizeof(MemoEntry) + key.query.size() + key.body.size() + resp_len;
+        if (need > shard_budget / MEMO_ENTRY_SHARE) return;
+        MemoEntry *e = (MemoEntry *)malloc(need); // Header and bytes in one block, placement new below
+        if (!e) return;
+        new (e) MemoEntry();
+        e->hash = key.hash;
+        e->tag = key.tag;
+        e->query_len = key.query.size();
+        e->body_len = key.body.size();
+        // An empty view can have a null data pointer, memcpy doesn't take those
+        if (!key.query.empty()) memcpy((char *)e->query(), key.query.data(), key.query.size());
+        if (!key.body.empty()) memcpy((char *)e->body(), key.body.data(), key.body.size());
+        e->resp_len = reply.out.copy(from, (char *)e->resp());
+        if (e->resp_len != resp_len){
+            free(e); // Had a file in it, those aren't kept
+            return;
+        }
+        e->status = reply.status;
+        e->date_off = 0;
+        if (response_config.send_date){
+            std::string_view head(e->resp(), e->resp_len);
+            size_t date = head.substr(0, head.find("\r\n\r\n")).find("\r\nDate: ");
+            if (date != std::string_view::npos) e->date_off = date + 8;
+        }
+        e->expires_ms = now_ms() + ttl_ms;
+
+        Shard &s = shard(key);
+        std::lock_guard<std::mutex> lk(s.mutex);
+        // Two workers can miss on the same key at once, the newer answer wins
+        auto it = s.index.find(key.hash);
+        if (it != s.index.end()) remove(s, it->second);
+        s.index[key.hash] = e;
+        lru_push(s, e);
+        s.bytes += e->bytes();
+        bytes.fetch_add(e->bytes(), std::memory_order_relaxed);
+        inserts.fetch_add(1, std::memory_order_relaxed);
+        while (s.bytes > shard_budget && s.lru_tail != e){
+            remove(s, s.lru_tail);
+            evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> inserts{0};
+    std::atomic<uint64_t> evictions{0}; // Pushed out by the budget
+    std::atomic<uint64_t> expirations{0}; // Found past the TTL
+    std::atomic<uint64_t> bytes{0}; // Held across all shards
+
+private:
+    struct alignas(64) Shard {
+        std::mutex mutex; // Protects everything below
+        std::unordered_map<uint64_t, MemoEntry *> index; // By hash, the entry has the full key
+        MemoEntry *lru_head = nullptr; // Most recent
+        MemoEntry *lru_tail = nullptr; // Least recent
+        size_t bytes = 0;
+    };
+
+    static uint64_t now_ms(){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    // Top bits, the map already uses the bottom ones
+    Shard &shard(const MemoKey &key){ return shards[(key.hash >> 59) % MEMO_SHARDS]; }
+
+    static void lru_push(Shard &s, MemoEntry *e){
+        e->lru_prev = nullptr;
+        e->lru_next = s.lru_head;
+        if (s.lru_head) s.lru_head->lru_prev = e;
+        else s.lru_tail = e;
+        s.lru_head = e;
+    }
+
+    static void lru_unlink(Shard &s, MemoEntry *e){
+        if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+        else s.lru_head = e->lru_next;
+        if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+        else s.lru_tail = e->lru_prev;
+        e->lru_prev = e->lru_next = nullptr;
+    }
+
+    static void touch(Shard &s, MemoEntry *e){
+        if (s.lru_head == e) return;
+        lru_unlink(s, e);
+        lru_push(s, e);
+    }
+
+    // Lock held
+    void remove(Shard &s, MemoEntry *e){
+        lru_unlink(s, e);
+        s.index.erase(e->hash);
+        s.bytes -= e->bytes();
+        bytes.fetch_sub(e->bytes(), std::memory_order_relaxed);
+        free(e);
+    }
+
+    Shard shards[MEMO_SHARDS];
+    size_t shard_budget = 0;
+    uint64_t ttl_ms = 0;
+};
+inline MemoCache memo_cache;
+
+#endif
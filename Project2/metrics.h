@@ -0,0 +1,251 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Per-thread counters and latency histograms, rendered for Prometheus on /metrics
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#include "arena.h"
+
+#define METRIC_ROUTES 32 // Route labels, more routes than this count as "other"
+#define METRIC_ROUTE_OTHER 0 // No route, or refused before routing
+#define METRIC_ROUTE_STATIC 1 // Served from the docroot
+#define METRIC_ROUTE_FIRST 2 // Router's routes from here
+#define HIST_SUB_BITS 2 // 4 buckets per power of two, values within 25%
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (40 * HIST_SUB) // Up to 2^41ns, about 36 minutes
+
+// Status codes with their own counter, anything else is counted as "other"
+static const int metric_statuses[] = {200, 206, 301, 304, 400, 403, 404, 405, 408, 413, 414, 416, 431, 500, 501, 503};
+#define METRIC_STATUSES (sizeof(metric_statuses) / sizeof(metric_statuses[0]) + 1)
+
+// Latencies tracked
+enum LatencyHist {
+    HIST_PARSE, // Parsing what one read brought in
+    HIST_HANDLE, // Running the handler for one request
+    HIST_WRITE, // Response ready until the last byte is written
+    HIST_WAIT, // Waiting on the worker queue
+    HIST_COUNT
+};
+static const char *hist_names[HIST_COUNT] = {"http_parse", "http_handle", "http_write", "threadpool_wait"};
+static const char *hist_help[HIST_COUNT] = {
+    "Time parsing the requests one read brought in",
+    "Time in the route handler per request",
+    "Time from a response being ready to it being written",
+    "Time a request batch waited for a worker",
+};
+
+// Why a request was refused before it reached a handler
+enum RefusedKind {
+    REFUSED_INVALID,
+    REFUSED_URI_TOO_LONG,
+    REFUSED_HEADERS_TOO_LARGE,
+    REFUSED_BODY_TOO_LARGE,
+    REFUSED_UNSUPPORTED,
+    REFUSED_TIMEOUT,
+    REFUSED_COUNT
+};
+static const char *refused_names[REFUSED_COUNT] = {
+    "invalid", "uri_too_long", "headers_too_large", "body_too_large", "unsupported_encoding", "timeout"
+};
+
+// Only the owning thread writes, so a plain load and store is enough, no locked add
+// Scrapes read them relaxed from another thread, a count can be one behind but never torn
+static inline void bump(std::atomic<uint64_t> &c, uint64_t n = 1){
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// HDR-style log-linear histogram in nanoseconds
+// Each power of two is split into HIST_SUB equal buckets, so the error is the same
+// relative amount at 2us as at 2s and finding the bucket is a clz and a shift.
+struct Histogram {
+    std::atomic<uint64_t> buckets[HIST_BUCKETS] = {};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> total{0};
+
+    static size_t index(uint64_t ns){
+        if (ns < HIST_SUB) return ns;
+        int msb = 63 - __builtin_clzll(ns);
+        size_t i = (size_t)(msb - HIST_SUB_BITS + 1) * HIST_SUB + (ns >> (msb - HIST_SUB_BITS)) - HIST_SUB;
+        return i < HIST_BUCKETS ? i : HIST_BUCKETS - 1;
+    }
+
+    // Largest value that lands in bucket i
+    static uint64_t upper(size_t i){
+        if (i < HIST_SUB) return i;
+        size_t oct = i / HIST_SUB;
+        size_t sub = i % HIST_SUB;
+        return ((uint64_t)(HIST_SUB + sub + 1) << (oct - 1)) - 1;
+    }
+
+    void record(uint64_t ns){
+        bump(buckets[index(ns)]);
+        bump(sum, ns);
+        bump(total);
+    }
+};
+
+// Everything one thread counts, on its own cache lines so threads never share one
+struct alignas(64) ThreadMetrics {
+    std::atomic<uint64_t> requests[METRIC_ROUTES][METRIC_STATUSES] = {};
+    std::atomic<uint64_t> refused[REFUSED_COUNT] = {};
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> bytes_out{0};
+    std::atomic<uint64_t> accepted{0};
+    Histogram hists[HIST_COUNT];
+};
+
+// Value the server supplies when scraped, a point in time gauge unless type says counter
+struct Sample {
+    const char *name;
+    const char *help;
+    uint64_t value;
+    const char *type = "gauge";
+};
+
+// Every thread's counters, summed only when someone asks
+class Metrics {
+public:
+    static size_t status_index(int code){
+        for (size_t i = 0; i + 1 < METRIC_STATUSES; ++i){
+            if (metric_statuses[i] == code) return i;
+        }
+        return METRIC_STATUSES - 1;
+    }
+
+    void request(size_t route, int status){
+        bump(local()->requests[route < METRIC_ROUTES ? route : METRIC_ROUTE_OTHER][status_index(status)]);
+    }
+    void refused(RefusedKind kind){ bump(local()->refused[kind]); }
+    void latency(int hist, uint64_t ns){ local()->hists[hist].record(ns); }
+    void bytes_in(uint64_t n){ bump(local()->bytes_in, n); }
+    void bytes_out(uint64_t n){ bump(local()->bytes_out, n); }
+    void accepted(){ bump(local()->accepted); }
+
+    // Prometheus text format into out
+    // routes[i] names route label i, samples come from whoever owns those numbers
+    void render(Buffer &out, const std::vector<std::string_view> &routes, const Sample *samples, size_t nsamples){
+        std::vector<ThreadMetrics *> all;
+        {
+            std::lock_guard<std::mutex> lk(mutex);
+            all = threads;
+        }
+        auto sum = [&](auto get){
+            uint64_t n = 0;
+            for (ThreadMetrics *m : all) n += get(m).load(std::memory_order_relaxed);
+            return n;
+        };
+        char line[256];
+
+        header(out, "http_requests_total", "Requests answered by route and status", "counter");
+        for (size_t r = 0; r < routes.size() && r < METRIC_ROUTES; ++r){
+            for (size_t s = 0; s < METRIC_STATUSES; ++s){
+                uint64_t n = sum([&](ThreadMetrics *m) -> std::atomic<uint64_t> & { return m->requests[r][s]; });
+                if (n == 0) continue;
+                char status[8];
+                if (s + 1 < METRIC_STATUSES) snprintf(status, sizeof(status), "%d", metric_statuses[s]);
+                else strcpy(status, "other");
+                int len = snprintf(line, sizeof(line), "http_requests_total{route=\"%.*s\",status=\"%s\"} %llu\n",
+                                   (int)std::min<size_t>(routes[r].size(), 128), routes[r].data(), status, (unsigned long long)n);
+                out.append(line, len);
+            }
+        }
+
+        header(out, "http_refused_total", "Requests refused before a handler, by reason", "counter");
+        for (size_t k = 0; k < REFUSED_COUNT; ++k){
+            uint64_t n = sum([&](ThreadMetrics *m) -> std::atomic<uint64_t> & { return m->refused[k]; });
+            int len = snprintf(line, sizeof(line), "http_refused_total{reason=\"%s\"} %llu\n", refused_names[k], (unsigned long long)n);
+            out.append(line, len);
+        }
+
+        counter(out, "http_received_bytes_total", "Bytes read from clients",
+                sum([](ThreadMetrics *m) -> std::atomic<uint64_t> & { return m->bytes_in; }));
+        counter(out, "http_sent_bytes_total", "Bytes written to clients",
+                sum([](ThreadMetrics *m) -> std::atomic<uint64_t> & { return m->bytes_out; }));
+        counter(out, "http_connections_accepted_total", "Connections accepted",
+                sum([](ThreadMetrics *m) -> std::atomic<uint64_t> & { return m->accepted; }));
+
+        for (size_t i = 0; i < nsamples; ++i){
+            header(out, samples[i].name, samples[i].help, samples[i].type);
+            int len = snprintf(line, sizeof(line), "%s %llu\n", samples[i].name, (unsigned long long)samples[i].value);
+            out.append(line, len);
+        }
+
+        for (int h = 0; h < HIST_COUNT; ++h){
+            histogram(out, h, all);
+        }
+    }
+
+private:
+    ThreadMetrics *local(){
+        thread_local ThreadMetrics *mine = nullptr;
+        if (!mine){
+            mine = new ThreadMetrics();
+            std::lock_guard<std::mutex> lk(mutex);
+            threads.push_back(mine);
+        }
+        return mine;
+    }
+
+    static void header(Buffer &out, const char *name, const char *help, const char *type){
+        char line[256];
+        int len = snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+        out.append(line, len);
+    }
+
+    static void counter(Buffer &out, const char *name, const char *help, uint64_t n){
+        header(out, name, help, "counter");
+        char line[128];
+        int len = snprintf(line, sizeof(line), "%s %llu\n", name, (unsigned long long)n);
+        out.append(line, len);
+    }
+
+    // Cumulative buckets in seconds, from 1us up to the last one anything landed in
+    static void histogram(Buffer &out, int h, const std::vector<ThreadMetrics *> &all){
+        char name[64];
+        snprintf(name, sizeof(name), "%s_seconds", hist_names[h]);
+        header(out, name, hist_help[h], "histogram");
+        uint64_t counts[HIST_BUCKETS] = {};
+        uint64_t sum = 0, total = 0;
+        for (ThreadMetrics *m : all){
+            const Histogram &hist = m->hists[h];
+            for (size_t i = 0; i < HIST_BUCKETS; ++i) counts[i] += hist.buckets[i].load(std::memory_order_relaxed);
+            sum += hist.sum.load(std::memory_order_relaxed);
+            total += hist.total.load(std::memory_order_relaxed);
+        }
+        size_t last = 0;
+        for (size_t i = 0; i < HIST_BUCKETS; ++i){
+            if (counts[i]) last = i;
+        }
+        char line[128];
+        uint64_t running = 0;
+        for (size_t i = 0; i <= last; ++i){
+            running += counts[i];
+            uint64_t le = Histogram::upper(i);
+            if (le < 1000 && i != last) continue; // Sub-microsecond buckets fold into the first shown
+            int len = snprintf(line, sizeof(line), "%s_bucket{le=\"%.9g\"} %llu\n", name, (le + 1) / 1e9,
+                               (unsigned long long)running);
+            out.append(line, len);
+        }
+        int len = snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+                           name, (unsigned long long)total, name, sum / 1e9, name, (unsigned long long)total);
+        out.append(line, len);
+    }
+
+    std::mutex mutex; // Protect threads
+    std::vector<ThreadMetrics *> threads; // Every thread's block, never freed since the threads never end
+};
+inline Metrics metrics;
+
+#endif
@@ -0,0 +1,171 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Multiplying many pairs at once, for POST /multiply/batch
+
+#ifndef MULTIPLY_H
+#define MULTIPLY_H
+
+#include <immintrin.h>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#define PRODUCT_TEXT_MAX 40 // "-" and 39 digits, the most a 128-bit product takes
+
+// Products of two int64 always fit in 128 bits, so every one is exact
+// Stored the way x86 keeps __int128, little-endian low half first, which is also the binary reply format
+typedef __int128 Product;
+
+// Pairs are a0,b0,a1,b1,... as little-endian int64, p doesn't have to be aligned
+static inline int64_t load_int64(const char *p){
+    int64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// n products of the pairs at pairs into out
+static inline void multiply_pairs_scalar(const char *pairs, Product *out, size_t n){
+    for (size_t i = 0; i < n; ++i){
+        out[i] = (Product)load_int64(pairs + 16 * i) * load_int64(pairs + 16 * i + 8);
+    }
+}
+
+// Vector kernels multiply the low 32 bits of each lane (vpmuldq), exact when both operands fit
+// in int32. Lanes where one doesn't are the overflow lanes: their mask bit is clear and they're
+// redone in scalar as 128-bit.
+__attribute__((target("avx2")))
+static inline void multiply_pairs_avx2(const char *pairs, Product *out, size_t n){
+    const __m256i bias = _mm256_set1_epi64x(0x80000000ll);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4){
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(pairs + 16 * i)); // a0 b0 a1 b1
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(pairs + 16 * i + 32)); // a2 b2 a3 b3
+        __m256i a = _mm256_unpacklo_epi64(v0, v1); // a0 a2 a1 a3
+        __m256i b = _mm256_unpackhi_epi64(v0, v1); // b0 b2 b1 b3
+        // x fits in int32 when x + 2^31 has nothing in its top half
+        __m256i fits = _mm256_and_si256(_mm256_cmpeq_epi64(_mm256_srli_epi64(_mm256_add_epi64(a, bias), 32), zero),
+                                        _mm256_cmpeq_epi64(_mm256_srli_epi64(_mm256_add_epi64(b, bias), 32), zero));
+        __m256i lo = _mm256_mul_epi32(a, b); // p0 p2 p1 p3
+        __m256i hi = _mm256_cmpgt_epi64(zero, lo); // Sign extended to 128 bits
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_unpacklo_epi64(lo, hi)); // p0 p1
+        _mm256_storeu_si256((__m256i *)(out + i + 2), _mm256_unpackhi_epi64(lo, hi)); // p2 p3
+        if (_mm256_movemask_pd(_mm256_castsi256_pd(fits)) != 0xF){
+            multiply_pairs_scalar(pairs + 16 * i, out + i, 4);
+        }
+    }
+    multiply_pairs_scalar(pairs + 16 * i, out + i, n - i);
+}
+
+// GCC 12 warns inside its own avx512fintrin.h (the undefined pass-through vector), nothing here
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+static inline void multiply_pairs_avx512(const char *pairs, Product *out, size_t n){
+    const __m512i even = _mm512_setr_epi64(0, 2, 4, 6, 8, 10, 12, 14);
+    const __m512i odd = _mm512_setr_epi64(1, 3, 5, 7, 9, 11, 13, 15);
+    const __m512i first = _mm512_setr_epi64(0, 8, 1, 9, 2, 10, 3, 11);
+    const __m512i second = _mm512_setr_epi64(4, 12, 5, 13, 6, 14, 7, 15);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8){
+        __m512i v0 = _mm512_loadu_si512(pairs + 16 * i);
+        __m512i v1 = _mm512_loadu_si512(pairs + 16 * i + 64);
+        __m512i a = _mm512_permutex2var_epi64(v0, even, v1);
+        __m512i b = _mm512_permutex2var_epi64(v0, odd, v1);
+        // Fits in int32 when sign extending its low half gives it back
+        __mmask8 fits = _mm512_cmpeq_epi64_mask(a, _mm512_srai_epi64(_mm512_slli_epi64(a, 32), 32)) &
+                        _mm512_cmpeq_epi64_mask(b, _mm512_srai_epi64(_mm512_slli_epi64(b, 32), 32));
+        __m512i lo = _mm512_mul_epi32(a, b);
+        __m512i hi = _mm512_srai_epi64(lo, 63);
+        _mm512_storeu_si512(out + i, _mm512_permutex2var_epi64(lo, first, hi));
+        _mm512_storeu_si512(out + i + 4, _mm512_permutex2var_epi64(lo, second, hi));
+        for (unsigned m = ~(unsigned)fits & 0xFF; m; m &= m - 1){
+            size_t j = i + __builtin_ctz(m);
+            multiply_pairs_scalar(pairs + 16 * j, out + j, 1);
+        }
+    }
+    multiply_pairs_scalar(pairs + 16 * i, out + i, n - i);
+}
+#pragma GCC diagnostic pop
+
+typedef void (*multiply_pairs_fn)(const char *, Product *, size_t);
+
+static inline multiply_pairs_fn pick_multiply_pairs(){
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return multiply_pairs_avx512;
+    if (__builtin_cpu_supports("avx2")) return multiply_pairs_avx2;
+    return multiply_pairs_scalar;
+}
+static const multiply_pairs_fn multiply_pairs = pick_multiply_pairs();
+
+// Decimal digits in v
+static inline size_t digits10(uint64_t v){
+    static const uint64_t pow10[20] = {
+        1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+        1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+        100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+        1000000000000000000ull, 10000000000000000000ull};
+    if (v == 0) return 1;
+    size_t t = (size_t)((64 - __builtin_clzll(v)) * 1233) >> 12; // About bits * log10(2)
+    return t + 1 - (v < pow10[t]);
+}
+
+#define TEN19 10000000000000000000ull
+
+// How long p is written out in decimal
+static inline size_t product_text_len(Product p){
+    unsigned __int128 u = p < 0 ? -(unsigned __int128)p : (unsigned __int128)p;
+    size_t sign = p < 0;
+    if (u >> 64 == 0) return sign + digits10((uint64_t)u);
+    return sign + 19 + digits10((uint64_t)(u / TEN19));
+}
+
+// p in decimal at dst, returns the end, dst needs PRODUCT_TEXT_MAX bytes
+static inline char *format_product(char *dst, Product p){
+    unsigned __int128 u = p < 0 ? -(unsigned __int128)p : (unsigned __int128)p;
+    if (p < 0) *dst++ = '-';
+    // Same split as product_text_len, anything under 2^64 goes out in one piece
+    if (u >> 64 == 0) return std::to_chars(dst, dst + PRODUCT_TEXT_MAX, (uint64_t)u).ptr;
+    // High part as is, low 19 digits zero padded
+    dst = std::to_chars(dst, dst + PRODUCT_TEXT_MAX, (uint64_t)(u / TEN19)).ptr;
+    uint64_t low = (uint64_t)(u % TEN19);
+    for (int k = 18; k >= 0; --k){
+        dst[k] = (char)('0' + low % 10);
+        low /= 10;
+    }
+    return dst + 19;
+}
+
+// One a,b pair per line, spaces around either number and CRLF line ends are fine, blank lines skipped
+// Fills pairs (room for one per line) and n, false with the 1-based line that's wrong in bad_line
+static inline bool parse_pairs_text(std::string_view body, int64_t *pairs, size_t &n, size_t &bad_line){
+    auto number = [](std::string_view s, int64_t &v){
+        while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) s.remove_prefix(1);
+        while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r')) s.remove_suffix(1);
+        if (!s.empty() && s[0] == '+' && s.size() > 1 && s[1] != '-') s.remove_prefix(1); // from_chars doesn't take '+'
+        auto res = std::from_chars(s.data(), s.data() + s.size(), v);
+        return !s.empty() && res.ec == std::errc() && res.ptr == s.data() + s.size();
+    };
+    n = 0;
+    size_t line = 0;
+    while (!body.empty()){
+        ++line;
+        size_t eol = body.find('\n');
+        std::string_view l = body.substr(0, eol);
+        body.remove_prefix(eol == std::string_view::npos ? body.size() : eol + 1);
+        if (l.find_first_not_of(" \t\r") == std::string_view::npos) continue;
+        size_t comma = l.find(',');
+        if (comma == std::string_view::npos || !number(l.substr(0, comma), pairs[2 * n]) ||
+            !number(l.substr(comma + 1), pairs[2 * n + 1])){
+            bad_line = line;
+            return false;
+        }
+        ++n;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,325 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Response output queue, copied headers plus bodies sent from where they already are
+
+#ifndef OUTQUEUE_H
+#define OUTQUEUE_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "arena.h"
+
+#define MAX_OUT_REFS 32 // Bodies queued by reference per connection, more than that get copied
+#define MAX_IOVECS 64 // iovecs handed to one sendmsg
+#define ATTACH_MIN 1024 // Bodies smaller than this are cheaper to copy than to reference
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+// Write path counters, shown on /stats with the allocator ones
+struct IoStats {
+    std::atomic<uint64_t> sendmsg_calls{0}; // sendmsg calls that wrote something
+    std::atomic<uint64_t> body_refs{0}; // Bodies sent by reference instead of copied
+    std::atomic<uint64_t> sendfile_calls{0}; // sendfile calls that wrote something
+    std::atomic<uint64_t> zerocopy_sends{0}; // sendmsg calls with MSG_ZEROCOPY
+    std::atomic<uint64_t> zerocopy_done{0}; // Completions read back from the error queue
+    std::atomic<uint64_t> zerocopy_copied{0}; // ...where the kernel copied anyway (loopback does)
+    std::atomic<uint64_t> uring_enters{0}; // io_uring_enter calls, the io_uring engine's only syscall per batch
+    std::atomic<uint64_t> uring_sends{0}; // Send SQEs that wrote something
+    std::atomic<uint64_t> uring_fixed_sends{0}; // ...from the registered block slab
+};
+inline IoStats io_stats;
+
+// How long a body handed to the queue stays valid
+enum BodyMemory {
+    BODY_COPY, // Caller's memory goes away, copy it
+    BODY_STABLE, // Lives until the response is written (the request arena)
+    BODY_STATIC // Lives as long as the server, safe for MSG_ZEROCOPY
+};
+
+// Called once a held body or file has been written or dropped
+typedef void (*ReleaseFn)(void *arg);
+
+// Bytes waiting to go out on a connection
+// Headers and small bodies are copied into one buffer, big bodies are only referenced and
+// sit between the copied bytes as their own iovec. flush() sends it all with one sendmsg,
+// except MSG_ZEROCOPY bodies which go in a call of their own: the kernel reads those pages
+// after sendmsg returns, so nothing that gets reused (like the copy buffer) can ride along.
+// File ranges are pieces too, flush() hands those to sendfile.
+class OutQueue {
+public:
+    OutQueue() {}
+    OutQueue(const OutQueue &) = delete;
+    OutQueue &operator=(const OutQueue &) = delete;
+    ~OutQueue(){ release(); }
+
+    // Copy bytes onto the end
+    void append(const char *p, size_t n){ bytes.append(p, n); }
+    void append(std::string_view s){ bytes.append(s); }
+    void push_back(char ch){ bytes.push_back(ch); }
+
+    // Space for n copied bytes to be written in place, nullptr if out of memory
+    char *claim(size_t n){
+        if (!bytes.reserve(n)) return nullptr;
+        char *p = bytes.tail();
+        bytes.commit(n);
+        return p;
+    }
+
+    // Queue a body
+    // Zerocopy only for BODY_STATIC, anything freed or reused after the write could change
+    // under the kernel before it is actually sent.
+    void body(std::string_view b, BodyMemory mem, bool zerocopy = false){
+        if (mem == BODY_COPY || b.size() < ATTACH_MIN || nrefs == MAX_OUT_REFS){
+            bytes.append(b);
+            return;
+        }
+        Ref &r = add_ref(b.size());
+        r.ptr = b.data();
+        r.zerocopy = zerocopy && mem == BODY_STATIC;
+    }
+
+    // Room for another held body or file
+    bool can_hold() const { return nrefs < MAX_OUT_REFS; }
+
+    // Queue a body someone else owns, done(arg) runs once it's no longer needed
+    // Check can_hold() first, nothing is queued or released when it's full
+    void held(std::string_view b, ReleaseFn done, void *arg){
+        if (!can_hold()) return;
+        Ref &r = add_ref(b.size());
+        r.ptr = b.data();
+        r.done = done;
+        r.arg = arg;
+    }
+
+    // Queue len bytes of a file from off, sent with sendfile
+    void file(int fd, off_t off, size_t len, ReleaseFn done, void *arg){
+        if (!can_hold()) return;
+        Ref &r = add_ref(len);
+        r.fd = fd;
+        r.off = off;
+        r.done = done;
+        r.arg = arg;
+    }
+
+    // Everything queued as one string, for responses built once at startup
+    std::string flatten() const {
+        std::string all;
+        for (size_t i = 0; i < pieces(); ++i){
+            const char *p;
+            size_t len;
+            bool zc;
+            get(i, p, len, zc);
+            if (p) all.append(p, len); // Files aren't read back
+        }
+        return all;
+    }
+
+    // Queued bytes from offset from on, copied into dst which has room for size() - from
+    // Returns how many were copied, files aren't read back so it's less when there are some
+    size_t copy(size_t from, char *dst) const {
+        char *out = dst;
+        size_t at = 0;
+        for (size_t i = 0; i < pieces(); ++i){
+            const char *p;
+            size_t len;
+            bool zc;
+            get(i, p, len, zc);
+            size_t skip = from > at ? std::min(from - at, len) : 0;
+            at += len;
+            if (!p || skip == len) continue;
+            memcpy(out, p + skip, len - skip);
+            out += len - skip;
+        }
+        return out - dst;
+    }
+
+    // Like copy() but file ranges are read back too, dst has room for size() - from
+    // false if a file couldn't be read
+    bool gather(size_t from, char *dst) const {
+        size_t at = 0;
+        for (size_t i = 0; i < pieces(); ++i){
+            const char *p;
+            size_t len;
+            bool zc;
+            get(i, p, len, zc);
+            size_t skip = from > at ? std::min(from - at, len) : 0;
+            at += len;
+            if (skip == len) continue;
+            if (p){
+                memcpy(dst, p + skip, len - skip);
+            }
+            else{
+                const Ref &r = refs[i / 2];
+                for (size_t got = skip; got < len;){
+                    ssize_t n = pread(r.fd, dst + got - skip, len - got, r.off + got);
+                    if (n <= 0) return false;
+                    got += n;
+                }
+            }
+            dst += len - skip;
+        }
+        return true;
+    }
+
+    // Bytes queued, copied and referenced
+    size_t size() const { return bytes.size() + ref_bytes; }
+
+    // Bytes not sent yet
+    size_t remaining() const { return bytes.size() + ref_bytes - sent; }
+
+    // Everything sent
+    bool done() const { return sent >= bytes.size() + ref_bytes; }
+
+    // The next thing to send is a file range, where in it to continue
+    bool next_file(int &fd, off_t &off, size_t &len) const {
+        for (size_t i = piece, at = piece_off; i < pieces(); ++i, at = 0){
+            const char *p;
+            size_t n;
+            bool zc;
+            get(i, p, n, zc);
+            if (at >= n) continue;
+            if (!(i & 1) || refs[i / 2].fd < 0) return false;
+            fd = refs[i / 2].fd;
+            off = refs[i / 2].off + at;
+            len = n - at;
+            return true;
+        }
+        return false;
+    }
+
+    // iovecs for what is left, up to the next zerocopy body or file
+    // zerocopy is set when the batch is exactly one zerocopy body
+    int fill(struct iovec *iov, int max, bool &zerocopy) const {
+        zerocopy = false;
+        int cnt = 0;
+        size_t off = piece_off;
+        for (size_t i = piece; i < pieces() && cnt < max; ++i, off = 0){
+            const char *p;
+            size_t len;
+            bool zc;
+            get(i, p, len, zc);
+            if (off >= len) continue; // Empty stretch of copied bytes
+            if ((i & 1) && refs[i / 2].fd >= 0) break; // sendfile's job
+            if (zc){
+                if (cnt > 0) break; // Send what's before it first
+                zerocopy = true;
+            }
+            iov[cnt].iov_base = (void *)(p + off);
+            iov[cnt].iov_len = len - off;
+            ++cnt;
+            if (zc) break;
+        }
+        return cnt;
+    }
+
+    // n more bytes were written, move past them
+    void advance(size_t n){
+        sent += n;
+        while (n > 0 && piece < pieces()){
+            const char *p;
+            size_t len;
+            bool zc;
+            get(piece, p, len, zc);
+            size_t left = len - piece_off;
+            if (n < left){
+                piece_off += n;
+                return;
+            }
+            n -= left;
+            ++piece;
+            piece_off = 0;
+        }
+    }
+
+    // Empty but keep the memory
+    void clear(){
+        drop_refs();
+        bytes.clear();
+        ref_bytes = sent = 0;
+        piece = piece_off = 0;
+    }
+
+    // Hand the memory back to the pool
+    void release(){
+        drop_refs();
+        bytes.release();
+        ref_bytes = sent = 0;
+        piece = piece_off = 0;
+    }
+
+private:
+    struct Ref {
+        size_t at; // Copied bytes before it
+        const char *ptr;
+        size_t len;
+        bool zerocopy;
+        int fd; // File to sendfile from, -1 for memory
+        off_t off;
+        ReleaseFn done; // Owner to tell when we're finished with it
+        void *arg;
+    };
+
+    Ref &add_ref(size_t len){
+        count(io_stats.body_refs);
+        Ref &r = refs[nrefs++];
+        r.at = bytes.size();
+        r.ptr = nullptr;
+        r.len = len;
+        r.zerocopy = false;
+        r.fd = -1;
+        r.off = 0;
+        r.done = nullptr;
+        r.arg = nullptr;
+        ref_bytes += len;
+        return r;
+    }
+
+    void drop_refs(){
+        for (size_t i = 0; i < nrefs; ++i){
+            if (refs[i].done) refs[i].done(refs[i].arg);
+        }
+        nrefs = 0;
+    }
+
+    // Pieces alternate copied bytes and references: bytes, ref 0, bytes, ref 1, ..., bytes
+    size_t pieces() const { return 2 * nrefs + 1; }
+
+    void get(size_t i, const char *&p, size_t &len, bool &zc) const {
+        if (i & 1){
+            const Ref &r = refs[i / 2];
+            p = r.ptr;
+            len = r.len;
+            zc = r.zerocopy;
+            return;
+        }
+        size_t k = i / 2;
+        size_t from = k == 0 ? 0 : refs[k - 1].at;
+        size_t to = k < nrefs ? refs[k].at : bytes.size();
+        p = bytes.data() + from;
+        len = to - from;
+        zc = false;
+    }
+
+    Buffer bytes; // Copied part
+    Ref refs[MAX_OUT_REFS];
+    size_t nrefs = 0;
+    size_t ref_bytes = 0; // Bytes in refs
+    size_t sent = 0; // Bytes written so far
+    size_t piece = 0; // Send position
+    size_t piece_off = 0;
+};
+
+#endif
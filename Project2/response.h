@@ -0,0 +1,286 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Writing responses, built per request or cached at startup
+
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <time.h>
+#include <charconv>
+#include <coroutine>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include "arena.h"
+#include "async.h"
+#include "compress.h"
+#include "metrics.h"
+#include "outqueue.h"
+
+#define RETRY_AFTER_SECS 1 // Retry-After on 503s when overloaded
+#define MULTIPLY_MAX_DIGITS 4096 // Longest /multiply operand, the big product is O(n*m)
+
+// How responses are written, set from the command line
+struct ResponseConfig {
+    bool send_date = false; // Add a Date header to responses
+    size_t zerocopy_min = 65536; // Static bodies this big go out with MSG_ZEROCOPY, 0 turns it off
+    int gzip_level = 6; // zlib level for compressed responses, 0 turns compression off
+    size_t gzip_min = 128; // Smaller bodies aren't worth compressing
+};
+inline ResponseConfig response_config;
+
+#define DATE_LEN 29 // "Sun, 06 Nov 1994 08:49:37 GMT"
+
+// Current time as an HTTP date, only reformatted when the second changes
+// Each thread keeps its own copy so nothing is shared or locked
+static const char *http_date(){
+    thread_local char buf[DATE_LEN + 1];
+    thread_local time_t last = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec != last){
+        last = ts.tv_sec;
+        struct tm tm;
+        gmtime_r(&last, &tm);
+        strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    }
+    return buf;
+}
+
+struct Connection; // The event loop's, defined with it
+struct H2Stream; // An HTTP/2 request on one, from h2.h
+
+// What a suspended coroutine handler is waiting for
+enum LoopWait {
+    WAIT_NONE,
+    WAIT_SLEEP, // A timer
+    WAIT_WRITE // Everything it appended so far to be sent
+};
+
+// co_await on one of these parks the handler on its connection, the loop resumes it
+struct LoopAwait {
+    Connection *conn;
+    H2Stream *stream; // Parks on the stream instead when it's HTTP/2
+    LoopWait what;
+    int ms;
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> h);
+    void await_resume() const {}
+};
+
+// Where a handler puts its response
+struct Reply {
+    OutQueue &out; // Response bytes, the event loop writes them
+    Arena &arena; // Scratch memory that lasts until the response is written
+    bool keep_alive; // Connection stays open after this response
+    Encoding encoding = ENC_IDENTITY; // Best Content-Encoding the client takes
+    int status = 0; // Status code of the response, for the access log
+    size_t route = METRIC_ROUTE_OTHER; // What answered it, for /metrics
+    Connection *conn = nullptr; // Set for coroutine handlers, the waits below park on it
+    H2Stream *stream = nullptr; // ...or on this when the request came over HTTP/2
+
+    // co_await reply.sleep(ms), comes back after ms without holding a thread
+    // The time starts once everything written before it has gone out
+    LoopAwait sleep(int ms){ return {conn, stream, WAIT_SLEEP, ms}; }
+    // co_await reply.write(), sends what was appended so far and comes back once the client
+    // took all of it, so a long response can go out in pieces instead of sitting in memory
+    LoopAwait write(){ return {conn, stream, WAIT_WRITE, 0}; }
+};
+
+// Coroutine handler frames live in the request arena
+inline Arena *frame_arena(Reply &reply){ return &reply.arena; }
+
+// Append a number in decimal
+static inline void append_number(OutQueue &out, unsigned long long n){
+    char buf[24];
+    char *end = std::to_chars(buf, buf + sizeof(buf), n).ptr;
+    out.append(buf, end - buf);
+}
+
+// Status line and Date, the headers common to every response
+static inline void begin_response(Reply &reply, int code, std::string_view reason){
+    OutQueue &out = reply.out;
+    reply.status = code;
+    out.append("HTTP/1.1 ");
+    append_number(out, code);
+    out.push_back(' ');
+    out.append(reason);
+    out.append("\r\n");
+    if (response_config.send_date){
+        out.append("Date: ");
+        out.append(http_date(), DATE_LEN);
+        out.append("\r\n");
+    }
+}
+
+// HTTP Response
+// Appends the whole response to out, the event loop writes it
+// extra_headers is already formatted, "Name: value\r\n" lines
+// Bodies that outlive the write (mem) are sent from where they are instead of copied
+static inline void send_response(Reply &reply, int code, std::string_view reason,
+                                 std::string_view content_type, std::string_view body,
+                                 std::string_view extra_headers = std::string_view(),
+                                 BodyMemory mem = BODY_COPY) {
+    OutQueue &out = reply.out;
+    // Text bodies big enough get compressed if the client takes it
+    bool varies = response_config.gzip_level && body.size() >= response_config.gzip_min && compressible(content_type);
+    std::string_view encoded;
+    if (varies && reply.encoding != ENC_IDENTITY){
+        encoded = deflate_arena(reply.encoding, response_config.gzip_level, body, reply.arena);
+    }
+    if (!encoded.empty()){
+        body = encoded;
+        mem = BODY_STABLE; // In the arena now
+    }
+    begin_response(reply, code, reason);
+    out.append("Content-Type: ");
+    out.append(content_type);
+    out.append("\r\nContent-Length: ");
+    append_number(out, body.size());
+    out.append("\r\n");
+    if (!encoded.empty()){
+        out.append("Content-Encoding: ");
+        out.append(encoding_names[reply.encoding]);
+        out.append("\r\n");
+    }
+    if (varies){
+        out.append("Vary: Accept-Encoding\r\n");
+    }
+    // For requests with location
+    out.append(extra_headers);
+    out.append(reply.keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+    bool zerocopy = response_config.zerocopy_min && body.size() >= response_config.zerocopy_min;
+    out.body(body, mem, zerocopy);
+}
+
+// Build a response once at startup
+static inline std::string serialize_response(bool keep_alive, Encoding encoding, int code, std::string_view reason,
+                                             std::string_view content_type, std::string_view body,
+                                             std::string_view extra_headers = std::string_view()){
+    OutQueue out;
+    Arena arena;
+    Reply reply{out, arena, keep_alive, encoding};
+    send_response(reply, code, reason, content_type, body, extra_headers);
+    return out.flatten();
+}
+
+// Responses that never change
+enum StaticResponse {
+    RESP_INDEX, // Default HTML page
+    RESP_GOOGLE, // 301 to google
+    RESP_FORBIDDEN, // 403
+    RESP_NOT_FOUND, // 404
+    RESP_BAD_FORM, // 400 missing a or b
+    RESP_BAD_INT, // 400 a or b not integers
+    RESP_INT_TOO_LONG, // 400 a or b over MULTIPLY_MAX_DIGITS
+    RESP_TIMEOUT, // 408 request took too long
+    RESP_BAD_REQUEST, // 400 didn't parse
+    RESP_BODY_TOO_LARGE, // 413
+    RESP_URI_TOO_LONG, // 414
+    RESP_HEADERS_TOO_LARGE, // 431
+    RESP_NOT_IMPLEMENTED, // 501 unknown Transfer-Encoding
+    RESP_UNAVAILABLE, // 503 overloaded, with Retry-After
+    RESP_COUNT
+};
+
+// Pre-serialized static responses
+// Status line, headers and body are built once at startup, the hot path just copies them.
+// The Date header, when on, has a fixed width slot that is patched per response.
+// Each one is also kept compressed per encoding, when that comes out smaller.
+class ResponseCache {
+public:
+    void build(){
+        const char *page =
+            "<!doctype html>\n<html><head><meta charset=\"utf-8\"><title>Index</title></head>\n"
+            "<body><h1>Hello from Allison's server :)</h1>\n"
+            "</body></html>\n";
+        const char *google = "Location: https://google.com\r\n";
+        std::string retry = "Retry-After: " + std::to_string(RETRY_AFTER_SECS) + "\r\n";
+        std::string too_long = "Bad Request: a and b can have at most " + std::to_string(MULTIPLY_MAX_DIGITS) + " digits";
+
+        for (int ka = 0; ka < 2; ++ka){
+            set(RESP_INDEX, ka, 200, "OK", "text/html", page);
+            set(RESP_GOOGLE, ka, 301, "Moved Permanently", "text/plain", "Moved Permanently", google);
+            set(RESP_FORBIDDEN, ka, 403, "Forbidden", "text/plain", "Forbidden");
+            set(RESP_NOT_FOUND, ka, 404, "Not Found", "text/plain", "Not Found");
+            set(RESP_BAD_FORM, ka, 400, "Bad Request", "text/plain", "Bad Request: expected a=INT&b=INT");
+            set(RESP_BAD_INT, ka, 400, "Bad Request", "text/plain", "Bad Request: a and b must be integers");
+            set(RESP_INT_TOO_LONG, ka, 400, "Bad Request", "text/plain", too_long.c_str());
+            set(RESP_TIMEOUT, ka, 408, "Request Timeout", "text/plain", "Request Timeout");
+            set(RESP_BAD_REQUEST, ka, 400, "Bad Request", "text/plain", "Bad Request");
+            set(RESP_BODY_TOO_LARGE, ka, 413, "Content Too Large", "text/plain", "Content Too Large");
+            set(RESP_URI_TOO_LONG, ka, 414, "URI Too Long", "text/plain", "URI Too Long");
+            set(RESP_HEADERS_TOO_LARGE, ka, 431, "Request Header Fields Too Large", "text/plain",
+                "Request Header Fields Too Large");
+            set(RESP_NOT_IMPLEMENTED, ka, 501, "Not Implemented", "text/plain", "Not Implemented");
+            set(RESP_UNAVAILABLE, ka, 503, "Service Unavailable", "text/plain", "Service Unavailable", retry.c_str());
+        }
+    }
+
+    // Copy a cached response onto the reply
+    // A big body is referenced from the cache instead, it never changes
+    void append(Reply &reply, StaticResponse id) const {
+        const Entry *ep = &entries[id][reply.keep_alive][reply.encoding];
+        if (ep->bytes.empty()) ep = &entries[id][reply.keep_alive][ENC_IDENTITY];
+        else if (reply.encoding != ENC_IDENTITY) count(compress_stats.cache_hits);
+        const Entry &e = *ep;
+        reply.status = e.code;
+        std::string_view whole = e.bytes;
+        std::string_view body = whole.substr(e.body_off);
+        bool by_ref = body.size() >= ATTACH_MIN;
+        size_t n = by_ref ? e.body_off : whole.size();
+        char *dst = reply.out.claim(n);
+        if (!dst) return;
+        memcpy(dst, whole.data(), n);
+        if (e.date_off){
+            memcpy(dst + e.date_off, http_date(), DATE_LEN);
+        }
+        if (by_ref){
+            bool zerocopy = response_config.zerocopy_min && body.size() >= response_config.zerocopy_min;
+            reply.out.body(body, BODY_STATIC, zerocopy);
+        }
+    }
+
+    // Copy a cached response into dst for writing straight to a socket, its size or 0 if it doesn't fit
+    size_t copy(StaticResponse id, bool keep_alive, char *dst, size_t cap) const {
+        const Entry &e = entries[id][keep_alive][ENC_IDENTITY];
+        if (e.bytes.size() > cap) return 0;
+        memcpy(dst, e.bytes.data(), e.bytes.size());
+        if (e.date_off){
+            memcpy(dst + e.date_off, http_date(), DATE_LEN);
+        }
+        return e.bytes.size();
+    }
+
+private:
+    struct Entry {
+        std::string bytes; // Whole response
+        size_t date_off = 0; // Where the date goes, 0 if there is no Date header
+        size_t body_off = 0; // Where the headers end
+        int code = 0;
+    };
+
+    void set(StaticResponse id, bool keep_alive, int code, const char *reason,
+             const char *content_type, const char *body, const char *extra_headers = ""){
+        for (int enc = 0; enc < ENC_COUNT; ++enc){
+            Entry &e = entries[id][keep_alive][enc];
+            e.code = code;
+            e.bytes = serialize_response(keep_alive, (Encoding)enc, code, reason, content_type, body, extra_headers);
+            if (enc != ENC_IDENTITY && e.bytes == entries[id][keep_alive][ENC_IDENTITY].bytes){
+                e.bytes.clear(); // Didn't compress, the identity one is used
+                continue;
+            }
+            e.body_off = e.bytes.find("\r\n\r\n") + 4;
+            if (response_config.send_date){
+                e.date_off = e.bytes.find("\r\nDate: ") + 8;
+            }
+        }
+    }
+
+    Entry entries[RESP_COUNT][2][ENC_COUNT];
+};
+inline ResponseCache responses;
+
+#endif
@@ -0,0 +1,330 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Work-stealing worker thread pool
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define DEQUE_SIZE 4096 // Tasks each worker's deque holds
+#define INJECT_SIZE 65536 // Tasks the shared injection queue holds
+#define SPIN_ROUNDS 64 // Looks for work this many times before parking
+#define INJECT_BATCH 8 // Tasks a worker takes from the injection queue at once
+#define CACHE_LINE 64 // Keep hot atomics on their own cache line
+
+// A unit of work, a function and what to call it on
+// Two words and no heap allocation, unlike std::function
+struct Task {
+    void (*fn)(void *) = nullptr;
+    void *arg = nullptr;
+};
+
+// Chase-Lev work-stealing deque
+// The owner pushes and pops at the bottom, other workers steal from the top.
+// Slots are plain atomic words read relaxed, a thief only keeps what it read if its CAS on top wins.
+// https://www.di.ens.fr/~zappa/readings/ppopp13.pdf
+class WorkDeque {
+public:
+    // Owner only, false if full
+    bool push(Task t){
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t tp = top.load(std::memory_order_acquire);
+        if (b - tp >= DEQUE_SIZE) return false;
+        Slot &s = slots[b & (DEQUE_SIZE - 1)];
+        s.fn.store(t.fn, std::memory_order_relaxed);
+        s.arg.store(t.arg, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Owner only, newest task first
+    bool pop(Task &t){
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t tp = top.load(std::memory_order_relaxed);
+        if (tp > b){
+            bottom.store(b + 1, std::memory_order_relaxed); // Was empty
+            return false;
+        }
+        read(b, t);
+        if (tp == b){
+            // Last task, race thieves for it
+            bool won = top.compare_exchange_strong(tp, tp + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // Any thread, oldest task first
+    bool steal(Task &t){
+        int64_t tp = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (tp >= b) return false;
+        read(tp, t);
+        return top.compare_exchange_strong(tp, tp + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    // Rough count, only for stats
+    size_t size() const {
+        int64_t n = bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_relaxed);
+        return n > 0 ? (size_t)n : 0;
+    }
+
+private:
+    struct Slot {
+        std::atomic<void (*)(void *)> fn{nullptr};
+        std::atomic<void *> arg{nullptr};
+    };
+
+    void read(int64_t i, Task &t) const {
+        const Slot &s = slots[i & (DEQUE_SIZE - 1)];
+        t.fn = s.fn.load(std::memory_order_relaxed);
+        t.arg = s.arg.load(std::memory_order_relaxed);
+    }
+
+    alignas(CACHE_LINE) std::atomic<int64_t> top{0};
+    alignas(CACHE_LINE) std::atomic<int64_t> bottom{0};
+    alignas(CACHE_LINE) Slot slots[DEQUE_SIZE];
+};
+
+// Bounded multi-producer multi-consumer queue for tasks coming from outside the pool
+// Each slot has a sequence number saying whose turn it is, so there is no lock
+// https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+class InjectQueue {
+public:
+    InjectQueue(){
+        for (size_t i = 0; i < INJECT_SIZE; ++i){
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool push(Task t){
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true){
+            Cell &c = cells[pos & (INJECT_SIZE - 1)];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0){
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                    c.task = t;
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0){
+                return false; // Full
+            }
+            else{
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(Task &t){
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (true){
+            Cell &c = cells[pos & (INJECT_SIZE - 1)];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0){
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                    t = c.task;
+                    c.seq.store(pos + INJECT_SIZE, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0){
+                return false; // Empty
+            }
+            else{
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_relaxed) >= tail.load(std::memory_order_relaxed);
+    }
+
+    // Rough count, only for stats
+    size_t size() const {
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_relaxed);
+        return t > h ? t - h : 0;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> seq;
+        Task task;
+    };
+
+    alignas(CACHE_LINE) std::atomic<size_t> head{0};
+    alignas(CACHE_LINE) std::atomic<size_t> tail{0};
+    alignas(CACHE_LINE) Cell cells[INJECT_SIZE];
+};
+
+// Worker thread pool
+// Outside threads (the event loop) submit into the injection queue, workers take a batch from
+// it into their own deque and idle workers steal from each other. A worker with nothing to do
+// spins a little before parking, and submitters only touch the condvar when someone is parked.
+class ThreadPool {
+public:
+    // Starts worker threads that will wait for tasks
+    ThreadPool(size_t n) : deques(n), inject(new InjectQueue()){
+        for (size_t i = 0; i < n; ++i) {
+            deques[i] = new WorkDeque();
+        }
+        for (size_t i = 0; i < n; ++i) {
+            workers.emplace_back([this, i] {this->worker_loop(i);});
+        }
+    }
+
+    // Deconstructor to shut down worker threads
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lk(park_mutex);
+            stop_flag.store(true);
+            ++epoch;
+        }
+        cv.notify_all();  // Notifies all workers
+        for (auto &t : workers){
+            // If thread stil running, wait before deconstruction
+            if (t.joinable()){
+                t.join();
+            }
+        }
+        for (auto *d : deques) delete d;
+        delete inject;
+    }
+
+    // Add task
+    // From a worker it goes on that worker's own deque, otherwise on the injection queue
+    void enqueue(Task task){
+        if (current_pool == this && deques[current_worker]->push(task)){
+            wake_one();
+            return;
+        }
+        // Full only under extreme load, wait for workers to make room
+        while (!inject->push(task)){
+            std::this_thread::yield();
+        }
+        wake_one();
+    }
+
+    // Tasks waiting, approximate
+    size_t queued() const {
+        size_t n = inject->size();
+        for (auto *d : deques) n += d->size();
+        return n;
+    }
+
+private:
+    // Worker thread's life loop
+    void worker_loop(size_t me){
+        current_pool = this;
+        current_worker = me;
+        Task task;
+        while (true){
+            int spins = 0;
+            while (!find_task(me, task)){
+                if (stop_flag.load(std::memory_order_relaxed)) return;
+                if (++spins < SPIN_ROUNDS){
+                    std::this_thread::yield();
+                    continue;
+                }
+                park(me);
+                spins = 0;
+            }
+            run(task);
+        }
+    }
+
+    // Own deque, then the injection queue, then other workers
+    bool find_task(size_t me, Task &task){
+        if (deques[me]->pop(task)) return true;
+        if (inject->pop(task)){
+            // Take a few more so other idle workers can steal them from us
+            Task extra;
+            for (int i = 1; i < INJECT_BATCH && inject->pop(extra); ++i){
+                if (!deques[me]->push(extra)){
+                    run(extra);
+                }
+            }
+            return true;
+        }
+        size_t n = deques.size();
+        for (size_t i = 1; i < n; ++i){
+            if (deques[(me + i) % n]->steal(task)) return true;
+        }
+        return false;
+    }
+
+    bool has_work() const {
+        if (!inject->empty()) return true;
+        for (auto *d : deques){
+            if (d->size() > 0) return true;
+        }
+        return false;
+    }
+
+    // Sleep until enqueue wakes us
+    void park(size_t){
+        std::unique_lock<std::mutex> lk(park_mutex);
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        uint64_t seen = epoch;
+        // Pairs with the fence in wake_one, either we see the task or they see us sleeping
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!has_work() && !stop_flag.load()){
+            cv.wait(lk, [&] { return epoch != seen; }); // Wait for task
+        }
+        sleepers.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Only pays for a futex wakeup when a worker is actually parked
+    void wake_one(){
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) == 0) return;
+        {
+            std::lock_guard<std::mutex> lk(park_mutex);
+            ++epoch;
+        }
+        cv.notify_one(); // Calls a worker thread for task
+    }
+
+    static void run(const Task &task){
+        try{
+            task.fn(task.arg); // Do task
+        }
+        catch (const std::exception &e){
+            std::cerr<<"Task exception: "<<e.what()<<"\n";
+        }
+    }
+
+    std::vector<std::thread> workers;  // Worker threads
+    std::vector<WorkDeque *> deques; // One per worker
+    InjectQueue *inject; // Tasks from outside the pool
+    std::mutex park_mutex; // Protect epoch
+    std::condition_variable cv; // Notifies parked worker threads
+    uint64_t epoch = 0; // Bumped on every wakeup
+    alignas(CACHE_LINE) std::atomic<int> sleepers{0}; // Parked workers
+    std::atomic<bool> stop_flag{false};  // Shutdown flag
+
+    static inline thread_local ThreadPool *current_pool = nullptr; // Pool the calling thread works for
+    static inline thread_local size_t current_worker = 0; // Its deque
+};
+
+#endif
@@ -0,0 +1,162 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Hierarchical timing wheel for connection deadlines
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define WHEEL_TICK_MS 10 // Resolution of every deadline
+#define WHEEL_BITS 6 // 64 slots per level
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 64^4 ticks, about 46 hours at 10ms
+
+// A timer lives inside whatever it times, nothing is allocated to arm one
+struct TimerNode {
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expires = 0; // Tick it fires on
+    uint8_t level = 0; // Where it's linked
+    uint8_t slot = 0;
+    bool armed = false;
+    void *owner = nullptr; // Handed back when it fires
+};
+
+// Timing wheel, Varghese & Lauck style
+// Level 0 has one slot per tick, each level above covers 64 times as much. A timer goes in
+// the lowest level whose range reaches its deadline and moves down a level each time the
+// level below wraps around, so schedule, cancel and firing are all O(1) no matter how many
+// connections are open. A bitmap per level finds the next non-empty slot for epoll_wait.
+// http://www.cs.columbia.edu/~nahum/w6998/papers/sosp87-timing-wheels.pdf
+class TimerWheel {
+public:
+    explicit TimerWheel(uint64_t now_ms) : current(now_ms / WHEEL_TICK_MS){}
+
+    // (Re)arm n to fire at deadline_ms
+    void schedule(TimerNode *n, uint64_t deadline_ms){
+        if (n->armed) cancel(n);
+        // Round up so a timer never fires early
+        n->expires = (deadline_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+        insert(n);
+        ++count;
+    }
+
+    void cancel(TimerNode *n){
+        if (!n->armed) return;
+        Slot &s = slots[n->level][n->slot];
+        if (n->prev) n->prev->next = n->next;
+        else s.head = n->next;
+        if (n->next) n->next->prev = n->prev;
+        if (!s.head) occupied[n->level] &= ~(1ull << n->slot);
+        n->prev = n->next = nullptr;
+        n->armed = false;
+        --count;
+    }
+
+    size_t size() const { return count; }
+
+    // Run the clock up to now, fire(owner) for every timer that expired
+    // Each timer is unlinked before fire sees it, so fire can free or re-arm it
+    template <typename F>
+    void advance(uint64_t now_ms, F fire){
+        uint64_t target = now_ms / WHEEL_TICK_MS;
+        while (current < target){
+            if (count == 0){
+                current = target; // Nothing to walk past
+                break;
+            }
+            ++current;
+            // Lower level wrapped, bring the next slot of the one above down
+            for (int level = 1; level < WHEEL_LEVELS; ++level){
+                if ((current & ((1ull << (WHEEL_BITS * level)) - 1)) != 0) break;
+                cascade(level, (current >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+            }
+            size_t idx = current & (WHEEL_SLOTS - 1);
+            Slot &s = slots[0][idx];
+            TimerNode *n = s.head;
+            s.head = nullptr;
+            occupied[0] &= ~(1ull << idx);
+            while (n){
+                TimerNode *next = n->next;
+                n->prev = n->next = nullptr;
+                n->armed = false;
+                --count;
+                fire(n->owner);
+                n = next;
+            }
+        }
+    }
+
+    // Milliseconds epoll can sleep before the wheel needs to move, -1 if nothing is armed
+    // Exact for level 0, a lower bound (the next cascade) above that
+    int next_timeout(uint64_t now_ms) const {
+        if (count == 0) return -1;
+        uint64_t ticks = WHEEL_SLOTS;
+        if (occupied[0]){
+            size_t from = (current + 1) & (WHEEL_SLOTS - 1);
+            uint64_t bits = rotate(occupied[0], from);
+            ticks = __builtin_ctzll(bits) + 1;
+        }
+        // Timers further out come down when level 0 wraps, that may be sooner
+        for (int level = 1; level < WHEEL_LEVELS; ++level){
+            if (!occupied[level]) continue;
+            uint64_t wrap = WHEEL_SLOTS - (current & (WHEEL_SLOTS - 1));
+            if (wrap < ticks) ticks = wrap;
+            break;
+        }
+        uint64_t due = (current + ticks) * WHEEL_TICK_MS;
+        return due > now_ms ? (int)(due - now_ms) : 0;
+    }
+
+private:
+    struct Slot { TimerNode *head = nullptr; };
+
+    static uint64_t rotate(uint64_t bits, size_t by){
+        return by ? (bits >> by) | (bits << (64 - by)) : bits;
+    }
+
+    void insert(TimerNode *n){
+        uint64_t expires = n->expires <= current ? current + 1 : n->expires;
+        uint64_t delta = expires - current;
+        int level = 0;
+        while (level < WHEEL_LEVELS - 1 && delta >= (1ull << (WHEEL_BITS * (level + 1)))){
+            ++level;
+        }
+        if (delta >= (1ull << (WHEEL_BITS * WHEEL_LEVELS))){
+            expires = current + (1ull << (WHEEL_BITS * WHEEL_LEVELS)) - 1; // Clamp, 46 hours is forever
+        }
+        size_t idx = (expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+        Slot &s = slots[level][idx];
+        n->level = (uint8_t)level;
+        n->slot = (uint8_t)idx;
+        n->prev = nullptr;
+        n->next = s.head;
+        if (s.head) s.head->prev = n;
+        s.head = n;
+        occupied[level] |= 1ull << idx;
+        n->armed = true;
+    }
+
+    // Move every timer in a slot down to where it belongs now
+    void cascade(int level, size_t idx){
+        Slot &s = slots[level][idx];
+        TimerNode *n = s.head;
+        s.head = nullptr;
+        occupied[level] &= ~(1ull << idx);
+        while (n){
+            TimerNode *next = n->next;
+            insert(n);
+            n = next;
+        }
+    }
+
+    Slot slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint64_t occupied[WHEEL_LEVELS] = {}; // Bit per non-empty slot
+    uint64_t current; // Ticks processed so far
+    size_t count = 0;
+};
+
+#endif
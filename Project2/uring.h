@@ -0,0 +1,315 @@
+// Allison Barricklow
+// CSCI 4245
+// Programming Assign 2
+// Small io_uring wrapper on the raw syscalls, just what the event loop needs
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// glibc has no wrappers for these
+static inline int sys_io_uring_setup(unsigned entries, struct io_uring_params *p){
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+static inline int sys_io_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags, void *arg, size_t argsz){
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+static inline int sys_io_uring_register(int fd, unsigned op, void *arg, unsigned nargs){
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+// Submission and completion rings shared with the kernel
+// SQEs are filled in place and handed over in one io_uring_enter that also waits for
+// completions, so a busy loop makes one syscall per batch no matter how much it did.
+// Only the thread that made it may use it.
+class Uring {
+public:
+    Uring() {}
+    Uring(const Uring &) = delete;
+    Uring &operator=(const Uring &) = delete;
+    ~Uring(){
+        if (sqes) munmap(sqes, sqes_len);
+        if (ring) munmap(ring, ring_len);
+        if (fd >= 0) close(fd);
+    }
+
+    // false if the kernel can't, errno says why (ENOSYS too old, EPERM turned off)
+    bool init(unsigned entries){
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        // One thread submits and reaps, so the kernel can skip waking us for task work
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                  IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        p.cq_entries = entries * 4; // Multishot ops post many completions per SQE
+        fd = sys_io_uring_setup(entries, &p);
+        if (fd < 0 && errno == EINVAL){
+            memset(&p, 0, sizeof(p));
+            p.flags = IORING_SETUP_CQSIZE;
+            p.cq_entries = entries * 4;
+            fd = sys_io_uring_setup(entries, &p);
+        }
+        if (fd < 0) return false;
+        unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_SUBMIT_STABLE;
+        if ((p.features & need) != need){
+            errno = ENOSYS;
+            return false;
+        }
+        ring_len = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                            p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+        void *r = mmap(nullptr, ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (r == MAP_FAILED) return false;
+        ring = (char *)r;
+        sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+        void *s = mmap(nullptr, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (s == MAP_FAILED) return false;
+        sqes = (struct io_uring_sqe *)s;
+
+        sq_head = (unsigned *)(ring + p.sq_off.head);
+        sq_tail = (unsigned *)(ring + p.sq_off.tail);
+        sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+        sq_entries = p.sq_entries;
+        cq_head = (unsigned *)(ring + p.cq_off.head);
+        cq_tail = (unsigned *)(ring + p.cq_off.tail);
+        cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+        // SQE i always goes in slot i
+        unsigned *array = (unsigned *)(ring + p.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; ++i) array[i] = i;
+        tail = *sq_tail;
+        return true;
+    }
+
+    int ring_fd() const { return fd; }
+
+    // Make sure the next n sqe() calls don't submit, linked SQEs have to go in together
+    void make_room(unsigned n){
+        while (tail + n - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_entries){
+            enter(0, 0);
+        }
+    }
+
+    // Next SQE, zeroed, submitting what's queued first if the ring is full
+    struct io_uring_sqe *sqe(){
+        make_room(1);
+        struct io_uring_sqe *e = &sqes[tail & sq_mask];
+        memset(e, 0, sizeof(*e));
+        ++tail;
+        return e;
+    }
+
+    // Submit everything queued and sleep until something completes or timeout_ms passes
+    // -1 waits forever. Doesn't sleep at all if completions are already waiting.
+    int wait(int timeout_ms){
+        bool ready = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE) != *cq_head;
+        return enter(ready ? 0 : 1, timeout_ms);
+    }
+
+    // fn(cqe) for every completion waiting
+    template <typename F>
+    void reap(F fn){
+        unsigned head = *cq_head;
+        unsigned end = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != end){
+            fn(cqes[head & cq_mask]);
+            ++head;
+            // Let the kernel reuse the slot now, fn may have queued enough to fill the ring
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            if (head == end) end = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    // Pin memory once so sends from it skip mapping the pages every time, index i is iov[i]
+    bool register_buffers(const struct iovec *iov, unsigned n){
+        return sys_io_uring_register(fd, IORING_REGISTER_BUFFERS, (void *)iov, n) == 0;
+    }
+
+private:
+    int enter(unsigned wait_nr, int timeout_ms){
+        unsigned submit = tail - *sq_tail;
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        if (wait_nr && timeout_ms >= 0){
+            ts.tv_sec = timeout_ms / 1000;
+            ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+        return sys_io_uring_enter(fd, submit, wait_nr, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+
+    int fd = -1;
+    char *ring = nullptr;
+    size_t ring_len = 0;
+    struct io_uring_sqe *sqes = nullptr;
+    size_t sqes_len = 0;
+    unsigned *sq_head = nullptr;
+    unsigned *sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned tail = 0; // SQEs filled, handed to the kernel on the next enter
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    struct io_uring_cqe *cqes = nullptr;
+};
+
+// Provided buffers for multishot recv
+// The kernel picks a buffer when data arrives instead of each connection holding one while
+// it waits, so memory follows the traffic and not the number of open sockets.
+// They go in a registered buffer ring: handing one back is a store to the ring's tail, no
+// SQE and no syscall. Kernels older than 5.19 don't take the registration (EINVAL), and some
+// take it but never hand a buffer out (a test recv gets ENOBUFS). Both get the same buffers
+// through PROVIDE_BUFFERS instead, one SQE per hand-back.
+class BufferGroup {
+public:
+    BufferGroup() {}
+    BufferGroup(const BufferGroup &) = delete;
+    BufferGroup &operator=(const BufferGroup &) = delete;
+    ~BufferGroup(){
+        unregister_ring();
+        if (base) munmap(base, (size_t)count * size);
+    }
+
+    // count buffers of size bytes under group, count a power of two for the ring
+    // PROVIDE_BUFFERS failures complete with tag
+    bool init(Uring &uring, uint16_t group_id, unsigned n, unsigned bytes, uint64_t tag){
+        group = group_id;
+        count = n;
+        size = bytes;
+        user_data = tag;
+        void *b = mmap(nullptr, (size_t)count * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b == MAP_FAILED) return false;
+        base = (char *)b;
+        if (register_ring(uring)){
+            for (unsigned bid = 0; bid < count; ++bid) push(bid);
+            publish();
+            if (ring_works(uring)) return true;
+            unregister_ring();
+        }
+        else if (errno != EINVAL){
+            return false;
+        }
+        provide(uring, 0, count);
+        return true;
+    }
+
+    uint16_t id() const { return group; }
+    char *buffer(uint16_t bid) const { return base + (size_t)bid * size; }
+
+    // Done with bid, the kernel can pick it again right away with the ring, after the next
+    // submit without
+    void give_back(Uring &uring, uint16_t bid){
+        if (ring){
+            push(bid);
+            publish();
+        }
+        else{
+            provide(uring, bid, 1);
+        }
+    }
+
+private:
+    size_t ring_len() const { return (size_t)count * sizeof(struct io_uring_buf); }
+
+    bool register_ring(Uring &uring){
+        void *r = mmap(nullptr, ring_len(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (r == MAP_FAILED) return false;
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)r;
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if (sys_io_uring_register(uring.ring_fd(), IORING_REGISTER_PBUF_RING, &reg, 1) != 0){
+            int err = errno;
+            munmap(r, ring_len());
+            errno = err;
+            return false;
+        }
+        ring = (struct io_uring_buf_ring *)r;
+        ring_fd = uring.ring_fd();
+        return true;
+    }
+
+    void unregister_ring(){
+        if (!ring) return;
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.bgid = group;
+        sys_io_uring_register(ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        munmap(ring, ring_len());
+        ring = nullptr;
+    }
+
+    // One recv from the ring on a socketpair before anything else is on the uring
+    // The buffer it took goes right back
+    bool ring_works(Uring &uring){
+        int sv[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return false;
+        int res = -ENOBUFS;
+        if (write(sv[1], "x", 1) == 1){
+            struct io_uring_sqe *e = uring.sqe();
+            e->opcode = IORING_OP_RECV;
+            e->fd = sv[0];
+            e->flags = IOSQE_BUFFER_SELECT;
+            e->buf_group = group;
+            e->user_data = user_data;
+            uring.wait(1000);
+            uring.reap([&](const struct io_uring_cqe &cqe){
+                res = cqe.res;
+                if (cqe.flags & IORING_CQE_F_BUFFER){
+                    push(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                    publish();
+                }
+            });
+        }
+        close(sv[0]);
+        close(sv[1]);
+        return res == 1;
+    }
+
+    // Slot for bid at the tail, the kernel doesn't see it until publish
+    void push(uint16_t bid){
+        struct io_uring_buf *e = &ring->bufs[tail & (count - 1)];
+        // Field by field, the ring's tail is the resv of slot 0 and must not be written over
+        e->addr = (uint64_t)(uintptr_t)buffer(bid);
+        e->len = size;
+        e->bid = bid;
+        ++tail;
+    }
+    void publish(){ __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE); }
+
+    void provide(Uring &uring, uint16_t bid, unsigned n){
+        struct io_uring_sqe *e = uring.sqe();
+        e->opcode = IORING_OP_PROVIDE_BUFFERS;
+        e->fd = (int)n;
+        e->addr = (uint64_t)(uintptr_t)buffer(bid);
+        e->len = size;
+        e->buf_group = group;
+        e->off = bid;
+        e->flags = IOSQE_CQE_SKIP_SUCCESS;
+        e->user_data = user_data;
+    }
+
+    char *base = nullptr;
+    unsigned count = 0;
+    unsigned size = 0;
+    uint16_t group = 0;
+    uint64_t user_data = 0;
+    struct io_uring_buf_ring *ring = nullptr; // Null when it's PROVIDE_BUFFERS
+    int ring_fd = -1;
+    uint16_t tail = 0; // Ours, published to ring->tail
+};
+
+#endif